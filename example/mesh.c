@@ -23,6 +23,14 @@ typedef struct {
     u32 model;
 } Object;
 
+#define BUNNY_COUNT 100
+typedef struct {
+    f32 pos[BUNNY_COUNT][3];
+    f32 size[BUNNY_COUNT][3];
+    f32 rot[BUNNY_COUNT][3];
+    u32 model;
+} Bunnies;
+
 static Object sun;
 static u32 sunlight;
 
@@ -66,19 +74,17 @@ void GAME_HandleInput(Camera* camera) {
 //    camera->rotation[0] -= mouse_delta[1]*sensitivity;
 }
 
-void GAME_BunniesInit(Object bunnies[], u32 count) {
+void GAME_BunniesInit(Bunnies* bunnies, u32 count) {
+    bunnies->model = model_bunny;
     for (u32 i = 0; i < count; i++) {
-	bunnies[i].model = model_bunny;
-	VM3_Set(bunnies[i].size, 0.5f, 0.5f, 0.5f);
-	VM3_Set(bunnies[i].pos,  i%(u32)sqrt(count), -0.5f, i/(u32)sqrt(count)  );
-	VM3_Set(bunnies[i].rot, 0, 0, 0);
+	VM3_Set(bunnies->size[i], 0.5f, 0.5f, 0.5f);
+	VM3_Set(bunnies->pos[i],  i%(u32)sqrt(count), -0.5f, i/(u32)sqrt(count)  );
+	VM3_Set(bunnies->rot[i], 0, 0, 0);
     }
 }
 
-void GAME_BunniesDraw(Object bunnies[], u32 count) {
-    for (u32 i = 0; i < count; i++) {
-	VG_ModelDrawAt(bunnies[i].model, bunnies[i].pos, bunnies[i].rot, bunnies[i].size);
-    }
+void GAME_BunniesDraw(Bunnies* bunnies, u32 count) {
+    VG_ModelDrawBatch(bunnies->model, count, bunnies->pos, bunnies->rot, bunnies->size);
 }
 
 
@@ -110,8 +116,11 @@ int main() {
     VG_BackgroundColorSet(VRGBA_BLACK);
     VG_VSyncSet(false);
 //    VG_FPSMaxSet(60);
+    VG_ShaderCacheDirSet("build/shader_cache");
     shader_light = VG_ShaderLoad("shaders/shader.vert", "shaders/light.frag");
-    shader_default = VG_ShaderLoad("shaders/shader.vert", "shaders/shader.frag");
+    // compiles while the meshes load, drawn as shader_light until then
+    VG_ShaderDefaultSet(shader_light);
+    shader_default = VG_ShaderLoadAsync("shaders/shader.vert", "shaders/shader.frag", NULL);
 
     texture_default = VG_TextureNew("include/vtex/textures/default.ppm");
     u32 texture_bunny = VG_TextureNew("include/vtex/textures/input.ppm");
@@ -120,6 +129,7 @@ int main() {
     model_teapot = VG_ModelNew("models/teapot.obj", 0, shader_light);
     model_bunny =  VG_ModelNew("models/bunny_textured.obj", texture_bunny, shader_default);
     model_floor =  VG_ModelNew("models/floor.obj", 0, shader_default);
+    VG_ModelOccluderSet(model_floor, true);
 
     flashlight = VG_FlashLightCreate();
     
@@ -133,9 +143,8 @@ int main() {
     VM3_Copy(direct_light->color, VRGB_YELLOW);
     VM3_Set(direct_light->direction, 0, 1, 0);
     
-    const u32 BUNNYC = 100;
-    Object bunnies[BUNNYC];
-    GAME_BunniesInit(bunnies, BUNNYC);
+    static Bunnies bunnies;
+    GAME_BunniesInit(&bunnies, BUNNY_COUNT);
 
     VG_BackgroundColorSet(VRGBA_BLACK);
 
@@ -156,7 +165,7 @@ int main() {
 
 
 	VG_ModelDrawAt(sun.model, sun.pos, sun.rot, sun.size);
-	GAME_BunniesDraw(bunnies, BUNNYC);
+	GAME_BunniesDraw(&bunnies, BUNNY_COUNT);
 	VG_ModelDrawAt(model_floor, (f32[]){0,-0.5,0}, (f32[]){0,0,0}, (f32[]){1, 1, 1});
 	
 	VG_DrawingEnd();
@@ -0,0 +1,62 @@
+#define _VMATH_IMPLEMENTATION_
+#define _VCOLOR_IMPLEMENTATION_
+#include "../vgfx.h"
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define RUNS 5
+
+static float size[2] = {320.f, 180.f};
+
+static f64 TimeGet() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+// Parses every models/*.obj RUNS times and reports the best run.
+// make objbench MODE=-O3 gives numbers worth comparing
+int main() {
+    // the importer runs on the job pool, which comes with the window
+    VG_WindowOpen("Example: OBJ Benchmark", size, 0);
+    
+    DIR* models = opendir("models");
+    if (!models) {
+	printf("Run from the repository root\n");
+	return 1;
+    }
+    printf("%-28s %10s %9s %9s %10s\n", "file", "bytes", "vertices", "indices", "MB/s");
+    f64 bytes_total = 0, time_total = 0;
+    struct dirent* entry;
+    while ((entry = readdir(models))) {
+	u32 length = strlen(entry->d_name);
+	if (length < 4 || strcmp(entry->d_name + length - 4, ".obj")) continue;
+	char path[512];
+	snprintf(path, sizeof(path), "models/%s", entry->d_name);
+	struct stat info;
+	if (stat(path, &info) != 0) continue;
+	
+	f64 best = 1e30;
+	u32 vertex_count = 0, index_count = 0;
+	for (u32 run = 0; run < RUNS; run++) {
+	    f64 start = TimeGet();
+	    if (!VG_ObjParse(path, &vertex_count, &index_count)) {
+		printf("%s: could not parse\n", path);
+		break;
+	    }
+	    f64 time = TimeGet() - start;
+	    if (time < best) best = time;
+	}
+	printf("%-28s %10ld %9u %9u %10.1f\n", entry->d_name, (long)info.st_size,
+	       vertex_count, index_count, info.st_size/best/1e6);
+	bytes_total += info.st_size;
+	time_total += best;
+    }
+    closedir(models);
+    if (time_total > 0) printf("%-28s %10.0f %30.1f\n", "total", bytes_total, bytes_total/time_total/1e6);
+    
+    VG_WindowClose();
+}
@@ -6,7 +6,15 @@ struct Material {
 
 uniform Material material;
 
+#if defined(VG_GEOMETRY_POOL)
+flat in vec3 bColor;
+#endif
+
 void main()
 {
+#if defined(VG_GEOMETRY_POOL)
+    FragColor = vec4(bColor, 1.0);
+#else
     FragColor = vec4(material.color, 1.0);
+#endif
 }
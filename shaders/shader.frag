@@ -1,10 +1,17 @@
-#version 330 core
+#version 430 core
 out vec4 FragColor;
 in vec3 bNormal;
 in vec3 bPos;
 in vec2 bTex;
 
-uniform vec3 cameraPos;
+layout(std140, row_major) uniform FrameData {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec3 cameraPos;
+    float time;
+    vec2 viewport;
+};
 uniform sampler2D main_texture;
 
 struct DirectLight {
@@ -12,15 +19,13 @@ struct DirectLight {
     vec3 color;
 };
 
-struct PointLight {
+// A point light, or a flash light when flash is 1
+struct Light {
     vec3 position;
+    float range;
     vec3 color;
-};
-
-struct FlashLight {
-    vec3 position;
+    float flash;
     vec3 direction;
-    vec3 color;
     float angle;
     float cutoff;
 };
@@ -29,12 +34,43 @@ struct Material {
     vec3 color;
 };
 
-#define DIRECT_LIGHT_COUNT 8
-uniform DirectLight directLights[DIRECT_LIGHT_COUNT];
-#define POINT_LIGHT_COUNT 8
-uniform PointLight pointLights[POINT_LIGHT_COUNT];
-#define FLASH_LIGHT_COUNT 2
-uniform FlashLight flashLights[FLASH_LIGHT_COUNT];
+// Written by vgfx once a frame and shared by every program
+layout(std140) uniform Lights {
+    int directLightCount;
+    // lights without a range come first and shade every fragment
+    int globalLightCount;
+    uvec4 clusterGrid;
+    vec4 clusterDepth;
+};
+
+layout(std430, binding = 5) readonly buffer DirectLightData {
+    DirectLight directLights[];
+};
+layout(std430, binding = 2) readonly buffer LightData {
+    Light lights[];
+};
+// first light index and count of every cluster
+layout(std430, binding = 3) readonly buffer ClusterData {
+    uvec2 clusters[];
+};
+layout(std430, binding = 4) readonly buffer ClusterLightData {
+    uint clusterLights[];
+};
+
+// vgfx builds variants for the lights in use, the loops then have constant bounds
+#ifdef VG_DIRECT_LIGHTS
+#define DIRECT_LIGHTS VG_DIRECT_LIGHTS
+#else
+#define DIRECT_LIGHTS directLightCount
+#endif
+#ifdef VG_GLOBAL_LIGHTS
+#define GLOBAL_LIGHTS VG_GLOBAL_LIGHTS
+#else
+#define GLOBAL_LIGHTS globalLightCount
+#endif
+#ifndef VG_CLUSTERED_LIGHTS
+#define VG_CLUSTERED_LIGHTS 1
+#endif
 
 uniform Material material;
 
@@ -46,41 +82,46 @@ vec3 DirectLightCalculate(int i, vec3 normal) {
     return max(vec3(0.0), factor*directLights[i].color);
 }
 
-vec3 PointLightCalculate(int i, vec3 position, vec3 normal) {
-    vec3 to = pointLights[i].position - position;    
+vec3 LightCalculate(uint i, vec3 position, vec3 normal) {
+    Light light = lights[i];
+    vec3 to = light.position - position;
     vec3 direction = normalize(to);
     float dist = length(to);
-    float attenuation = 1.0 / (1.0 + 0.1 * dist + 0.01 * dist * dist);
-    float factor = dot(normal, direction)*attenuation;
-    
-    vec3 viewDir = normalize(cameraPos - position);
-    vec3 reflectDir = reflect(-direction, normal);
-    float spec = pow(max(dot(viewDir, reflectDir), 0.0), specularPower);
-    float specular = specularStrength * spec;
     
-    return max(vec3(0.0), (factor+specular)*pointLights[i].color);
-}
-
-vec3 FlashLightCalculate(int i, vec3 position, vec3 normal) {
-    vec3 to = flashLights[i].position - position;
-    
-    vec3 direction = normalize(to);
-    float theta = dot(direction, -normalize(flashLights[i].direction));
-    float inner_edge = cos(flashLights[i].angle);
-    float outer_edge = cos(flashLights[i].angle + flashLights[i].cutoff);
-    float epsilon = inner_edge - outer_edge;
-    float intensity = clamp((theta - outer_edge)/epsilon, 0.0, 1.0);
+    float intensity = 1.0;
+    float quadratic = 0.01;
+    if (light.flash > 0.5) {
+	float theta = dot(direction, -normalize(light.direction));
+	float inner_edge = cos(light.angle);
+	float outer_edge = cos(light.angle + light.cutoff);
+	intensity = clamp((theta - outer_edge)/(inner_edge - outer_edge), 0.0, 1.0);
+	quadratic = 0.1;
+    }
+    float attenuation = 1.0 / (1.0 + 0.1 * dist + quadratic * dist * dist);
+    // reaches zero at the range so the light never leaves its clusters
+    float window = 1.0;
+    if (light.range > 0.0) {
+	float ratio = dist/light.range;
+	window = clamp(1.0 - ratio*ratio*ratio*ratio, 0.0, 1.0);
+	window *= window;
+    }
     
-    float dist = length(to);
-    float attenuation = 1.0 / (1.0 + 0.1 * dist + 0.1 * dist * dist);
-
     vec3 viewDir = normalize(cameraPos - position);
     vec3 reflectDir = reflect(-direction, normal);
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), specularPower);
     float specular = specularStrength * spec*intensity;
     
     float factor = dot(normal, direction)*attenuation*intensity;
-    return max(vec3(0.0), (factor+specular)*flashLights[i].color);
+    return max(vec3(0.0), (factor+specular)*window*light.color);
+}
+
+uint ClusterIndexGet(vec3 position) {
+    vec2 screen = clamp(gl_FragCoord.xy/viewport, 0.0, 0.999);
+    uvec2 tile = uvec2(screen*vec2(clusterGrid.xy));
+    float depth = -(view*vec4(position, 1.0)).z;
+    float slice = log(max(depth, 1e-4))*clusterDepth.x + clusterDepth.y;
+    uint z = uint(clamp(slice, 0.0, float(clusterGrid.z - 1u)));
+    return tile.x + clusterGrid.x*(tile.y + clusterGrid.y*z);
 }
 
 void main()
@@ -89,15 +130,18 @@ void main()
     vec3 normal = normalize(bNormal);
     vec3 result = vec3(0.0);
 
-    for (int i = 0; i < DIRECT_LIGHT_COUNT; i++) {
+    for (int i = 0; i < DIRECT_LIGHTS; i++) {
 	result += DirectLightCalculate(i, normal);
     }
-    for (int i = 0; i < POINT_LIGHT_COUNT; i++) {
-	result += PointLightCalculate(i, position, normal);
+    for (int i = 0; i < GLOBAL_LIGHTS; i++) {
+	result += LightCalculate(uint(i), position, normal);
     }
-    for (int i = 0; i < FLASH_LIGHT_COUNT; i++) {
-	result += FlashLightCalculate(i, position, normal);
+#if VG_CLUSTERED_LIGHTS
+    uvec2 cluster = clusters[ClusterIndexGet(position)];
+    for (uint i = 0u; i < cluster.y; i++) {
+	result += LightCalculate(clusterLights[cluster.x + i], position, normal);
     }
+#endif
 
     FragColor = vec4(result, 1.0);
     FragColor *= texture(main_texture, bTex);
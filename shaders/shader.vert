@@ -2,19 +2,95 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTex;
+#if defined(VG_INSTANCE_TRS)
+layout (location = 3) in vec3 aInstancePosition;
+layout (location = 4) in vec3 aInstanceSize;
+layout (location = 5) in vec4 aInstanceRotation;
+#elif defined(VG_INSTANCE_AFFINE)
+layout (location = 3) in vec4 aInstanceRow0;
+layout (location = 4) in vec4 aInstanceRow1;
+layout (location = 5) in vec4 aInstanceRow2;
+layout (location = 6) in vec3 aInstanceNormalScale;
+#else
 layout (location = 3) in mat4 aInstance;
+layout (location = 7) in vec3 aInstanceNormalScale;
+#endif
 
-uniform mat4 view;
-uniform mat4 projection;
+// Written by vgfx once a frame and shared by every program
+layout(std140, row_major) uniform FrameData {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    vec3 cameraPos;
+    float time;
+    vec2 viewport;
+};
+
+#if defined(VG_GEOMETRY_POOL)
+// Model colors of a multi draw, one per command
+uniform vec3 drawColors[VG_DRAW_COLORS];
+flat out vec3 bColor;
+#endif
+
+#if defined(VG_QUANTIZED_VERTICES) && defined(VG_GEOMETRY_POOL)
+uniform vec4 drawPositionDequantize[VG_DRAW_COLORS];
+#elif defined(VG_QUANTIZED_VERTICES)
+// aPos is a fraction of the model bounds, xyz is their center and w half their size
+uniform vec4 positionDequantize;
+#endif
 
 out vec3 bNormal;
 out vec3 bPos;
 out vec2 bTex;
 
+// Instance matrix split in its 3x3 part and translation. The normal matrix
+// is never inverted: it is the 3x3 part with its rows scaled by normalScale.
+void InstanceGet(out mat3 linear, out vec3 translation, out vec3 normal)
+{
+#if defined(VG_INSTANCE_TRS)
+    vec4 q = normalize(aInstanceRotation);
+    vec3 q2 = 2.0*q.xyz;
+    vec3 qq = q.xyz*q2;
+    float xy = q.x*q2.y, xz = q.x*q2.z, yz = q.y*q2.z;
+    float wx = q.w*q2.x, wy = q.w*q2.y, wz = q.w*q2.z;
+    mat3 rotation = mat3(1.0 - qq.y - qq.z, xy + wz, xz - wy,
+                         xy - wz, 1.0 - qq.x - qq.z, yz + wx,
+                         xz + wy, yz - wx, 1.0 - qq.x - qq.y);
+    linear = mat3(aInstanceSize*rotation[0], aInstanceSize*rotation[1], aInstanceSize*rotation[2]);
+    translation = aInstancePosition;
+    // a flattened axis counts as the largest of the others, like on the CPU
+    vec3 size = abs(aInstanceSize);
+    float largest = max(size.x, max(size.y, size.z));
+    vec3 divisor = mix(aInstanceSize, vec3(largest > 0.0 ? largest : 1.0), equal(aInstanceSize, vec3(0.0)));
+    normal = (rotation*aNormal)/divisor;
+#elif defined(VG_INSTANCE_AFFINE)
+    linear = transpose(mat3(aInstanceRow0.xyz, aInstanceRow1.xyz, aInstanceRow2.xyz));
+    translation = vec3(aInstanceRow0.w, aInstanceRow1.w, aInstanceRow2.w);
+    normal = aInstanceNormalScale*(linear*aNormal);
+#else
+    linear = mat3(aInstance);
+    translation = aInstance[3].xyz;
+    normal = aInstanceNormalScale*(linear*aNormal);
+#endif
+}
+
 void main()
 {
-    bPos = (aInstance*vec4(aPos, 1.0)).xyz;
-    bNormal = mat3(transpose(inverse(aInstance))) * aNormal;
+    mat3 linear;
+    vec3 translation;
+    InstanceGet(linear, translation, bNormal);
+#if defined(VG_QUANTIZED_VERTICES) && defined(VG_GEOMETRY_POOL)
+    vec4 dequantize = drawPositionDequantize[gl_DrawIDARB];
+    vec3 position = dequantize.xyz + dequantize.w*aPos;
+#elif defined(VG_QUANTIZED_VERTICES)
+    vec3 position = positionDequantize.xyz + positionDequantize.w*aPos;
+#else
+    vec3 position = aPos;
+#endif
+    bPos = linear*position + translation;
     bTex = aTex;
-    gl_Position = projection*view*aInstance*vec4(aPos, 1.0);
+#if defined(VG_GEOMETRY_POOL)
+    bColor = drawColors[gl_DrawIDARB];
+#endif
+    gl_Position = viewProjection*vec4(bPos, 1.0);
 }
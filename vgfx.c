@@ -9,12 +9,27 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
+#include <float.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
 #define ARRLEN(x) ((sizeof(x))/(sizeof(x[0])))
 
 #if 1
 #define iVG_Log(a) printf(a "\n")
+#define iVG_Logf(a, ...) printf(a "\n", __VA_ARGS__)
 #else
 #define iVG_Log(a)
+#define iVG_Logf(a, ...)
 #endif
 
 static GLFWwindow *window = NULL;
@@ -24,14 +39,21 @@ static f64 time_current;
 static f64 time_previous;
 static b8 vsync;
 static f64 time_delta_target;
-static u32 shader_current;
 static u32 texture_default;
 static u32 texture_current;
+static u32 instance_shrink_frames = 120;
+static b8  frustum_culling = true;
 
 static Camera camera;
 
 static f32 matrix_view[16];
 static f32 matrix_projection[16];
+#define PROJECTION_NEAR 0.1f
+#define PROJECTION_FAR 100.0f
+static f32 matrix_view_projection[4][4];
+// Planes of matrix_projection * matrix_view laid out for SIMD: x, y, z and w
+// of each plane in their own row, two always passing planes pad it to eight
+static f32 frustum_planes[4][8];
 
 static b8  mouse_first = true;
 static f32 mouse_last[2];
@@ -46,15 +68,15 @@ const u32 normals = 3;
 const u32 uvs = 2;
 const u32 vert_size = dims + normals + uvs;
 
-#define POINT_LIGHT_MAX_COUNT  8
-#define DIRECT_LIGHT_MAX_COUNT 8
-#define FLASH_LIGHT_MAX_COUNT  2
-PointLight  pointLights[POINT_LIGHT_MAX_COUNT];
-DirectLight directLights[DIRECT_LIGHT_MAX_COUNT];
-FlashLight  flashLights[FLASH_LIGHT_MAX_COUNT];
+DirectLight* directLights = NULL;
+PointLight* pointLights = NULL;
+FlashLight* flashLights = NULL;
 u32 pointLightCount = 0;
+u32 pointLightCapacity = 0;
 u32 directLightCount = 0;
+u32 directLightCapacity = 0;
 u32 flashLightCount = 0;
+u32 flashLightCapacity = 0;
 
 void iVG_RenderFlush();
 void iVG_KeysUpdate();
@@ -67,27 +89,428 @@ void iVG_PollEvents();
 b8 iVG_TimeDeltaTargetReached();
 
 char* iVG_FileLoadToString(const char* path);
+void  iVG_GLShaderSourceSet(u32 shader, const char* source, const char* defines);
+
+
+// Instance records as they sit in GPU memory, only one format is used
+// at a time and it is picked in VG_WindowOpen
+typedef enum {
+    INSTANCE_FORMAT_MAT4,
+    INSTANCE_FORMAT_AFFINE,
+    INSTANCE_FORMAT_TRS,
+} InstanceFormat;
 
+// Normals go through the instance matrix with every row multiplied by
+// normal_scale, which is 1/size^2 up to a constant. For translate * scale * rotate
+// that is the inverse transpose, so the vertex shader never inverts anything.
 
+// Full matrix, transposed, with its bottom row kept at 0 0 0 1
 typedef struct {
     f32 transform[16];
-} InstanceData;
+    f32 normal_scale[3];
+} InstanceMat4;
 
+// Top three rows
 typedef struct {
-    u32 VAO;
+    f32 rows[12];
+    f32 normal_scale[3];
+} InstanceAffine;
+
+// Rotation is a snorm16 quaternion, rebuilt into a matrix by the vertex shader
+typedef struct {
+    f32 position[3];
+    f32 size[3];
+    int16_t rotation[4];
+} InstanceTRS;
+
+static InstanceFormat instance_format = INSTANCE_FORMAT_MAT4;
+static u32 instance_stride = sizeof(InstanceMat4);
+
+// A contiguous range of the current instance ring region owned by one model
+typedef struct {
+    u32 first;
+    u32 count;
+    u32 capacity;
+} InstanceRun;
+
+// MESH LOD
+// Coarser index buffers over the same vertices, built by collapsing edges
+// in order of their quadric error. Each level aims at half the triangles of
+// the one before and instances take the coarsest level their projected size
+// allows, halving the size threshold for every level.
+#define MODEL_LOD_MAX 4
+#define LOD_SCREEN_SIZE 0.25f
+#define MESH_LOD_ERROR_MAX 0.05f
+
+// One level of a model with the instances drawn with it this frame
+typedef struct {
+    u32 first_index;
     u32 index_count;
+    
+    u32 instance_count;
+    u32 instance_capacity;
+    u32 instance_high_water;
+    u32 instance_frames_under;
+    InstanceRun *runs;
+    u32 run_count;
+    u32 run_capacity;
+} ModelLod;
+
+typedef struct {
+    u32 VAO;
+    int32_t base_vertex;
     u32 shader;
     f32 color[3];
     u32 texture;
     
-    u32 instance_count;
-    u32 instance_capacity;
-    u32 instance_vbo;
-    u32 instance_vbo_capacity;
-    InstanceData *instances;
+    f32 aabb_min[3];
+    f32 aabb_max[3];
+    f32 sphere_center[3];
+    f32 sphere_radius;
+    
+    ModelLod lods[MODEL_LOD_MAX];
+    u32 lod_count;
+    u32 instances_culled;
+    u32 object_count;
+    u32 objects_drawn;
+    f32 depth_nearest;
+    u32 stats_visible;
+    u32 stats_culled;
+    // of LOD 0 as imported and as uploaded
+    f32 acmr[2];
+    f32 atvr[2];
+    // center and half size of the cube quantized positions are fractions of
+    f32 position_dequantize[4];
+    u32 index_size;
+    
+    u32 static_instances;
+    
+    // welded positions of LOD 0, rasterized when the model is an occluder
+    b8 occluder;
+    f32 (*occluder_positions)[3];
+    u32 occluder_position_count;
+    u32* occluder_indices;
+    u32 occluder_index_count;
+    
+    // transforms given this frame, turned into instances at VG_DrawingEnd
+    f32 (*pending_pos)[3];
+    f32 (*pending_rotation)[3];
+    f32 (*pending_size)[3];
+    u32 pending_count;
+    u32 pending_capacity;
 } Model;
 
 void iVG_ModelInstancesClear(Model* model);
+void* iVG_ModelInstancesPush(Model* model, u32 lod, u32 count);
+void  iVG_ModelInstancesPop(Model* model, u32 lod, u32 count);
+void  iVG_ModelInstancesSkip(Model* model, u32 lod, u32 count);
+u32   iVG_ModelInstanceCountGet(Model* model);
+void  iVG_ModelPendingPush(Model* model, u32 count, f32 pos[][3], f32 rotation[][3], f32 size[][3]);
+void  iVG_ModelBoundsCompute(Model* model, Mesh* mesh);
+void  iVG_ModelOccluderMeshBuild(Model* model, Mesh* mesh);
+void  iVG_ModelMeshImport(Model* model, const char* path, const char* cache_path);
+void  iVG_ModelGeometryUpload(Model* model, void* vertices, u32 vertex_count, void* indices,
+			      u32 lod_count, u32* index_counts);
+void  iVG_ModelGeometryReserve(Model* model, u32 vertex_count, u32 lod_count, u32* index_counts,
+			       u32 buffers[2], u64 offsets[2]);
+void iVG_ModelInstancesTrim(Model* model);
+void iVG_ModelInstancesFree(Model* model);
+
+static f32 lod_bias;
+static f32 lod_scale = 1;
+
+// a2 ab ac ad b2 bc bd c2 cd d2 of the summed squared plane distances
+typedef struct {
+    f64 q[10];
+} Quadric;
+
+// Moving vertex from onto the position of vertex to
+typedef struct {
+    u32 from;
+    u32 to;
+    f32 cost;
+} LodCollapse;
+
+u32* iVG_MeshLodsBuild(Mesh* mesh, u32* lod_count, u32 index_counts[MODEL_LOD_MAX]);
+
+// MESH OPTIMIZATION
+// Imported triangles are reordered for the post-transform vertex cache with
+// Tipsify, which fans around vertices likely still in the cache. Its order
+// is then cut into clusters that miss the cache barely more often than the
+// whole, and clusters facing away from the middle of the mesh are drawn
+// first so early-Z rejects more of what lies behind them. Vertices last
+// get renumbered in the order the indices first use them. ACMR and ATVR,
+// misses per triangle and per vertex, are measured in a FIFO cache.
+#define VERTEX_CACHE_SIZE 16
+#define MESH_OVERDRAW_THRESHOLD 1.05f
+
+typedef struct {
+    f32 key;
+    u32 cluster;
+} MeshCluster;
+
+static b8 mesh_optimization = true;
+
+void iVG_MeshOptimize(Model* model, Mesh* mesh, u32* indices, u32 lod_count, u32* index_counts);
+void iVG_MeshTrianglesOptimize(Mesh* mesh, u32* indices, u32 index_count, u32* timestamps);
+void iVG_MeshTipsify(u32* indices, u32 triangle_count, u32 vertex_count, u32* timestamps, u32* out);
+u32  iVG_MeshHardBoundariesFind(u32* indices, u32 triangle_count, u32 vertex_count, u32* timestamps, u32* out);
+u32  iVG_MeshSoftBoundariesFind(u32* indices, u32* hard, u32 hard_count, u32 vertex_count, u32* timestamps,
+				u32* out);
+int  iVG_MeshClusterCompare(const void* a, const void* b);
+void iVG_MeshFetchOptimize(Mesh* mesh, u32* indices, u32 index_count);
+u32  iVG_VertexCacheMisses(u32* triangle, u32* timestamps, u32* time);
+void iVG_VertexCacheStatsGet(u32* indices, u32 index_count, u32 vertex_count, u32* timestamps,
+			     f32* acmr, f32* atvr);
+
+// VERTEX QUANTIZATION
+// With VG_WINDOW_FLAG_QUANTIZED_VERTICES meshes go to GL as VertexQuantized.
+// Positions are snorm16 inside the cube around the mesh bounds, so one
+// vec4 of its center and half size places them again in the vertex shader.
+// Index buffers are 16 bit whenever the vertices fit, but not in the
+// geometry pool, whose multi draws all read one index type.
+typedef struct {
+    int16_t pos[3];
+    int16_t pad;
+    u32 normal; // snorm 10_10_10_2, w unused
+    uint16_t tex[2]; // half floats
+} VertexQuantized;
+
+static b8 vertex_quantization;
+
+u32      iVG_VertexStrideGet();
+u32      iVG_IndexSizeGet(u32 vertex_count);
+GLenum   iVG_IndexTypeGet(Model* model);
+void     iVG_ModelPositionDequantizeSet(Model* model);
+void*    iVG_VerticesQuantize(Model* model, Vertex* vertices, u32 count);
+void*    iVG_IndicesNarrow(u32* indices, u64 count, u32 index_size);
+void     iVG_VertexQuantize(VertexQuantized* out, Vertex* vertex, f32* dequantize);
+uint16_t iVG_HalfFromFloat(f32 value);
+
+// MESH CACHE
+// What VG_ModelNew makes of an OBJ is kept next to it as a .vgm file and
+// loaded instead while it is newer than the OBJ. The file is mapped and
+// its blobs go to GL straight from the mapping. Blobs start on
+// MESH_FILE_ALIGNMENT, offsets count from the start of the file and
+// everything is in the byte order of the machine that wrote it.
+#define MESH_FILE_MAGIC 0x314D4756 // "VGM1"
+#define MESH_FILE_VERSION 4
+#define MESH_FILE_ALIGNMENT 64
+#define MESH_FILE_ATTRIBUTES_MAX 4
+
+typedef struct {
+    u32 location;
+    u32 components;
+    u32 type;
+    u32 offset;
+} MeshFileAttribute;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 size;
+    
+    f32 aabb_min[3];
+    f32 aabb_max[3];
+    f32 sphere_center[3];
+    f32 sphere_radius;
+    f32 acmr[2];
+    f32 atvr[2];
+    
+    u32 vertex_stride;
+    u32 attribute_count;
+    MeshFileAttribute attributes[MESH_FILE_ATTRIBUTES_MAX];
+    
+    u32 vertex_count;
+    u32 index_size;
+    u32 lod_count;
+    u32 lod_index_counts[MODEL_LOD_MAX];
+    u32 occluder_position_count;
+    u32 occluder_index_count;
+    
+    u64 vertex_offset;
+    u64 index_offset;
+    u64 occluder_position_offset;
+    u64 occluder_index_offset;
+} MeshFileHeader;
+
+void iVG_MeshCachePathGet(const char* path, char* out, u32 size);
+b8   iVG_MeshCacheFresh(const char* path, const char* cache_path);
+b8   iVG_MeshCacheLoad(Model* model, const char* cache_path);
+b8   iVG_MeshCacheIndicesValid(u8* data, u64 offset, u64 count, u32 index_size, u32 limit);
+void iVG_MeshCacheStore(Model* model, const char* cache_path, void* vertices, u32 vertex_count,
+			void* indices, u32* index_counts);
+void iVG_MeshFileLayoutGet(MeshFileHeader* header);
+void iVG_MeshFileHeaderFill(MeshFileHeader* header, Model* model, u32 vertex_count, u32* index_counts);
+
+// OBJ IMPORT
+// The mapped file is cut into chunks at line ends. Chunks first count
+// their v, vt and vn lines so each one knows where its attributes go,
+// then parse into the shared arrays and triangulate their faces. Corners
+// are split by hash into shards that are deduplicated on their own, so
+// no job ever touches another's table. Vertices come out in the order
+// of their first corner, the same for any number of threads.
+#define OBJ_CHUNK_SIZE_MIN (256*1024)
+#define OBJ_CHUNKS_PER_THREAD 4
+#define OBJ_SHARD_BITS 4
+#define OBJ_SHARD_COUNT (1 << OBJ_SHARD_BITS)
+#define OBJ_INDEX_NONE 0xFFFFFFFFu
+
+typedef struct ObjImport ObjImport;
+
+typedef struct {
+    ObjImport* import;
+    const char* begin;
+    const char* end;
+    u32 position_count;
+    u32 texcoord_count;
+    u32 normal_count;
+    u32 position_base;
+    u32 texcoord_base;
+    u32 normal_base;
+    // position, texcoord and normal of every triangle corner
+    u32 (*corners)[3];
+    u32* hashes;
+    u32 corner_count;
+    u32 corner_capacity;
+    u32 corner_base;
+    u32 shard_counts[OBJ_SHARD_COUNT];
+    u32 shard_offsets[OBJ_SHARD_COUNT];
+    u32 first_count;
+    u32 vertex_base;
+    b8 failed;
+} ObjChunk;
+
+typedef struct {
+    ObjImport* import;
+    u32 shard;
+} ObjShard;
+
+struct ObjImport {
+    ObjChunk* chunks;
+    u32 chunk_count;
+    ObjShard shards[OBJ_SHARD_COUNT];
+    u32 shard_bases[OBJ_SHARD_COUNT + 1];
+    f32 (*positions)[3];
+    f32 (*texcoords)[2];
+    f32 (*normals)[3];
+    u32 position_count;
+    u32 texcoord_count;
+    u32 normal_count;
+    u32 (*corners)[3];
+    u32 corner_count;
+    // corner indices grouped by shard, in corner order inside a shard
+    u32* shard_corners;
+    // first corner with the same tuple, then the vertex of every first corner
+    u32* firsts;
+    u32* vertex_ids;
+    Mesh* mesh;
+};
+
+b8   iVG_ObjLoad(Mesh* mesh, const char* path);
+void iVG_ObjImportRun(ObjImport* import, JobFunction function, b8 per_shard);
+void iVG_ObjCountJob(void* chunk);
+void iVG_ObjParseJob(void* chunk);
+void iVG_ObjScatterJob(void* chunk);
+void iVG_ObjShardJob(void* shard);
+void iVG_ObjFirstCountJob(void* chunk);
+void iVG_ObjVertexJob(void* chunk);
+void iVG_ObjIndexJob(void* chunk);
+const char* iVG_ObjLineEnd(const char* p, const char* end);
+f32  iVG_ObjFloatParse(const char** cursor, const char* end);
+b8   iVG_ObjIndexParse(const char** cursor, const char* end, u32 base, u32 local, u32 total, u32* out);
+b8   iVG_ObjCornerStart(char c);
+u32  iVG_ObjCornerHash(u32* corner);
+void iVG_MeshWeld(Mesh* mesh, u32* remap, size_t offset, size_t size);
+void iVG_MeshAdjacencyBuild(u32* triangles, u32 triangle_count, u32* position, u32 vertex_count,
+			    u32* offsets, u32* adjacency);
+void iVG_LodScaleUpdate();
+u32  iVG_LodSelect(Model* model, f32* center, f32 radius);
+
+// STREAMING IMPORT
+// With an import budget set, an OBJ whose import in memory would need more
+// is read twice through a window of a fixed size instead. The first pass
+// appends v, vt and vn to temporary files next to the cache and counts
+// triangle corners. When every corner indexes v, vt and vn alike the
+// positions are the vertices, copied from the mapped files in order, and
+// the second pass only writes the indices of the faces. Otherwise it turns
+// every corner into a vertex of its own. Either fills a window of the .vgm
+// cache that is then loaded like any other, or of mapped GL buffer ranges
+// when the cache can not be written, dropping the mapped pages after every
+// window. Only the windows are allocated, the rest is file pages the
+// kernel can drop. Streamed models have one LOD and no occluder mesh.
+#define OBJ_IMPORT_TRIANGLE_COST 256 // bytes the import in memory needs per triangle, measured
+#define OBJ_TRIANGLE_BYTES_MIN 2 // one more " 1" on a face
+#define OBJ_STREAM_WINDOW_MIN (64*1024)
+#define OBJ_STREAM_WINDOW_MAX (64*1024*1024)
+
+typedef struct ObjStream ObjStream;
+typedef b8 (*ObjStreamLineFunction)(ObjStream* stream, const char* p, const char* line_end);
+
+// Where vertices or indices go, one window at a time
+typedef struct {
+    FILE* file; // NULL when writing to buffer
+    u32 buffer;
+    u64 offset; // bytes into file or buffer
+    u32 element_size;
+    u64 total;
+    u64 written;
+    u8* window;
+    u32 count;
+    u32 capacity;
+} ObjStreamSink;
+
+struct ObjStream {
+    Model* model;
+    int file;
+    char* window;
+    u32 window_size;
+    u8* staging;
+    // v, vt and vn written by the first pass, seen counts them in the second
+    FILE* spills[3];
+    u32 counts[3];
+    u32 seen[3];
+    f32 (*positions)[3];
+    f32 (*texcoords)[2];
+    f32 (*normals)[3];
+    u64 corner_count;
+    // v, vt and vn indexed alike with the same of them on every corner,
+    // layout being 1 with a bit for vt and one for vn, 0 before the first
+    b8 shared;
+    u32 layout;
+    u32 vertex_count;
+    f32 radius2;
+    // the FIFO of iVG_VertexCacheMisses as a ring, and a bit per used vertex
+    u32 cache[VERTEX_CACHE_SIZE];
+    u32 cache_next;
+    u64 misses;
+    u8* used;
+    ObjStreamSink vertices;
+    ObjStreamSink indices;
+    // a broken face rather than a file that could not be written
+    b8 failed;
+};
+
+static u64 import_budget;
+
+u64  iVG_ImportWindowSizeGet();
+b8   iVG_ObjStreamNeeded(const char* path);
+u64  iVG_ObjTriangleCount(const char* path);
+b8   iVG_ObjStream(Model* model, const char* path, const char* cache_path);
+FILE* iVG_ObjStreamSpillOpen(const char* cache_path, u32 spill);
+void iVG_ObjStreamSpillsDrop(ObjStream* stream);
+b8   iVG_ObjStreamPass(ObjStream* stream, ObjStreamLineFunction line);
+b8   iVG_ObjStreamAttributeLine(ObjStream* stream, const char* p, const char* line_end);
+b8   iVG_ObjStreamFaceLine(ObjStream* stream, const char* p, const char* line_end);
+b8   iVG_ObjStreamCornerParse(ObjStream* stream, const char** cursor, const char* line_end,
+				u32* seen, u32* totals, u32* index);
+b8   iVG_ObjStreamVertexPush(ObjStream* stream, Vertex* vertex);
+b8   iVG_ObjStreamIndexPush(ObjStream* stream, u32 index);
+b8   iVG_ObjStreamEmit(ObjStream* stream);
+u8*  iVG_ObjStreamSinkPush(ObjStream* stream, ObjStreamSink* sink);
+b8   iVG_ObjStreamSinkFlush(ObjStream* stream, ObjStreamSink* sink);
+b8   iVG_ObjStreamToCache(ObjStream* stream, const char* cache_path);
+b8   iVG_ObjStreamToBuffers(ObjStream* stream);
 
 // MODELARENA
 typedef struct {
@@ -103,6 +526,123 @@ u32      iVG_ModelArenaBump();
 Model*   iVG_ModelArenaPointerGet(u32 model_handle);
 void     iVG_ModelArenaDestroy();
 
+// STATIC INSTANCES
+// Instances uploaded once and drawn every frame until destroyed. Sets of
+// one model form a list through next, starting at model->static_instances.
+typedef struct {
+    u32 model;
+    u32 buffer;
+    u32 count;
+    u32 next;
+} StaticInstances;
+
+typedef struct {
+    StaticInstances* base;
+    u32 position;
+    u32 size;
+} StaticInstancesArena;
+
+static StaticInstancesArena static_instances_arena;
+
+void             iVG_StaticInstancesArenaInit(u32 size);
+u32              iVG_StaticInstancesArenaBump();
+StaticInstances* iVG_StaticInstancesArenaPointerGet(u32 handle);
+void             iVG_StaticInstancesArenaDestroy();
+void             iVG_StaticInstancesWrite(StaticInstances* set, u32 first, u32 count, InstanceTransform* transforms);
+
+// OBJECTS
+// Persistent instances, each one owns a leaf of the object tree
+typedef struct {
+    u32 model;
+    u32 leaf;
+    InstanceTransform transform;
+    f32 rows[3][4];
+} Object;
+
+// Destroyed objects are reused through free, linked by their leaf field
+typedef struct {
+    Object* base;
+    u32 position;
+    u32 size;
+    u32 free;
+} ObjectArena;
+
+static ObjectArena object_arena;
+
+void    iVG_ObjectArenaInit(u32 size);
+u32     iVG_ObjectArenaBump();
+Object* iVG_ObjectArenaPointerGet(u32 handle);
+void    iVG_ObjectArenaDestroy();
+void    iVG_ObjectBoundsCompute(Object* object, f32* min, f32* max);
+
+// OBJECT TREE
+// Dynamic AABB tree over the objects. Leaves hold bounds enlarged by
+// OBJECT_TREE_MARGIN of their size so small moves don't touch the tree,
+// rotations keep it balanced as leaves come and go.
+#define OBJECT_TREE_MARGIN 0.1f
+
+typedef struct {
+    f32 min[3];
+    f32 max[3];
+    u32 parent; // next free node while unused
+    u32 child[2];
+    u32 object;
+    int32_t height;
+} ObjectNode;
+
+typedef struct {
+    u32 node;
+    u32 planes;
+} ObjectTreeVisit;
+
+typedef struct {
+    ObjectNode* nodes;
+    u32 position;
+    u32 size;
+    u32 free;
+    u32 root;
+    ObjectTreeVisit* stack;
+    u32 stack_size;
+} ObjectTree;
+
+static ObjectTree object_tree;
+
+void iVG_ObjectTreeInit(u32 size);
+void iVG_ObjectTreeDestroy();
+u32  iVG_ObjectTreeNodeAlloc();
+void iVG_ObjectTreeNodeFree(u32 node);
+void iVG_ObjectTreeInsert(u32 leaf);
+void iVG_ObjectTreeRemove(u32 leaf);
+u32  iVG_ObjectTreeBalance(u32 node);
+void iVG_ObjectTreeQuery();
+
+// INSTANCE RING
+// One persistently mapped buffer holding every dynamic instance, split in
+// regions so the CPU fills one frame while the GPU still reads the others
+#define INSTANCE_RING_REGIONS 3
+#define INSTANCE_RING_REGION_CAPACITY_MIN 4096
+// glVertexAttribPointer ties attribute n to binding n, so instances use one past those
+#define INSTANCE_BINDING 8
+
+typedef struct {
+    u32 buffer;
+    u8* mapped;
+    u32 region_capacity;
+    u32 region;
+    u32 position;
+    b8 acquired;
+    GLsync fences[INSTANCE_RING_REGIONS];
+} InstanceRing;
+
+static InstanceRing instance_ring;
+
+void iVG_InstanceRingInit(u32 region_capacity);
+void iVG_InstanceRingDestroy();
+u32  iVG_InstanceRingAlloc(u32 count);
+void iVG_InstanceRingGrow(u32 region_capacity);
+void iVG_InstanceRingFrameEnd();
+u32  iVG_InstanceRingBaseGet();
+
 typedef struct {
     u32* base;
     u32 position;
@@ -117,6 +657,173 @@ u32* iVG_TextureArenaPointerGet(u32 model_handle);
 void      iVG_TextureArenaDestroy();
 void iVG_TextureUse(u32 texture);
 
+// SHADERS
+// Programs find the locations of everything vgfx sets once after linking,
+// setters then go through a slot instead of a name. Every other active
+// uniform, array elements included, is kept in a table for lookups by name.
+//
+// A shader handle keeps the sources it was loaded from, the programs built
+// from them are variants in one table keyed by the sources and the defines
+// they got. Handles whose program reads the Lights block are specialized
+// for the number of lights in use, VG_ShaderUse picks or builds the variant.
+// Variants are linked in the background where the driver can, a handle
+// is drawn with what is ready in the meantime.
+#define SHADER_LIGHT_VARIANT_MAX 8
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef void (*ShaderCompilerThreadsProc)(GLuint count);
+
+typedef enum {
+    UNIFORM_MAIN_TEXTURE,
+    UNIFORM_MATERIAL_COLOR,
+    UNIFORM_DRAW_COLORS,
+    UNIFORM_POSITION_DEQUANTIZE,
+    UNIFORM_DRAW_POSITION_DEQUANTIZE,
+    // from before FrameData, for programs that still declare them
+    UNIFORM_PROJECTION,
+    UNIFORM_VIEW,
+    UNIFORM_CAMERA_POS,
+    UNIFORM_SLOT_COUNT,
+} UniformSlot;
+
+typedef struct {
+    u32 hash;
+    GLint location;
+    char* name;
+} UniformEntry;
+
+typedef struct {
+    u64 hash;
+    // the shader handle whose sources were compiled
+    u32 source;
+    char* defines;
+    u32 program;
+    GLint slots[UNIFORM_SLOT_COUNT];
+    UniformEntry* uniforms;
+    u32 uniform_count;
+    u32 uniform_capacity;
+    // open addressed on the name hash, entry index + 1 with 0 for empty
+    u32* uniform_table;
+    u32 uniform_table_mask;
+    // reads the Lights block, known once linked
+    b8 lights;
+    // the frame_version its camera uniforms were set for
+    u32 camera_frame;
+    // the handle and its uniform_version whose user uniforms it holds
+    u32 uniform_owner;
+    u32 uniform_version;
+    // compiled and linking, the stages are kept until the status is checked
+    b8 pending;
+    u32 stages[2];
+    u64 cache_key;
+} ShaderVariant;
+
+typedef enum {
+    USER_UNIFORM_F32,
+    USER_UNIFORM_VEC2,
+    USER_UNIFORM_VEC3,
+    USER_UNIFORM_VEC4,
+    USER_UNIFORM_INT,
+    USER_UNIFORM_MAT4,
+} UserUniformType;
+
+// A value set through VG_ShaderUniform*Set, kept to be set again on
+// every variant the handle is drawn with
+typedef struct {
+    char* name;
+    UserUniformType type;
+    union {
+	f32 f[16];
+	int32_t i;
+    } value;
+} UserUniform;
+
+typedef struct {
+    char* vertex_source;
+    char* fragment_source;
+    char* defines;
+    u64 source_hash;
+    UserUniform* uniforms;
+    u32 uniform_count;
+    u32 uniform_capacity;
+    // bumped on every VG_ShaderUniform*Set
+    u32 uniform_version;
+    u32 variant;
+    // the variant for the lights in use and the light key it was picked for
+    u32 light_variant;
+    u32 light_variant_key;
+} Shader;
+
+typedef struct {
+    Shader* base;
+    u32 position;
+    u32 size;
+} ShaderArena;
+
+typedef struct {
+    ShaderVariant* base;
+    u32 count;
+    u32 capacity;
+} ShaderVariantTable;
+
+static ShaderArena shader_arena;
+static ShaderVariantTable shader_variants;
+static u32 shader_variant_current;
+static u32 shader_default;
+static b8 shader_parallel_compile;
+// direct, global and whether there are clustered lights, see iVG_ShaderLightKeyGet
+static u32 shader_light_key;
+
+void    iVG_ShaderArenaInit(u32 size);
+u32     iVG_ShaderArenaBump();
+Shader* iVG_ShaderArenaPointerGet(u32 shader_handle);
+void    iVG_ShaderArenaDestroy();
+void    iVG_GLShaderParallelCompileInit();
+u32     iVG_ShaderVariantGet(u32 shader_handle, const char* defines);
+u32     iVG_ShaderVariantResolve(u32 shader_handle);
+b8      iVG_ShaderVariantReady(u32 variant_handle);
+void    iVG_ShaderVariantFinish(ShaderVariant* variant);
+u32     iVG_ShaderLightVariantGet(u32 shader_handle);
+u32     iVG_ShaderLightKeyGet(u32 direct_count, u32 global_count, b8 clustered);
+ShaderVariant* iVG_ShaderVariantCurrentGet();
+void    iVG_GLProgramStart(ShaderVariant* variant, const char* vertex_source, const char* fragment_source);
+void    iVG_ShaderDefinesGet(GLenum type, char* out, u32 size);
+void    iVG_ShaderUniformsBuild(ShaderVariant* variant);
+void    iVG_ShaderUniformAdd(ShaderVariant* variant, const char* name, GLint location);
+void    iVG_ShaderUniformTableBuild(ShaderVariant* variant);
+GLint   iVG_ShaderUniformFind(ShaderVariant* variant, const char* name);
+void    iVG_ShaderUserUniformSet(u32 shader_handle, const char* name, UserUniformType type, const void* value);
+void    iVG_GLShaderUserUniformsApply(ShaderVariant* variant, u32 shader_handle);
+u32     iVG_UniformNameHash(const char* name);
+
+// SHADER CACHE
+// With a cache directory set, linked programs are written there as
+// <key>.bin, the key hashing both sources with every define and the GL
+// vendor, renderer and version. A binary the driver turns down is built
+// from source again and written over.
+#define SHADER_CACHE_MAGIC 0x31424756 // "VGB1"
+
+typedef struct {
+    u32 magic;
+    u32 format;
+    u64 key;
+    u32 length;
+    u32 pad;
+} ShaderCacheHeader;
+
+static char* shader_cache_dir;
+static u64 shader_cache_driver_hash;
+
+u64  iVG_ShaderCacheKeyGet(const char* vertex_source, const char* fragment_source, const char* defines);
+void iVG_ShaderCachePathGet(u64 key, char* out, u32 size);
+u32  iVG_GLShaderCacheLoad(u64 key);
+void iVG_GLShaderCacheStore(u32 program, u64 key);
+// FNV-1a, chained by passing the previous hash, starting from HASH64_BASIS
+#define HASH64_BASIS 14695981039346656037ull
+u64  iVG_Hash64(u64 hash, const void* data, u64 size);
+
 
 // BUFFERING DATA
 typedef u32 VAO_t;
@@ -128,24 +835,366 @@ void  iVG_GLDrawTriangles(VAO_t amount);
 void  iVG_GLVertexArrayDestroy(VAO_t VAO);
 void  iVG_GLModelRender(Model *VAO);
 void  iVG_GLModelRenderInstances(Model *model);
-u32   iVG_GLLoadVerticesIndexed(Vertex* vertices, u32 vcount, u32* indices, u32 icount);
-u32   iVG_GLInstancesBuffer(InstanceData* instances, u32 instance_count);
+void  iVG_GLModelRenderStatic(Model *model);
+u32   iVG_GLLoadVerticesIndexed(void* vertices, u32 vcount, void* indices, u32 icount, u32 index_size,
+				u32 buffers[2]);
+void  iVG_GLInstanceAttributesSet(VAO_t VAO, u32 buffer);
+void  iVG_GLVertexAttributesSet();
 void  iVG_GLRenderVerticesIndexed(Vertex* vertices, u32 vcound, u32 *indices, u32 icount);
 
 
+// INSTANCE TRANSFORMS
+void iVG_InstanceFormatSet(InstanceFormat format);
+void iVG_InstanceRowsCompose(f32 rows[3][4], f32* pos, f32* rotation, f32* size);
+void iVG_InstanceQuaternionCompose(int16_t* out, f32* rotation);
+void iVG_InstanceNormalScaleCompose(f32* out, f32* size);
+void iVG_InstanceStore(void* out, f32 rows[3][4], f32* pos, f32* rotation, f32* size);
+void iVG_InstanceWrite(void* out, f32* pos, f32* rotation, f32* size);
+u32  iVG_InstancesWrite(void* out, u32 count, f32 pos[][3], f32 rotation[][3], f32 size[][3],
+			Model* model, b8 cull, u8* lods, f32* depth_nearest);
+void iVG_InstancesDepthNearestFold(f32* depth_nearest, f32 pos[][3], u32 visible, u32 lanes);
+
+// JOBS
+// Work stealing pool. Every thread owns a queue, queue 0 belongs to the
+// thread that opened the window and is only ever run while it waits.
+#define JOB_QUEUE_CAPACITY 4096
+
+typedef struct {
+    JobFunction function;
+    void* data;
+    JobCounter* counter;
+} Job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Job jobs[JOB_QUEUE_CAPACITY];
+    u32 top;
+    u32 bottom;
+} JobQueue;
+
+typedef struct {
+    pthread_t* threads;
+    JobQueue* queues;
+    u32 count;
+    atomic_uint queued;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    b8 quit;
+} JobPool;
+
+static JobPool job_pool;
+static _Thread_local u32 job_thread;
+
+void  iVG_JobPoolInit(u32 threads);
+void  iVG_JobPoolDestroy();
+b8    iVG_JobTake(Job* job);
+void  iVG_JobRun(Job* job);
+void* iVG_JobWorker(void* index);
+
+// INSTANCE PREPARATION
+// Pending transforms are cut in chunks that workers turn into instances
+#define INSTANCE_CHUNK_SIZE 1024
+
+// Models with more than one LOD can't know where an instance goes before
+// all of them are written, their chunks go to scratch and get scattered
+// into the ring once every level has its count
+typedef struct {
+    Model* model;
+    u32 first;
+    u32 offset;
+    u32 count;
+    u32 written;
+    f32 depth_nearest;
+    u8* scratch;
+    u8 lods[INSTANCE_CHUNK_SIZE];
+    u32 lod_written[MODEL_LOD_MAX];
+    u32 lod_first[MODEL_LOD_MAX];
+} InstanceChunk;
+
+static InstanceChunk* instance_chunks;
+static u32 instance_chunk_capacity;
+static u8* instance_scratch;
+static size_t instance_scratch_capacity;
+
+void iVG_InstancesPrepare();
+void iVG_InstanceChunkJob(void* chunk);
+void iVG_InstanceChunkScatterJob(void* chunk);
+f32  iVG_ViewDepthGet(f32* pos);
+
+// RENDER QUEUE
+// One item per model with something to draw. Keys sort by shader, then
+// texture, then material color, then nearest instance so the state only
+// changes when the key does and each state group goes front to back.
+#define RENDER_KEY_DEPTH_FAR 100.0f
+
+typedef struct {
+    u64 key;
+    u32 model;
+} RenderItem;
+
+typedef struct {
+    RenderItem* items;
+    RenderItem* scratch;
+    u32 count;
+    u32 capacity;
+} RenderQueue;
+
+static RenderQueue render_queue;
+
+u64  iVG_RenderKeyCompose(Model* model);
+void iVG_RenderQueuePush(u64 key, u32 model_handle);
+void iVG_RenderQueueSort();
+void iVG_RenderQueueSubmit();
+void iVG_RenderQueueDestroy();
+
+// GEOMETRY POOL
+// With VG_WINDOW_FLAG_GEOMETRY_POOL every mesh is appended to one vertex
+// and one index buffer behind a single VAO. Models keep their ranges and
+// a frame is drawn with one multi draw per shader and texture, the model
+// colors go to the shader as an array indexed by the draw.
+#define GEOMETRY_POOL_DRAWS_MAX 128
+
+typedef struct {
+    u32 count;
+    u32 instance_count;
+    u32 first_index;
+    int32_t base_vertex;
+    u32 base_instance;
+} DrawCommand;
+
+typedef struct {
+    u32 VAO;
+    u32 vertex_buffer;
+    u32 index_buffer;
+    u32 vertex_count;
+    u32 vertex_capacity;
+    u32 index_count;
+    u32 index_capacity;
+
+    u32 indirect_buffer;
+    DrawCommand* commands;
+    f32 (*colors)[3];
+    f32 (*position_dequantize)[4];
+    u32* command_models;
+    u32 command_count;
+    u32 command_capacity;
+} GeometryPool;
+
+static GeometryPool geometry_pool;
+
+void iVG_GeometryPoolInit();
+void iVG_GeometryPoolDestroy();
+void iVG_GeometryPoolAttach();
+u32  iVG_GeometryPoolBufferGrow(u32 buffer, u32 used, u32 size);
+u32  iVG_GeometryPoolReserve(Model* model, u32 vertex_count, u32 index_count);
+void iVG_GeometryPoolCommandPush(u32 model_handle, u32 lod, u32 count, u32 first);
+void iVG_RenderQueueSubmitIndirect();
+b8   iVG_GLExtensionSupported(const char* name);
+void iVG_GLMaterialColorSet(f32* color);
+void iVG_GLPositionDequantizeSet(Model* model);
+
+// FRUSTUM
+void iVG_FrustumReset();
+void iVG_FrustumUpdate();
+b8   iVG_FrustumSphereVisible(f32* center, f32 radius);
+void iVG_InstanceSphereGet(Model* model, f32 rows[3][4], f32* center, f32* radius);
+
+// OCCLUSION
+// Instances of occluder models are rasterized into a small depth buffer on
+// the CPU, a band of rows per job. Every level of the pyramid above it keeps
+// the farthest depth of the four texels below, so a bounding box is tested
+// with a handful of reads at the level its size on screen matches. Depths
+// are 1/w, which interpolates linearly on screen and leaves 0 where nothing
+// was drawn.
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+#define OCCLUSION_LEVELS 8
+#define OCCLUSION_BAND_HEIGHT 16
+#define OCCLUSION_NEAR 0.1f
+
+// Corners in buffer pixels with y up, z holds 1/w
+typedef struct {
+    f32 x[3];
+    f32 y[3];
+    f32 z[3];
+} OcclusionTriangle;
+
+typedef struct {
+    Model* model;
+    f32 rows[3][4];
+    u32 first_triangle;
+    u32 triangle_count;
+} OcclusionInstance;
+
+typedef struct {
+    f32* levels[OCCLUSION_LEVELS];
+    OcclusionInstance* instances;
+    u32 instance_count;
+    u32 instance_capacity;
+    OcclusionTriangle* triangles;
+    u32 triangle_capacity;
+    // only set between building the buffer and preparing the instances
+    b8 ready;
+} OcclusionBuffer;
+
+static OcclusionBuffer occlusion;
+static b8 occlusion_culling = true;
+
+void iVG_OcclusionInit();
+void iVG_OcclusionDestroy();
+void iVG_OcclusionBuild();
+void iVG_OcclusionInstancePush(Model* model, f32 rows[3][4]);
+void iVG_OcclusionSetupJob(void* instance);
+void iVG_OcclusionRasterJob(void* band);
+void iVG_OcclusionPyramidBuild();
+b8   iVG_OcclusionBoxVisible(Model* model, f32 rows[3][4]);
+
+// LIGHTS
+// Light counts and the cluster grid parameters as the Lights block of the
+// shaders lays them out under std140. One buffer bound at
+// LIGHT_BLOCK_BINDING serves every program. Direct lights go to the
+// DirectLightData storage buffer, point and flash lights to LightData as
+// records, the ones without a range first since every fragment goes through those.
+#define LIGHT_BLOCK_BINDING 0
+#define LIGHT_RECORD_BINDING 2
+#define DIRECT_LIGHT_RECORD_BINDING 5
+
+// A direct light under std430, where a vec3 takes the room of a vec4
+typedef struct {
+    f32 direction[3];
+    f32 pad0;
+    f32 color[3];
+    f32 pad1;
+} DirectLightRecord;
+
+typedef struct {
+    int32_t direct_count;
+    int32_t global_count;
+    int32_t pad[2];
+    u32 cluster_grid[4];
+    // the slice of a view depth is log(depth)*x + y
+    f32 cluster_depth[4];
+} LightBlock;
+
+// A point or flash light under std430
+typedef struct {
+    f32 position[3];
+    f32 range;
+    f32 color[3];
+    f32 flash;
+    f32 direction[3];
+    f32 angle;
+    f32 cutoff;
+    f32 pad[3];
+} LightRecord;
+
+// what the buffers hold since the last upload
+static LightBlock light_block;
+static u32 light_buffer;
+static LightRecord* light_records;
+static LightRecord* light_records_uploaded;
+static u32 light_record_count;
+static u32 light_record_uploaded_count;
+static u32 light_record_capacity;
+static u32 light_record_buffer;
+static u32 light_record_buffer_capacity;
+static DirectLightRecord* direct_light_records;
+static DirectLightRecord* direct_light_records_uploaded;
+static u32 direct_light_record_capacity;
+static u32 direct_light_record_uploaded_count;
+static u32 direct_light_record_buffer;
+static u32 direct_light_record_buffer_capacity;
+
 void iVG_LightInit();
+void iVG_LightDestroy();
+u32  iVG_LightRecordsPack();
+void iVG_LightRecordPack(LightRecord* out, f32* position, f32* color, f32 range, FlashLight* flash);
+void iVG_GLDirectLightRecordsUpdate();
+
+// CLUSTERS
+// Lights with a range are binned into froxels, CLUSTER_X by CLUSTER_Y tiles
+// of the screen times CLUSTER_Z slices spaced evenly in log depth. Each
+// slice is filled by its own job, every froxel gets a first index and a
+// count in the list of light records it touches.
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_TILES (CLUSTER_X*CLUSTER_Y)
+#define CLUSTER_COUNT (CLUSTER_TILES*CLUSTER_Z)
+#define CLUSTER_BINDING 3
+#define CLUSTER_LIGHT_BINDING 4
+
+// Froxels touched by a light, both ends included
+typedef struct {
+    u32 light;
+    u8 min[3];
+    u8 max[3];
+} ClusterLightBounds;
+
+typedef struct {
+    u32* indices;
+    u32 index_count;
+    u32 index_capacity;
+} ClusterSlice;
+
+typedef struct {
+    ClusterLightBounds* bounds;
+    u32 bound_count;
+    u32 bound_capacity;
+    ClusterSlice slices[CLUSTER_Z];
+    // first index and count, x first then y then slice
+    u32 ranges[CLUSTER_COUNT][2];
+    u32* indices;
+    u32 index_capacity;
+    u32 range_buffer;
+    u32 index_buffer;
+    u32 index_buffer_capacity;
+    b8 empty;
+} ClusterGrid;
+
+static ClusterGrid cluster_grid;
+
+void iVG_ClusterGridInit();
+void iVG_ClusterGridDestroy();
+void iVG_ClusterGridBuild(u32 first, u32 count);
+b8   iVG_ClusterLightBoundsGet(ClusterLightBounds* out, f32* position, f32 range);
+void iVG_ClusterSliceJob(void* slice);
+u32  iVG_ClusterSliceGet(f32 depth);
+
+// FRAME DATA
+// Camera, time and viewport of the frame in the std140 FrameData block,
+// written once in VG_DrawingBegin. Matrices stay row major, the shaders
+// declare the block row_major.
+#define FRAME_BLOCK_BINDING 1
+
+typedef struct {
+    f32 view[16];
+    f32 projection[16];
+    f32 view_projection[16];
+    f32 camera_position[3];
+    f32 time;
+    f32 viewport[2];
+    f32 pad[2];
+} FrameBlock;
+
+static u32 frame_buffer;
+// counts the FrameData writes, starting from 1
+static u32 frame_version;
+
+void iVG_FrameBlockInit();
+void iVG_FrameBlockDestroy();
 
 void iVG_GLCameraUpdate();
 void iVG_GLPerspectiveUpdate();
 void iVG_GLLightUpdate();
-void iVG_GLShaderCameraUpdate();
-void iVG_GLShaderLightUpdate();
-void iVG_GLShaderProjectionUpdate();
+void iVG_GLFrameBlockUpdate();
+void iVG_GLShaderCameraUpdate(ShaderVariant* variant);
+void iVG_GLShaderBlocksBind(u32 program);
 
 
-void iVG_GLUniformVec3Set(char* name, f32* vec);
-void iVG_GLUniformF32Set(char* name, f32 value);
-void iVG_GLUniformIntSet(char *name, int value);
+void iVG_GLUniformVec3Set(UniformSlot slot, f32* vec);
+void iVG_GLUniformF32Set(UniformSlot slot, f32 value);
+void iVG_GLUniformIntSet(UniformSlot slot, int value);
 
 
 // INITIALIZATION AND CLOSING
@@ -190,9 +1239,36 @@ void VG_WindowOpen(char* name, f32* size, u32 flags) {
 
     camera.fov = V_PI/2;
     
+    vertex_quantization = (flags & VG_WINDOW_FLAG_QUANTIZED_VERTICES) != 0;
     iVG_ModelArenaInit(64);
     iVG_TextureArenaInit(64);
+    iVG_ShaderArenaInit(16);
+    iVG_GLShaderParallelCompileInit();
+    iVG_StaticInstancesArenaInit(64);
+    iVG_ObjectArenaInit(64);
+    iVG_ObjectTreeInit(128);
+    if (flags & VG_WINDOW_FLAG_INSTANCE_TRS) {
+	iVG_InstanceFormatSet(INSTANCE_FORMAT_TRS);
+    } else if (flags & VG_WINDOW_FLAG_INSTANCE_AFFINE) {
+	iVG_InstanceFormatSet(INSTANCE_FORMAT_AFFINE);
+    } else {
+	iVG_InstanceFormatSet(INSTANCE_FORMAT_MAT4);
+    }
+    iVG_InstanceRingInit(INSTANCE_RING_REGION_CAPACITY_MIN);
+    iVG_FrustumReset();
+    iVG_OcclusionInit();
+    u32 threads = flags >> 24;
+    if (!threads) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    iVG_JobPoolInit(threads);
+    if (flags & VG_WINDOW_FLAG_GEOMETRY_POOL) {
+	if (iVG_GLExtensionSupported("GL_ARB_shader_draw_parameters")) {
+	    iVG_GeometryPoolInit();
+	} else {
+	    iVG_Log("No GL_ARB_shader_draw_parameters, meshes get their own buffers");
+	}
+    }
     iVG_LightInit();
+    iVG_FrameBlockInit();
 }
 
 b8 VG_WindowShouldClose() {
@@ -201,6 +1277,20 @@ b8 VG_WindowShouldClose() {
 
 void VG_WindowClose() {
     iVG_ModelArenaDestroy();
+    iVG_StaticInstancesArenaDestroy();
+    iVG_ShaderArenaDestroy();
+    VG_ShaderCacheDirSet(NULL);
+    iVG_ObjectArenaDestroy();
+    iVG_ObjectTreeDestroy();
+    iVG_InstanceRingDestroy();
+    iVG_JobPoolDestroy();
+    iVG_RenderQueueDestroy();
+    iVG_GeometryPoolDestroy();
+    iVG_OcclusionDestroy();
+    iVG_LightDestroy();
+    iVG_FrameBlockDestroy();
+    free(instance_chunks);
+    free(instance_scratch);
     glfwTerminate();
 }
 
@@ -298,24 +1388,27 @@ void VG_CameraSet(Camera camera) {
 
 //LIGHT
 u32 VG_FlashLightCreate() {
-    if (flashLightCount >= FLASH_LIGHT_MAX_COUNT - 1) {
-	fprintf(stderr, "Too many flashlights");
-	exit(1);
+    if (flashLightCount == flashLightCapacity) {
+	flashLightCapacity = flashLightCapacity ? flashLightCapacity*2 : 8;
+	flashLights = realloc(flashLights, sizeof(FlashLight)*flashLightCapacity);
     }
+    memset(flashLights + flashLightCount, 0, sizeof(FlashLight));
     return flashLightCount++;
 }
 u32 VG_DirectLightCreate() {
-    if (directLightCount >= DIRECT_LIGHT_MAX_COUNT - 1) {
-	fprintf(stderr, "Too many direct lights");
-	exit(1);
+    if (directLightCount == directLightCapacity) {
+	directLightCapacity = directLightCapacity ? directLightCapacity*2 : 8;
+	directLights = realloc(directLights, sizeof(DirectLight)*directLightCapacity);
     }
+    memset(directLights + directLightCount, 0, sizeof(DirectLight));
     return directLightCount++;
 }
 u32 VG_PointLightCreate() {
-    if (pointLightCount >= POINT_LIGHT_MAX_COUNT - 1) {
-	fprintf(stderr, "Too many point lights");
-	exit(1);
+    if (pointLightCount == pointLightCapacity) {
+	pointLightCapacity = pointLightCapacity ? pointLightCapacity*2 : 8;
+	pointLights = realloc(pointLights, sizeof(PointLight)*pointLightCapacity);
     }
+    memset(pointLights + pointLightCount, 0, sizeof(PointLight));
     return pointLightCount++;
 }
 
@@ -332,9 +1425,258 @@ PointLight*  VG_PointLightGet(u32 light) {
 }
 
 void iVG_LightInit() {
-    memset(directLights, 0, sizeof(DirectLight)*DIRECT_LIGHT_MAX_COUNT);
-    memset(pointLights,  0, sizeof(PointLight)*POINT_LIGHT_MAX_COUNT);
-    memset(flashLights,  0, sizeof(FlashLight)*FLASH_LIGHT_MAX_COUNT);
+    memset(&light_block, 0, sizeof(light_block));
+    glGenBuffers(1, &light_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, light_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(light_block), &light_block, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, light_buffer);
+    
+    // storage buffers never get bound empty
+    light_record_buffer_capacity = 1;
+    glGenBuffers(1, &light_record_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, light_record_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LightRecord), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_RECORD_BINDING, light_record_buffer);
+    
+    direct_light_record_buffer_capacity = 1;
+    glGenBuffers(1, &direct_light_record_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, direct_light_record_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(DirectLightRecord), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DIRECT_LIGHT_RECORD_BINDING, direct_light_record_buffer);
+    iVG_ClusterGridInit();
+}
+
+void iVG_LightDestroy() {
+    glDeleteBuffers(1, &light_buffer);
+    glDeleteBuffers(1, &light_record_buffer);
+    glDeleteBuffers(1, &direct_light_record_buffer);
+    free(light_records);
+    free(light_records_uploaded);
+    free(direct_light_records);
+    free(direct_light_records_uploaded);
+    free(directLights);
+    free(pointLights);
+    free(flashLights);
+    iVG_ClusterGridDestroy();
+}
+
+// Fills light_records, the lights without a range first. Returns how many those are
+u32 iVG_LightRecordsPack() {
+    light_record_count = pointLightCount + flashLightCount;
+    if (light_record_count > light_record_capacity) {
+	light_record_capacity = light_record_count;
+	light_records = realloc(light_records, sizeof(LightRecord)*light_record_capacity);
+	light_records_uploaded = realloc(light_records_uploaded, sizeof(LightRecord)*light_record_capacity);
+    }
+    
+    u32 count = 0, global_count = 0;
+    for (u32 ranged = 0; ranged < 2; ranged++) {
+	for (u32 i = 0; i < pointLightCount; i++) {
+	    PointLight* light = pointLights + i;
+	    if ((light->range > 0) != ranged) continue;
+	    iVG_LightRecordPack(light_records + count++, light->position, light->color, light->range, NULL);
+	}
+	for (u32 i = 0; i < flashLightCount; i++) {
+	    FlashLight* light = flashLights + i;
+	    if ((light->range > 0) != ranged) continue;
+	    iVG_LightRecordPack(light_records + count++, light->position, light->color, light->range, light);
+	}
+	if (!ranged) global_count = count;
+    }
+    return global_count;
+}
+
+void iVG_LightRecordPack(LightRecord* out, f32* position, f32* color, f32 range, FlashLight* flash) {
+    memset(out, 0, sizeof(LightRecord));
+    VM3_Copy(out->position, position);
+    VM3_Copy(out->color, color);
+    out->range = range > 0 ? range : 0;
+    if (flash) {
+	out->flash = 1;
+	VM3_Copy(out->direction, flash->direction);
+	out->angle = flash->angle;
+	out->cutoff = flash->cutoff;
+    }
+}
+
+// CLUSTERS
+void iVG_ClusterGridInit() {
+    memset(&cluster_grid, 0, sizeof(cluster_grid));
+    glGenBuffers(1, &cluster_grid.range_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cluster_grid.range_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(cluster_grid.ranges), cluster_grid.ranges, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BINDING, cluster_grid.range_buffer);
+    
+    cluster_grid.index_buffer_capacity = 1;
+    glGenBuffers(1, &cluster_grid.index_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cluster_grid.index_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_BINDING, cluster_grid.index_buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    cluster_grid.empty = true;
+}
+
+void iVG_ClusterGridDestroy() {
+    glDeleteBuffers(1, &cluster_grid.range_buffer);
+    glDeleteBuffers(1, &cluster_grid.index_buffer);
+    for (u32 z = 0; z < CLUSTER_Z; z++) {
+	free(cluster_grid.slices[z].indices);
+    }
+    free(cluster_grid.bounds);
+    free(cluster_grid.indices);
+}
+
+// Bins count light records starting at first and uploads the grid. The
+// froxels of every light are found here, the slice jobs only fill lists.
+void iVG_ClusterGridBuild(u32 first, u32 count) {
+    cluster_grid.bound_count = 0;
+    for (u32 i = first; i < first + count; i++) {
+	if (cluster_grid.bound_count == cluster_grid.bound_capacity) {
+	    cluster_grid.bound_capacity = cluster_grid.bound_capacity ? cluster_grid.bound_capacity*2 : 64;
+	    cluster_grid.bounds = realloc(cluster_grid.bounds, sizeof(ClusterLightBounds)*cluster_grid.bound_capacity);
+	}
+	ClusterLightBounds* bounds = cluster_grid.bounds + cluster_grid.bound_count;
+	if (iVG_ClusterLightBoundsGet(bounds, light_records[i].position, light_records[i].range)) {
+	    bounds->light = i;
+	    cluster_grid.bound_count++;
+	}
+    }
+    // a grid left empty stays valid until a light shows up
+    if (!cluster_grid.bound_count && cluster_grid.empty) return;
+    
+    JobCounter counter = {0};
+    for (u32 z = 0; z < CLUSTER_Z; z++) {
+	VG_JobSubmit(iVG_ClusterSliceJob, (void*)(uintptr_t)z, &counter);
+    }
+    VG_JobWait(&counter);
+    
+    u32 index_count = 0;
+    for (u32 z = 0; z < CLUSTER_Z; z++) {
+	index_count += cluster_grid.slices[z].index_count;
+    }
+    if (index_count > cluster_grid.index_capacity) {
+	cluster_grid.index_capacity = index_count;
+	cluster_grid.indices = realloc(cluster_grid.indices, sizeof(u32)*index_count);
+    }
+    u32 base = 0;
+    for (u32 z = 0; z < CLUSTER_Z; z++) {
+	ClusterSlice* slice = cluster_grid.slices + z;
+	for (u32 tile = 0; tile < CLUSTER_TILES; tile++) {
+	    cluster_grid.ranges[z*CLUSTER_TILES + tile][0] += base;
+	}
+	if (slice->index_count) {
+	    memcpy(cluster_grid.indices + base, slice->indices, sizeof(u32)*slice->index_count);
+	}
+	base += slice->index_count;
+    }
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cluster_grid.range_buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(cluster_grid.ranges), cluster_grid.ranges);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cluster_grid.index_buffer);
+    if (index_count > cluster_grid.index_buffer_capacity) {
+	cluster_grid.index_buffer_capacity = index_count*2;
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(u32)*cluster_grid.index_buffer_capacity, NULL, GL_DYNAMIC_DRAW);
+    }
+    if (index_count) glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(u32)*index_count, cluster_grid.indices);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    // glBufferData gives the buffer new storage, the binding follows the name
+    cluster_grid.empty = index_count == 0;
+}
+
+// Depths up to the near plane, negative ones too, are in the first slice
+u32 iVG_ClusterSliceGet(f32 depth) {
+    if (!(depth > PROJECTION_NEAR)) return 0;
+    f32 slice = logf(depth/PROJECTION_NEAR)/logf(PROJECTION_FAR/PROJECTION_NEAR)*CLUSTER_Z;
+    if (slice < 0) return 0;
+    if (slice >= CLUSTER_Z - 1) return CLUSTER_Z - 1;
+    return (u32)slice;
+}
+
+// Froxels the sphere of a light overlaps, through the screen rectangle of the
+// view space box around it. False when the sphere is out of view.
+b8 iVG_ClusterLightBoundsGet(ClusterLightBounds* out, f32* position, f32 range) {
+    f32 center[3];
+    for (u32 row = 0; row < 3; row++) {
+	center[row] = matrix_view[4*row]*position[0] + matrix_view[4*row + 1]*position[1]
+	    + matrix_view[4*row + 2]*position[2] + matrix_view[4*row + 3];
+    }
+    f32 depth = -center[2];
+    if (depth + range < PROJECTION_NEAR || depth - range > PROJECTION_FAR) return false;
+    out->min[2] = iVG_ClusterSliceGet(depth - range);
+    out->max[2] = iVG_ClusterSliceGet(depth + range);
+    
+    // a box reaching behind the near plane could land anywhere on screen
+    f32 ndc_min[2] = {-1, -1}, ndc_max[2] = {1, 1};
+    if (depth - range > PROJECTION_NEAR) {
+	ndc_min[0] = ndc_min[1] = FLT_MAX;
+	ndc_max[0] = ndc_max[1] = -FLT_MAX;
+	for (u32 corner = 0; corner < 8; corner++) {
+	    f32 v[3];
+	    for (u32 k = 0; k < 3; k++) {
+		v[k] = center[k] + (corner & (1u << k) ? range : -range);
+	    }
+	    f32 w = matrix_projection[12]*v[0] + matrix_projection[13]*v[1] + matrix_projection[14]*v[2] + matrix_projection[15];
+	    for (u32 k = 0; k < 2; k++) {
+		f32 ndc = (matrix_projection[4*k]*v[0] + matrix_projection[4*k + 1]*v[1]
+			   + matrix_projection[4*k + 2]*v[2] + matrix_projection[4*k + 3])/w;
+		ndc_min[k] = fminf(ndc_min[k], ndc);
+		ndc_max[k] = fmaxf(ndc_max[k], ndc);
+	    }
+	}
+	if (ndc_min[0] > 1 || ndc_min[1] > 1 || ndc_max[0] < -1 || ndc_max[1] < -1) return false;
+    }
+    u32 tiles[2] = {CLUSTER_X, CLUSTER_Y};
+    for (u32 k = 0; k < 2; k++) {
+	f32 low = (fmaxf(ndc_min[k], -1)*0.5f + 0.5f)*tiles[k];
+	f32 high = (fminf(ndc_max[k], 1)*0.5f + 0.5f)*tiles[k];
+	out->min[k] = (u8)fminf(low, tiles[k] - 1);
+	out->max[k] = (u8)fminf(high, tiles[k] - 1);
+    }
+    return true;
+}
+
+// Counts the lights of every froxel in a slice, turns the counts into
+// offsets and writes the lists. Offsets are relative to the slice until
+// the grid is put together.
+void iVG_ClusterSliceJob(void* data) {
+    u32 z = (u32)(uintptr_t)data;
+    ClusterSlice* slice = cluster_grid.slices + z;
+    u32 (*ranges)[2] = cluster_grid.ranges + z*CLUSTER_TILES;
+    memset(ranges, 0, sizeof(u32[2])*CLUSTER_TILES);
+    
+    for (u32 i = 0; i < cluster_grid.bound_count; i++) {
+	ClusterLightBounds* bounds = cluster_grid.bounds + i;
+	if (z < bounds->min[2] || z > bounds->max[2]) continue;
+	for (u32 y = bounds->min[1]; y <= bounds->max[1]; y++) {
+	    for (u32 x = bounds->min[0]; x <= bounds->max[0]; x++) {
+		ranges[y*CLUSTER_X + x][1]++;
+	    }
+	}
+    }
+    u32 total = 0;
+    for (u32 tile = 0; tile < CLUSTER_TILES; tile++) {
+	ranges[tile][0] = total;
+	total += ranges[tile][1];
+	ranges[tile][1] = 0;
+    }
+    if (total > slice->index_capacity) {
+	slice->index_capacity = total*2;
+	slice->indices = realloc(slice->indices, sizeof(u32)*slice->index_capacity);
+    }
+    for (u32 i = 0; i < cluster_grid.bound_count; i++) {
+	ClusterLightBounds* bounds = cluster_grid.bounds + i;
+	if (z < bounds->min[2] || z > bounds->max[2]) continue;
+	for (u32 y = bounds->min[1]; y <= bounds->max[1]; y++) {
+	    for (u32 x = bounds->min[0]; x <= bounds->max[0]; x++) {
+		u32* range = ranges[y*CLUSTER_X + x];
+		slice->indices[range[0] + range[1]++] = bounds->light;
+	    }
+	}
+    }
+    slice->index_count = total;
 }
 
 
@@ -369,18 +1711,44 @@ void VG_DrawingBegin() {
     iVG_InputUpdate();
     iVG_GLCameraUpdate();
     iVG_GLPerspectiveUpdate();
+    iVG_FrustumUpdate();
+    iVG_LodScaleUpdate();
+    iVG_GLLightUpdate();
     VG_Clear(background_color);
     time_previous = time_current;
     while(!iVG_TimeDeltaTargetReached())
 	;
-    
+    iVG_GLFrameBlockUpdate();
 }
 
 void VG_DrawingEnd() {
-    for (uint32_t i = 1; i < model_arena.position; i++) {
-	VG_ModelInstancesDraw(i);
+    iVG_OcclusionBuild();
+    iVG_ObjectTreeQuery();
+    iVG_InstancesPrepare();
+    occlusion.ready = false;
+    
+    render_queue.count = 0;
+    for (u32 i = 1; i < model_arena.position; i++) {
+	Model* model = iVG_ModelArenaPointerGet(i);
+	b8 work = iVG_ModelInstanceCountGet(model) > 0;
+	for (u32 handle = model->static_instances; handle && !work; ) {
+	    StaticInstances* set = iVG_StaticInstancesArenaPointerGet(handle);
+	    work = set->count > 0;
+	    handle = set->next;
+	}
+	if (work) iVG_RenderQueuePush(iVG_RenderKeyCompose(model), i);
+    }
+    iVG_RenderQueueSort();
+    iVG_RenderQueueSubmit();
+    
+    for (u32 i = 1; i < model_arena.position; i++) {
+	Model* model = iVG_ModelArenaPointerGet(i);
+	model->stats_visible = iVG_ModelInstanceCountGet(model);
+	model->stats_culled = model->instances_culled + model->object_count - model->objects_drawn;
+	iVG_ModelInstancesTrim(model);
 	VG_ModelInstancesClear(i);
     }
+    iVG_InstanceRingFrameEnd();
     iVG_RenderFlush();
 }
 
@@ -418,487 +1786,5324 @@ void VG_MouseGet(f32* out) {
 u32 VG_ModelNew(char* path, u32 texture, u32 shader) {
     u32 model_handle = iVG_ModelArenaBump();
     Model* model = iVG_ModelArenaPointerGet(model_handle);
-    Mesh* mesh = malloc(sizeof(Mesh));
-    VMESH_LoadObj(mesh, path);
-    model->VAO = iVG_GLLoadVerticesIndexed(mesh->vertices, mesh->vertex_count,
-				     mesh->indices, mesh->index_count);
-    model->index_count = mesh->index_count;
-    VMESH_Destroy(mesh);
+    char cache_path[4096];
+    iVG_MeshCachePathGet(path, cache_path, sizeof(cache_path));
+    b8 cached = iVG_MeshCacheFresh(path, cache_path) && iVG_MeshCacheLoad(model, cache_path);
+    if (!cached) iVG_ModelMeshImport(model, path, cache_path);
+    model->occluder = false;
     model->shader = shader;
     model->texture = texture;
     VM3_Set(model->color, 1, 1, 1);
     
-    model->instance_count = 0;
-    model->instance_capacity = 0;
-    model->instances = NULL;
-
-    model->instance_vbo_capacity = 0;
-    glGenBuffers(1, &model->instance_vbo);
+    model->instances_culled = 0;
+    model->object_count = 0;
+    model->objects_drawn = 0;
+    model->depth_nearest = FLT_MAX;
+    model->stats_visible = 0;
+    model->stats_culled = 0;
+    model->static_instances = 0;
+    model->pending_pos = NULL;
+    model->pending_rotation = NULL;
+    model->pending_size = NULL;
+    model->pending_count = 0;
+    model->pending_capacity = 0;
+
+    iVG_GLInstanceAttributesSet(model->VAO, instance_ring.buffer);
     
     return model_handle;
 }
 
-void VG_ModelInstancesDraw(u32 model_handle) {
-    Model* model = iVG_ModelArenaPointerGet(model_handle);
-    
-    VG_ShaderUse(model->shader);
-    
-    if (model->texture) {
-	iVG_TextureUse(model->texture);
-    } else {
-	iVG_TextureUse(texture_default);
+// Parses the OBJ and builds everything a model keeps of it, then writes the cache
+void iVG_ModelMeshImport(Model* model, const char* path, const char* cache_path) {
+    if (iVG_ObjStreamNeeded(path)) {
+	if (!iVG_ObjStream(model, path, cache_path)) {
+	    printf("ERROR: Could not load %s\n", path);
+	    exit(1);
+	}
+	return;
     }
     
-    iVG_GLUniformVec3Set("material.color", model->color);
+    Mesh* mesh = malloc(sizeof(Mesh));
+    if (!iVG_ObjLoad(mesh, path)) {
+	printf("ERROR: Could not load %s\n", path);
+	exit(1);
+    }
     
-    iVG_GLModelRenderInstances(model);
+    u32 index_counts[MODEL_LOD_MAX];
+    u32 lod_count;
+    u32* indices = iVG_MeshLodsBuild(mesh, &lod_count, index_counts);
+    iVG_MeshOptimize(model, mesh, indices, lod_count, index_counts);
+    iVG_Logf("%s: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f", path,
+	     model->acmr[0], model->acmr[1], model->atvr[0], model->atvr[1]);
+    iVG_ModelBoundsCompute(model, mesh);
+    iVG_ModelPositionDequantizeSet(model);
+    iVG_ModelOccluderMeshBuild(model, mesh);
+    // packed where they are, nothing reads them as floats after this
+    u64 index_count = 0;
+    for (u32 lod = 0; lod < lod_count; lod++) {
+	index_count += index_counts[lod];
+    }
+    void* vertices = iVG_VerticesQuantize(model, mesh->vertices, mesh->vertex_count);
+    void* packed = iVG_IndicesNarrow(indices, index_count, iVG_IndexSizeGet(mesh->vertex_count));
+    iVG_ModelGeometryUpload(model, vertices, mesh->vertex_count, packed, lod_count, index_counts);
+    iVG_MeshCacheStore(model, cache_path, vertices, mesh->vertex_count, packed, index_counts);
+    free(indices);
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh);
 }
 
-void VG_ModelInstancesClear(u32 model_handle) {
-    Model* model = iVG_ModelArenaPointerGet(model_handle);
-    iVG_ModelInstancesClear(model);
+// vertices and indices as they go to GL, see iVG_VerticesQuantize and iVG_IndicesNarrow
+void iVG_ModelGeometryUpload(Model* model, void* vertices, u32 vertex_count, void* indices,
+			     u32 lod_count, u32* index_counts) {
+    u32 buffers[2];
+    u64 offsets[2];
+    iVG_ModelGeometryReserve(model, vertex_count, lod_count, index_counts, buffers, offsets);
+    u64 index_count = 0;
+    for (u32 lod = 0; lod < lod_count; lod++) {
+	index_count += index_counts[lod];
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[0]);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, offsets[0], (u64)iVG_VertexStrideGet()*vertex_count, vertices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[1]);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, offsets[1], (u64)model->index_size*index_count, indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 }
 
-void VG_ModelDrawAt(u32 model_handle, f32 pos[static 3], f32 rotation[static 3], f32 size[static 3]) {
-    Model* model = iVG_ModelArenaPointerGet(model_handle);
-    if (model->instance_capacity == 0) {
-	model->instances = malloc(sizeof(InstanceData));
-	model->instance_capacity = 1;
+// Room for the vertices and the LODs, which follow each other in indices, in
+// buffers of the model's own or at the end of the pool. buffers and offsets
+// get where the vertices and the indices go.
+void iVG_ModelGeometryReserve(Model* model, u32 vertex_count, u32 lod_count, u32* index_counts,
+			      u32 buffers[2], u64 offsets[2]) {
+    u32 index_count = 0;
+    for (u32 lod = 0; lod < lod_count; lod++) {
+	index_count += index_counts[lod];
     }
-    
-    if (model->instance_count+1 > model->instance_capacity) {
-	model->instance_capacity *= 2;
-	model->instances = realloc(model->instances, sizeof(InstanceData)*model->instance_capacity);
+    u32 first_index = 0;
+    model->index_size = iVG_IndexSizeGet(vertex_count);
+    if (geometry_pool.VAO) {
+	first_index = iVG_GeometryPoolReserve(model, vertex_count, index_count);
+	buffers[0] = geometry_pool.vertex_buffer;
+	buffers[1] = geometry_pool.index_buffer;
+    } else {
+	model->VAO = iVG_GLLoadVerticesIndexed(NULL, vertex_count, NULL, index_count, model->index_size, buffers);
+	model->base_vertex = 0;
+    }
+    offsets[0] = iVG_VertexStrideGet()*(u64)model->base_vertex;
+    offsets[1] = model->index_size*(u64)first_index;
+    model->lod_count = lod_count;
+    for (u32 lod = 0; lod < lod_count; lod++) {
+	model->lods[lod] = (ModelLod){
+	    .first_index = first_index,
+	    .index_count = index_counts[lod],
+	};
+	first_index += index_counts[lod];
     }
-    InstanceData* instance_current = model->instances + model->instance_count;
-    VM44_Copy(instance_current->transform, (f32[])VM44_IDENTITY);
-    VM44_Rotate(instance_current->transform, rotation);
-    VM44_Scale(instance_current->transform, size);
-    VM44_Translate(instance_current->transform, pos);
-    VM44_Transpose(instance_current->transform);
-    model->instance_count++;
 }
 
-void VG_ModelColorSet(u32 model_handle, f32 color[static 3]) {
-    Model* model = iVG_ModelArenaPointerGet(model_handle);
-    VM3_Copy(model->color, color);
+// MESH CACHE
+// models/bunny.obj is cached as models/bunny.vgm
+void iVG_MeshCachePathGet(const char* path, char* out, u32 size) {
+    const char* dot = strrchr(path, '.');
+    const char* slash = strrchr(path, '/');
+    u32 length = dot && (!slash || dot > slash) ? (u32)(dot - path) : strlen(path);
+    snprintf(out, size, "%.*s.vgm", (int)length, path);
 }
 
-// INTERNALS
-void iVG_RenderFlush() {
-    glfwSwapBuffers(window);
+// A cache without its OBJ is used as it is
+b8 iVG_MeshCacheFresh(const char* path, const char* cache_path) {
+    struct stat source, cache;
+    if (stat(cache_path, &cache) != 0) return false;
+    if (stat(path, &source) != 0) return true;
+    if (cache.st_mtim.tv_sec != source.st_mtim.tv_sec) return cache.st_mtim.tv_sec > source.st_mtim.tv_sec;
+    return cache.st_mtim.tv_nsec >= source.st_mtim.tv_nsec;
 }
 
-void iVG_SetupOpengl() {
-    glCullFace(GL_BACK);
-    glFrontFace(GL_CCW);
-    glEnable(GL_CULL_FACE);
-
-    glClearColor(0,0,0,0);
-    glViewport(0, 0, window_size[0], window_size[1]);
+// The layout vgfx writes, a file with any other is built again. Quantized
+// files are kept apart by their attribute types.
+void iVG_MeshFileLayoutGet(MeshFileHeader* header) {
+    header->vertex_stride = iVG_VertexStrideGet();
+    header->attribute_count = 3;
+    if (vertex_quantization) {
+	header->attributes[0] = (MeshFileAttribute){0, 3, GL_SHORT, offsetof(VertexQuantized, pos)};
+	header->attributes[1] = (MeshFileAttribute){1, 4, GL_INT_2_10_10_10_REV, offsetof(VertexQuantized, normal)};
+	header->attributes[2] = (MeshFileAttribute){2, 2, GL_HALF_FLOAT, offsetof(VertexQuantized, tex)};
+    } else {
+	header->attributes[0] = (MeshFileAttribute){0, 3, GL_FLOAT, offsetof(Vertex, pos)};
+	header->attributes[1] = (MeshFileAttribute){1, 3, GL_FLOAT, offsetof(Vertex, normal)};
+	header->attributes[2] = (MeshFileAttribute){2, 2, GL_FLOAT, offsetof(Vertex, tex)};
+    }
+    header->attributes[3] = (MeshFileAttribute){0, 0, 0, 0};
 }
 
-void iVG_GLDrawTriangles(u32 amount) {
-    glDrawArrays(GL_TRIANGLES, 0, 3*amount);
+// False when the file can not be used, the model is left untouched then
+b8 iVG_MeshCacheLoad(Model* model, const char* cache_path) {
+    int file = open(cache_path, O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    if (fstat(file, &info) != 0 || (u64)info.st_size < sizeof(MeshFileHeader)) {
+	close(file);
+	return false;
+    }
+    u8* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return false;
+    
+    MeshFileHeader* header = (MeshFileHeader*)data;
+    MeshFileHeader layout;
+    iVG_MeshFileLayoutGet(&layout);
+    u64 index_count = 0;
+    for (u32 lod = 0; lod < header->lod_count && lod < MODEL_LOD_MAX; lod++) {
+	index_count += header->lod_index_counts[lod];
+    }
+    u64 blobs[4][2] = {
+	{header->vertex_offset, (u64)header->vertex_count*layout.vertex_stride},
+	{header->index_offset, (u64)index_count*header->index_size},
+	{header->occluder_position_offset, (u64)header->occluder_position_count*sizeof(f32[3])},
+	{header->occluder_index_offset, (u64)header->occluder_index_count*sizeof(u32)},
+    };
+    // files written with and without the geometry pool differ in index size
+    b8 valid = header->magic == MESH_FILE_MAGIC && header->version == MESH_FILE_VERSION
+	&& header->size == (u64)info.st_size
+	&& header->lod_count >= 1 && header->lod_count <= MODEL_LOD_MAX
+	&& header->vertex_stride == layout.vertex_stride
+	&& header->index_size == iVG_IndexSizeGet(header->vertex_count)
+	&& index_count <= UINT32_MAX
+	&& header->attribute_count == layout.attribute_count
+	&& memcmp(header->attributes, layout.attributes, sizeof(layout.attributes)) == 0;
+    for (u32 i = 0; i < ARRLEN(blobs) && valid; i++) {
+	valid = blobs[i][0] % MESH_FILE_ALIGNMENT == 0 && blobs[i][0] <= header->size
+	    && blobs[i][1] <= header->size - blobs[i][0];
+    }
+    // indices out of range would read past the buffers once drawn
+    valid = valid
+	&& iVG_MeshCacheIndicesValid(data, blobs[1][0], index_count, header->index_size, header->vertex_count)
+	&& iVG_MeshCacheIndicesValid(data, blobs[3][0], header->occluder_index_count, sizeof(u32),
+				     header->occluder_position_count);
+    if (!valid) {
+	munmap(data, info.st_size);
+	return false;
+    }
+    
+    u32 buffers[2];
+    u64 offsets[2];
+    iVG_ModelGeometryReserve(model, header->vertex_count, header->lod_count, header->lod_index_counts,
+			     buffers, offsets);
+    // under an import budget a window at a time, dropping the pages it read
+    // so a big mesh is never all in memory twice
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    for (u32 i = 0; i < 2; i++) {
+	u64 window = import_budget ? iVG_ImportWindowSizeGet() : blobs[i][1];
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffers[i]);
+	for (u64 done = 0; done < blobs[i][1]; done += window) {
+	    u64 size = blobs[i][1] - done < window ? blobs[i][1] - done : window;
+	    u8* source = data + blobs[i][0] + done;
+	    glBufferSubData(GL_COPY_WRITE_BUFFER, offsets[i] + done, size, source);
+	    if (import_budget) {
+		u8* page = data + (source - data)/page_size*page_size;
+		madvise(page, source + size - page, MADV_DONTNEED);
+	    }
+	}
+    }
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    VM3_Copy(model->aabb_min, header->aabb_min);
+    VM3_Copy(model->aabb_max, header->aabb_max);
+    VM3_Copy(model->sphere_center, header->sphere_center);
+    model->sphere_radius = header->sphere_radius;
+    iVG_ModelPositionDequantizeSet(model);
+    memcpy(model->acmr, header->acmr, sizeof(model->acmr));
+    memcpy(model->atvr, header->atvr, sizeof(model->atvr));
+    
+    u32 position_count = header->occluder_position_count;
+    model->occluder_position_count = position_count;
+    model->occluder_positions = malloc(sizeof(f32[3])*(position_count ? position_count : 1));
+    memcpy(model->occluder_positions, data + header->occluder_position_offset, blobs[2][1]);
+    model->occluder_index_count = header->occluder_index_count;
+    model->occluder_indices = malloc(sizeof(u32)*(header->occluder_index_count ? header->occluder_index_count : 1));
+    memcpy(model->occluder_indices, data + header->occluder_index_offset, blobs[3][1]);
+    munmap(data, info.st_size);
+    return true;
 }
 
-void iVG_GLVertexArrayBind(VAO_t VAO) {
-    glBindVertexArray(VAO);
+// Whether every index is below limit. Read a window at a time under an
+// import budget, dropping the pages like the upload does
+b8 iVG_MeshCacheIndicesValid(u8* data, u64 offset, u64 count, u32 index_size, u32 limit) {
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    u64 window = import_budget ? iVG_ImportWindowSizeGet()/index_size : count;
+    for (u64 done = 0; done < count; done += window) {
+	u64 end = count - done < window ? count : done + window;
+	u8* source = data + offset;
+	for (u64 i = done; i < end; i++) {
+	    u32 index = index_size == sizeof(uint16_t) ? ((uint16_t*)source)[i] : ((u32*)source)[i];
+	    if (index >= limit) return false;
+	}
+	if (import_budget) {
+	    u8* page = data + (offset + done*index_size)/page_size*page_size;
+	    madvise(page, source + end*index_size - page, MADV_DONTNEED);
+	}
+    }
+    return true;
 }
 
-void iVG_GLVertexArrayUnbind() {
-    glBindVertexArray(0);
+// Written to a temporary file first so a reader never sees half a mesh. A
+// directory that can not be written to just leaves the model uncached.
+void iVG_MeshCacheStore(Model* model, const char* cache_path, void* vertices, u32 vertex_count,
+			void* indices, u32* index_counts) {
+    MeshFileHeader header;
+    iVG_MeshFileHeaderFill(&header, model, vertex_count, index_counts);
+    u32 index_count = 0;
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	index_count += index_counts[lod];
+    }
+    const void* blobs[4] = {vertices, indices, model->occluder_positions, model->occluder_indices};
+    u64 offsets[4] = {header.vertex_offset, header.index_offset,
+		      header.occluder_position_offset, header.occluder_index_offset};
+    u64 sizes[4] = {
+	(u64)vertex_count*header.vertex_stride, (u64)index_count*header.index_size,
+	(u64)model->occluder_position_count*sizeof(f32[3]), (u64)model->occluder_index_count*sizeof(u32),
+    };
+    
+    char temp_path[4096 + 16];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", cache_path, (int)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return;
+    static const u8 zeros[MESH_FILE_ALIGNMENT];
+    b8 ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    u64 position = sizeof(header);
+    for (u32 i = 0; i < 4 && ok; i++) {
+	u64 pad = offsets[i] - position;
+	ok = fwrite(zeros, 1, pad, file) == pad && fwrite(blobs[i], 1, sizes[i], file) == sizes[i];
+	position = offsets[i] + sizes[i];
+    }
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, cache_path) != 0) remove(temp_path);
 }
 
-VAO_t iVG_GLVertexArrayNew() {
-    VAO_t VAO;
-    glGenVertexArrays(1, &VAO);
-    return VAO;
+// Everything but the blobs, which follow the header in the order of its offsets
+void iVG_MeshFileHeaderFill(MeshFileHeader* header, Model* model, u32 vertex_count, u32* index_counts) {
+    memset(header, 0, sizeof(*header));
+    header->magic = MESH_FILE_MAGIC;
+    header->version = MESH_FILE_VERSION;
+    VM3_Copy(header->aabb_min, model->aabb_min);
+    VM3_Copy(header->aabb_max, model->aabb_max);
+    VM3_Copy(header->sphere_center, model->sphere_center);
+    header->sphere_radius = model->sphere_radius;
+    memcpy(header->acmr, model->acmr, sizeof(header->acmr));
+    memcpy(header->atvr, model->atvr, sizeof(header->atvr));
+    iVG_MeshFileLayoutGet(header);
+    header->vertex_count = vertex_count;
+    header->index_size = iVG_IndexSizeGet(vertex_count);
+    header->lod_count = model->lod_count;
+    u32 index_count = 0;
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	header->lod_index_counts[lod] = index_counts[lod];
+	index_count += index_counts[lod];
+    }
+    header->occluder_position_count = model->occluder_position_count;
+    header->occluder_index_count = model->occluder_index_count;
+    
+    u64 sizes[4] = {
+	(u64)vertex_count*header->vertex_stride, (u64)index_count*header->index_size,
+	(u64)model->occluder_position_count*sizeof(f32[3]), (u64)model->occluder_index_count*sizeof(u32),
+    };
+    u64* offsets[4] = {&header->vertex_offset, &header->index_offset,
+		       &header->occluder_position_offset, &header->occluder_index_offset};
+    u64 end = sizeof(*header);
+    for (u32 i = 0; i < 4; i++) {
+	end = (end + MESH_FILE_ALIGNMENT - 1)/MESH_FILE_ALIGNMENT*MESH_FILE_ALIGNMENT;
+	*offsets[i] = end;
+	end += sizes[i];
+    }
+    header->size = end;
 }
 
-void iVG_GLVertexArrayDestroy(VAO_t VAO) {
-    glDeleteVertexArrays(1, &VAO);
+// OBJ IMPORT
+b8 VG_ObjParse(const char* path, u32* vertex_count, u32* index_count) {
+    Mesh mesh;
+    if (!iVG_ObjLoad(&mesh, path)) return false;
+    if (vertex_count) *vertex_count = mesh.vertex_count;
+    if (index_count) *index_count = mesh.index_count;
+    free(mesh.vertices);
+    free(mesh.indices);
+    return true;
 }
 
-
-void iVG_GLBufferIndices(u32* indices, u32 arr_len, u32 flags) {
+// Fills mesh with malloc'd arrays. False when the file can not be read or
+// a face points past the attributes before it
+b8 iVG_ObjLoad(Mesh* mesh, const char* path) {
+    memset(mesh, 0, sizeof(Mesh));
+    int file = open(path, O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    if (fstat(file, &info) != 0) {
+	close(file);
+	return false;
+    }
+    u64 size = info.st_size;
+    const char* data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0) : NULL;
+    close(file);
+    if (data == MAP_FAILED) return false;
+    if (size) madvise((void*)data, size, MADV_SEQUENTIAL);
+    
+    ObjImport import;
+    memset(&import, 0, sizeof(import));
+    import.mesh = mesh;
+    u64 chunk_count = job_pool.count*OBJ_CHUNKS_PER_THREAD;
+    if (chunk_count > size/OBJ_CHUNK_SIZE_MIN) chunk_count = size/OBJ_CHUNK_SIZE_MIN;
+    if (chunk_count < 1) chunk_count = 1;
+    import.chunk_count = chunk_count;
+    import.chunks = calloc(chunk_count, sizeof(ObjChunk));
+    const char* begin = data;
+    for (u32 i = 0; i < chunk_count; i++) {
+	ObjChunk* chunk = import.chunks + i;
+	const char* end = data + size*(i + 1)/chunk_count;
+	if (i + 1 < chunk_count) end = iVG_ObjLineEnd(end > begin ? end : begin, data + size);
+	if (end < data + size) end++;
+	chunk->import = &import;
+	chunk->begin = begin;
+	chunk->end = i + 1 < chunk_count ? end : data + size;
+	begin = chunk->end;
+    }
+    for (u32 shard = 0; shard < OBJ_SHARD_COUNT; shard++) {
+	import.shards[shard] = (ObjShard){&import, shard};
+    }
+    
+    iVG_ObjImportRun(&import, iVG_ObjCountJob, false);
+    for (u32 i = 0; i < import.chunk_count; i++) {
+	ObjChunk* chunk = import.chunks + i;
+	chunk->position_base = import.position_count;
+	chunk->texcoord_base = import.texcoord_count;
+	chunk->normal_base = import.normal_count;
+	import.position_count += chunk->position_count;
+	import.texcoord_count += chunk->texcoord_count;
+	import.normal_count += chunk->normal_count;
+    }
+    import.positions = malloc(sizeof(f32[3])*(import.position_count + 1));
+    import.texcoords = malloc(sizeof(f32[2])*(import.texcoord_count + 1));
+    import.normals = malloc(sizeof(f32[3])*(import.normal_count + 1));
+    
+    iVG_ObjImportRun(&import, iVG_ObjParseJob, false);
+    b8 failed = false;
+    for (u32 i = 0; i < import.chunk_count; i++) {
+	ObjChunk* chunk = import.chunks + i;
+	failed |= chunk->failed;
+	chunk->corner_base = import.corner_count;
+	import.corner_count += chunk->corner_count;
+	for (u32 shard = 0; shard < OBJ_SHARD_COUNT; shard++) {
+	    import.shard_bases[shard + 1] += chunk->shard_counts[shard];
+	}
+    }
+    if (!failed) {
+	for (u32 shard = 0; shard < OBJ_SHARD_COUNT; shard++) {
+	    import.shard_bases[shard + 1] += import.shard_bases[shard];
+	    u32 offset = import.shard_bases[shard];
+	    for (u32 i = 0; i < import.chunk_count; i++) {
+		import.chunks[i].shard_offsets[shard] = offset;
+		offset += import.chunks[i].shard_counts[shard];
+	    }
+	}
+	u32 corner_count = import.corner_count ? import.corner_count : 1;
+	import.corners = malloc(sizeof(u32[3])*corner_count);
+	import.shard_corners = malloc(sizeof(u32)*corner_count);
+	import.firsts = malloc(sizeof(u32)*corner_count);
+	import.vertex_ids = malloc(sizeof(u32)*corner_count);
+	iVG_ObjImportRun(&import, iVG_ObjScatterJob, false);
+	iVG_ObjImportRun(&import, iVG_ObjShardJob, true);
+	iVG_ObjImportRun(&import, iVG_ObjFirstCountJob, false);
+	for (u32 i = 0; i < import.chunk_count; i++) {
+	    import.chunks[i].vertex_base = mesh->vertex_count;
+	    mesh->vertex_count += import.chunks[i].first_count;
+	}
+	mesh->index_count = import.corner_count;
+	mesh->vertices = malloc(sizeof(Vertex)*(mesh->vertex_count ? mesh->vertex_count : 1));
+	mesh->indices = malloc(sizeof(u32)*corner_count);
+	iVG_ObjImportRun(&import, iVG_ObjVertexJob, false);
+	iVG_ObjImportRun(&import, iVG_ObjIndexJob, false);
+    }
+    
+    for (u32 i = 0; i < import.chunk_count; i++) {
+	free(import.chunks[i].corners);
+	free(import.chunks[i].hashes);
+    }
+    free(import.chunks);
+    free(import.positions);
+    free(import.texcoords);
+    free(import.normals);
+    free(import.corners);
+    free(import.shard_corners);
+    free(import.firsts);
+    free(import.vertex_ids);
+    if (size) munmap((void*)data, size);
+    return !failed;
+}
+
+void iVG_ObjImportRun(ObjImport* import, JobFunction function, b8 per_shard) {
+    JobCounter counter = {0};
+    if (per_shard) {
+	for (u32 shard = 0; shard < OBJ_SHARD_COUNT; shard++) {
+	    VG_JobSubmit(function, import->shards + shard, &counter);
+	}
+    } else {
+	for (u32 i = 0; i < import->chunk_count; i++) {
+	    VG_JobSubmit(function, import->chunks + i, &counter);
+	}
+    }
+    VG_JobWait(&counter);
+}
+
+void iVG_ObjCountJob(void* data) {
+    ObjChunk* chunk = data;
+    const char* p = chunk->begin;
+    while (p < chunk->end) {
+	const char* line_end = iVG_ObjLineEnd(p, chunk->end);
+	while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+	if (line_end - p >= 2 && p[0] == 'v') {
+	    if (p[1] == ' ' || p[1] == '\t') chunk->position_count++;
+	    else if (p[1] == 't') chunk->texcoord_count++;
+	    else if (p[1] == 'n') chunk->normal_count++;
+	}
+	p = line_end + 1;
+    }
+}
+
+// Attributes go to the shared arrays, faces become triangle fans
+void iVG_ObjParseJob(void* data) {
+    ObjChunk* chunk = data;
+    ObjImport* import = chunk->import;
+    u32 positions = 0, texcoords = 0, normals = 0;
+    const char* p = chunk->begin;
+    while (p < chunk->end && !chunk->failed) {
+	const char* line_end = iVG_ObjLineEnd(p, chunk->end);
+	while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+	if (line_end - p < 2 || (p[1] != ' ' && p[1] != '\t' && p[1] != 't' && p[1] != 'n')) {
+	    p = line_end + 1;
+	    continue;
+	}
+	
+	if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+	    p += 1;
+	    f32* out = import->positions[chunk->position_base + positions++];
+	    for (u32 k = 0; k < 3; k++) out[k] = iVG_ObjFloatParse(&p, line_end);
+	} else if (p[0] == 'v' && p[1] == 't') {
+	    p += 2;
+	    f32* out = import->texcoords[chunk->texcoord_base + texcoords++];
+	    for (u32 k = 0; k < 2; k++) out[k] = iVG_ObjFloatParse(&p, line_end);
+	} else if (p[0] == 'v' && p[1] == 'n') {
+	    p += 2;
+	    f32* out = import->normals[chunk->normal_base + normals++];
+	    for (u32 k = 0; k < 3; k++) out[k] = iVG_ObjFloatParse(&p, line_end);
+	} else if (p[0] == 'f') {
+	    p += 1;
+	    u32 corner[3], first[3], previous[3];
+	    u32 count = 0;
+	    while (!chunk->failed) {
+		while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+		if (p >= line_end || !iVG_ObjCornerStart(*p)) break;
+		corner[1] = corner[2] = OBJ_INDEX_NONE;
+		chunk->failed = !iVG_ObjIndexParse(&p, line_end, chunk->position_base, positions,
+						   import->position_count, corner + 0);
+		if (p < line_end && *p == '/') {
+		    p++;
+		    if (p < line_end && *p != '/') {
+			chunk->failed |= !iVG_ObjIndexParse(&p, line_end, chunk->texcoord_base, texcoords,
+							    import->texcoord_count, corner + 1);
+		    }
+		    if (p < line_end && *p == '/') {
+			p++;
+			chunk->failed |= !iVG_ObjIndexParse(&p, line_end, chunk->normal_base, normals,
+							    import->normal_count, corner + 2);
+		    }
+		}
+		if (count == 0) memcpy(first, corner, sizeof(corner));
+		if (count >= 2) {
+		    if (chunk->corner_count + 3 > chunk->corner_capacity) {
+			chunk->corner_capacity = chunk->corner_capacity ? chunk->corner_capacity*2 : 1024;
+			chunk->corners = realloc(chunk->corners, sizeof(u32[3])*chunk->corner_capacity);
+		    }
+		    memcpy(chunk->corners[chunk->corner_count++], first, sizeof(first));
+		    memcpy(chunk->corners[chunk->corner_count++], previous, sizeof(previous));
+		    memcpy(chunk->corners[chunk->corner_count++], corner, sizeof(corner));
+		}
+		memcpy(previous, corner, sizeof(corner));
+		count++;
+	    }
+	}
+	p = line_end + 1;
+    }
+    
+    chunk->hashes = malloc(sizeof(u32)*(chunk->corner_count ? chunk->corner_count : 1));
+    for (u32 i = 0; i < chunk->corner_count; i++) {
+	u32 hash = iVG_ObjCornerHash(chunk->corners[i]);
+	chunk->hashes[i] = hash;
+	chunk->shard_counts[hash >> (32 - OBJ_SHARD_BITS)]++;
+    }
+}
+
+void iVG_ObjScatterJob(void* data) {
+    ObjChunk* chunk = data;
+    ObjImport* import = chunk->import;
+    if (!chunk->corner_count) return;
+    memcpy(import->corners + chunk->corner_base, chunk->corners, sizeof(u32[3])*chunk->corner_count);
+    for (u32 i = 0; i < chunk->corner_count; i++) {
+	u32 shard = chunk->hashes[i] >> (32 - OBJ_SHARD_BITS);
+	import->shard_corners[chunk->shard_offsets[shard]++] = chunk->corner_base + i;
+    }
+}
+
+// Open addressing over the corners of one shard, each corner learns the
+// first corner with the same tuple
+void iVG_ObjShardJob(void* data) {
+    ObjShard* shard = data;
+    ObjImport* import = shard->import;
+    u32* corners = import->shard_corners + import->shard_bases[shard->shard];
+    u32 count = import->shard_bases[shard->shard + 1] - import->shard_bases[shard->shard];
+    u32 capacity = 16;
+    while (capacity < count*2) capacity *= 2;
+    u32* table = malloc(sizeof(u32)*capacity);
+    memset(table, 0xFF, sizeof(u32)*capacity);
+    for (u32 i = 0; i < count; i++) {
+	u32 corner = corners[i];
+	u32* key = import->corners[corner];
+	u32 slot = iVG_ObjCornerHash(key) & (capacity - 1);
+	while (table[slot] != OBJ_INDEX_NONE && memcmp(import->corners[table[slot]], key, sizeof(u32[3]))) {
+	    slot = (slot + 1) & (capacity - 1);
+	}
+	if (table[slot] == OBJ_INDEX_NONE) table[slot] = corner;
+	import->firsts[corner] = table[slot];
+    }
+    free(table);
+}
+
+void iVG_ObjFirstCountJob(void* data) {
+    ObjChunk* chunk = data;
+    u32* firsts = chunk->import->firsts;
+    for (u32 i = chunk->corner_base; i < chunk->corner_base + chunk->corner_count; i++) {
+	chunk->first_count += firsts[i] == i;
+    }
+}
+
+void iVG_ObjVertexJob(void* data) {
+    ObjChunk* chunk = data;
+    ObjImport* import = chunk->import;
+    u32 vertex = chunk->vertex_base;
+    for (u32 i = chunk->corner_base; i < chunk->corner_base + chunk->corner_count; i++) {
+	if (import->firsts[i] != i) continue;
+	u32* corner = import->corners[i];
+	Vertex* out = import->mesh->vertices + vertex;
+	memset(out, 0, sizeof(Vertex));
+	VM3_Copy(out->pos, import->positions[corner[0]]);
+	if (corner[1] != OBJ_INDEX_NONE) VM2_Copy(out->tex, import->texcoords[corner[1]]);
+	if (corner[2] != OBJ_INDEX_NONE) VM3_Copy(out->normal, import->normals[corner[2]]);
+	import->vertex_ids[i] = vertex++;
+    }
+}
+
+void iVG_ObjIndexJob(void* data) {
+    ObjChunk* chunk = data;
+    ObjImport* import = chunk->import;
+    for (u32 i = chunk->corner_base; i < chunk->corner_base + chunk->corner_count; i++) {
+	import->mesh->indices[i] = import->vertex_ids[import->firsts[i]];
+    }
+}
+
+// Next '\n' at or after p, end when there is none
+const char* iVG_ObjLineEnd(const char* p, const char* end) {
+#if defined(__SSE2__)
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= end; p += 16) {
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), newline));
+	if (mask) return p + __builtin_ctz(mask);
+    }
+#endif
+    const char* found = p < end ? memchr(p, '\n', end - p) : NULL;
+    return found ? found : end;
+}
+
+// Decimal digits gathered into an integer and scaled by one exact power of
+// ten in f64, which is exact while both fit the mantissa. Anything longer
+// or odder goes through strtod.
+f32 iVG_ObjFloatParse(const char** cursor, const char* end) {
+    static const f64 powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const char* p = *cursor;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    const char* start = p;
+    b8 negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    
+    u64 mantissa = 0;
+    int32_t exponent = 0, digits = 0;
+    b8 exact = true;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+	if (digits < 19) mantissa = mantissa*10 + (*p - '0');
+	else exponent++;
+	digits += mantissa > 0;
+    }
+    b8 any = p > start && (p[-1] >= '0' && p[-1] <= '9');
+    if (p < end && *p == '.') {
+	p++;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+	    any = true;
+	    if (digits < 19) {
+		mantissa = mantissa*10 + (*p - '0');
+		exponent--;
+		digits += mantissa > 0;
+	    } else if (*p != '0') {
+		exact = false;
+	    }
+	}
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+	const char* q = p + 1;
+	b8 exponent_negative = q < end && *q == '-';
+	if (q < end && (*q == '-' || *q == '+')) q++;
+	if (q < end && *q >= '0' && *q <= '9') {
+	    int32_t value = 0;
+	    for (; q < end && *q >= '0' && *q <= '9'; q++) {
+		if (value < 100000) value = value*10 + (*q - '0');
+	    }
+	    exponent += exponent_negative ? -value : value;
+	    p = q;
+	}
+    }
+    
+    if (any && exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22) {
+	*cursor = p;
+	f64 value = exponent < 0 ? (f64)mantissa/powers[-exponent] : (f64)mantissa*powers[exponent];
+	return (f32)(negative ? -value : value);
+    }
+    
+    char buffer[128];
+    const char* token_end = start;
+    while (token_end < end && token_end - start < (long)sizeof(buffer) - 1
+	   && *token_end != ' ' && *token_end != '\t' && *token_end != '\r' && *token_end != '\n') {
+	token_end++;
+    }
+    memcpy(buffer, start, token_end - start);
+    buffer[token_end - start] = '\0';
+    char* parsed_end;
+    f64 value = strtod(buffer, &parsed_end);
+    *cursor = start + (parsed_end - buffer);
+    return (f32)value;
+}
+
+// One 1 based or negative index into the attributes, local counting those
+// of the chunk before this line. False for 0 or anything out of range.
+b8 iVG_ObjIndexParse(const char** cursor, const char* end, u32 base, u32 local, u32 total, u32* out) {
+    const char* p = *cursor;
+    b8 negative = p < end && *p == '-';
+    if (negative) p++;
+    int64_t value = 0;
+    const char* digits = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+	if (value < (1ll << 40)) value = value*10 + (*p - '0');
+    }
+    *cursor = p;
+    if (p == digits || value == 0) return false;
+    int64_t index = negative ? (int64_t)base + local - value : value - 1;
+    if (index < 0 || index >= total) return false;
+    *out = (u32)index;
+    return true;
+}
+
+// Corners of a face end at the first token that can't be an index, such
+// as a # comment, and whatever follows is ignored
+b8 iVG_ObjCornerStart(char c) {
+    return (c >= '0' && c <= '9') || c == '-';
+}
+
+u32 iVG_ObjCornerHash(u32* corner) {
+    u32 hash = corner[0]*0x9E3779B1u ^ corner[1]*0x85EBCA77u ^ corner[2]*0xC2B2AE3Du;
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    hash *= 0x297A2D39u;
+    hash ^= hash >> 15;
+    return hash;
+}
+
+// STREAMING IMPORT
+void VG_ImportBudgetSet(u64 bytes) {
+    import_budget = bytes;
+}
+
+// The read window and the staging window take a quarter of the budget
+u64 iVG_ImportWindowSizeGet() {
+    u64 size = import_budget/8;
+    if (size < OBJ_STREAM_WINDOW_MIN) size = OBJ_STREAM_WINDOW_MIN;
+    if (size > OBJ_STREAM_WINDOW_MAX) size = OBJ_STREAM_WINDOW_MAX;
+    return size;
+}
+
+// The import in memory grows with the triangles rather than the bytes of
+// the file, which only need counting when there can be enough of them
+b8 iVG_ObjStreamNeeded(const char* path) {
+    struct stat info;
+    if (!import_budget || stat(path, &info) != 0) return false;
+    if ((u64)info.st_size/OBJ_TRIANGLE_BYTES_MIN*OBJ_IMPORT_TRIANGLE_COST <= import_budget) return false;
+    return iVG_ObjTriangleCount(path)*OBJ_IMPORT_TRIANGLE_COST > import_budget;
+}
+
+// Triangles of the fans of all faces, 0 when the file can not be read
+u64 iVG_ObjTriangleCount(const char* path) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) return 0;
+    posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char* window = malloc(OBJ_STREAM_WINDOW_MIN);
+    u64 triangles = 0;
+    u64 kept = 0;
+    for (;;) {
+	ssize_t got = read(file, window + kept, OBJ_STREAM_WINDOW_MIN - kept);
+	if (got < 0) break;
+	b8 last = got == 0;
+	const char* end = window + kept + got;
+	const char* p = window;
+	while (p < end) {
+	    const char* line_end = iVG_ObjLineEnd(p, end);
+	    if (line_end == end && !last) break;
+	    while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+	    if (line_end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+		u32 count = 0;
+		for (p += 1; p < line_end; p++) {
+		    b8 space = *p == ' ' || *p == '\t' || *p == '\r';
+		    b8 start = p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r';
+		    if (space || !start) continue;
+		    if (!iVG_ObjCornerStart(*p)) break;
+		    count++;
+		}
+		if (count >= 3) triangles += count - 2;
+	    }
+	    p = line_end + 1;
+	}
+	if (last) break;
+	// a line longer than the window is no face worth counting
+	kept = end - p;
+	if (kept == OBJ_STREAM_WINDOW_MIN) kept = 0;
+	memmove(window, p, kept);
+    }
+    free(window);
+    close(file);
+    return triangles;
+}
+
+// False when the file can not be read or a face is broken. The model has
+// its geometry and bounds after true, the caller gives up after false.
+b8 iVG_ObjStream(Model* model, const char* path, const char* cache_path) {
+    ObjStream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.model = model;
+    stream.file = open(path, O_RDONLY);
+    if (stream.file < 0) return false;
+    posix_fadvise(stream.file, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream.window_size = iVG_ImportWindowSizeGet();
+    stream.window = malloc(stream.window_size);
+    stream.staging = malloc(stream.window_size);
+    
+    b8 ok = true;
+    for (u32 i = 0; i < 3; i++) {
+	stream.spills[i] = iVG_ObjStreamSpillOpen(cache_path, i);
+	ok &= stream.spills[i] != NULL;
+    }
+    VM3_Set(model->aabb_min, 0, 0, 0);
+    VM3_Set(model->aabb_max, 0, 0, 0);
+    stream.shared = true;
+    ok = ok && iVG_ObjStreamPass(&stream, iVG_ObjStreamAttributeLine) && stream.corner_count <= UINT32_MAX;
+    stream.shared = stream.shared && stream.corner_count;
+    stream.vertex_count = stream.shared ? stream.counts[0] : stream.corner_count;
+    if (stream.shared) stream.used = malloc(stream.vertex_count/8 + 1);
+    
+    void* mappings[3] = {NULL, NULL, NULL};
+    u64 mapping_sizes[3] = {
+	(u64)stream.counts[0]*sizeof(f32[3]), (u64)stream.counts[1]*sizeof(f32[2]), (u64)stream.counts[2]*sizeof(f32[3]),
+    };
+    for (u32 i = 0; i < 3 && ok; i++) {
+	if (!mapping_sizes[i]) continue;
+	ok = fflush(stream.spills[i]) == 0;
+	mappings[i] = ok ? mmap(NULL, mapping_sizes[i], PROT_READ, MAP_PRIVATE, fileno(stream.spills[i]), 0) : NULL;
+	if (mappings[i] == MAP_FAILED) mappings[i] = NULL;
+	ok = ok && mappings[i];
+	if (ok) madvise(mappings[i], mapping_sizes[i], MADV_RANDOM);
+    }
+    stream.positions = mappings[0];
+    stream.texcoords = mappings[1];
+    stream.normals = mappings[2];
+    
+    if (ok) {
+	for (u32 k = 0; k < 3; k++) {
+	    model->sphere_center[k] = (model->aabb_min[k] + model->aabb_max[k])*0.5f;
+	}
+	iVG_ModelPositionDequantizeSet(model);
+	model->lod_count = 1;
+	model->occluder_position_count = 0;
+	model->occluder_index_count = 0;
+	ok = iVG_ObjStreamToCache(&stream, cache_path) && iVG_MeshCacheLoad(model, cache_path);
+	if (!ok && !stream.failed) ok = iVG_ObjStreamToBuffers(&stream);
+    }
+    
+    for (u32 i = 0; i < 3; i++) {
+	if (mappings[i]) munmap(mappings[i], mapping_sizes[i]);
+	if (stream.spills[i]) fclose(stream.spills[i]);
+    }
+    free(stream.used);
+    free(stream.window);
+    free(stream.staging);
+    close(stream.file);
+    return ok;
+}
+
+// Unlinked at once so nothing is left behind. Next to the cache the pages
+// can be written back and dropped, unlike in a tmpfile() that may be in
+// memory, which is only used when the cache directory can not be written to
+FILE* iVG_ObjStreamSpillOpen(const char* cache_path, u32 spill) {
+    char spill_path[4096 + 32];
+    snprintf(spill_path, sizeof(spill_path), "%s.%d.spill%u", cache_path, (int)getpid(), spill);
+    int file = open(spill_path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (file < 0) return tmpfile();
+    unlink(spill_path);
+    FILE* out = fdopen(file, "w+b");
+    if (!out) close(file);
+    return out;
+}
+
+// Faces look up the spills all over, so the mappings are dropped whole
+// and only what the next window reads comes back
+void iVG_ObjStreamSpillsDrop(ObjStream* stream) {
+    void* mappings[3] = {stream->positions, stream->texcoords, stream->normals};
+    u64 sizes[3] = {sizeof(f32[3]), sizeof(f32[2]), sizeof(f32[3])};
+    for (u32 i = 0; i < 3; i++) {
+	if (mappings[i]) madvise(mappings[i], (u64)stream->counts[i]*sizes[i], MADV_DONTNEED);
+    }
+}
+
+// Calls line for every line of the file, read one window at a time. False
+// when line does or a line is longer than the window.
+b8 iVG_ObjStreamPass(ObjStream* stream, ObjStreamLineFunction line) {
+    if (lseek(stream->file, 0, SEEK_SET) != 0) return false;
+    u64 kept = 0;
+    u64 offset = 0;
+    for (;;) {
+	ssize_t got = read(stream->file, stream->window + kept, stream->window_size - kept);
+	if (got < 0) return false;
+	b8 last = got == 0;
+	const char* end = stream->window + kept + got;
+	const char* p = stream->window;
+	while (p < end) {
+	    const char* line_end = iVG_ObjLineEnd(p, end);
+	    if (line_end == end && !last) break;
+	    if (!line(stream, p, line_end)) return false;
+	    p = line_end + 1;
+	}
+	if (last) return true;
+	// the page cache would otherwise keep what was read
+	posix_fadvise(stream->file, offset, got, POSIX_FADV_DONTNEED);
+	iVG_ObjStreamSpillsDrop(stream);
+	offset += got;
+	kept = end - p;
+	if (kept == stream->window_size) return false;
+	memmove(stream->window, p, kept);
+    }
+}
+
+// v, vt and vn go to their spill files, faces are counted and checked for
+// corners that share their indices
+b8 iVG_ObjStreamAttributeLine(ObjStream* stream, const char* p, const char* line_end) {
+    while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+    if (line_end - p < 2) return true;
+    Model* model = stream->model;
+    
+    if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+	p += 1;
+	f32 position[3];
+	for (u32 k = 0; k < 3; k++) position[k] = iVG_ObjFloatParse(&p, line_end);
+	if (!stream->counts[0]) {
+	    VM3_Copy(model->aabb_min, position);
+	    VM3_Copy(model->aabb_max, position);
+	}
+	for (u32 k = 0; k < 3; k++) {
+	    model->aabb_min[k] = fminf(model->aabb_min[k], position[k]);
+	    model->aabb_max[k] = fmaxf(model->aabb_max[k], position[k]);
+	}
+	stream->counts[0]++;
+	return fwrite(position, sizeof(position), 1, stream->spills[0]) == 1;
+    } else if (p[0] == 'v' && p[1] == 't') {
+	p += 2;
+	f32 texcoord[2];
+	for (u32 k = 0; k < 2; k++) texcoord[k] = iVG_ObjFloatParse(&p, line_end);
+	stream->counts[1]++;
+	return fwrite(texcoord, sizeof(texcoord), 1, stream->spills[1]) == 1;
+    } else if (p[0] == 'v' && p[1] == 'n') {
+	p += 2;
+	f32 normal[3];
+	for (u32 k = 0; k < 3; k++) normal[k] = iVG_ObjFloatParse(&p, line_end);
+	stream->counts[2]++;
+	return fwrite(normal, sizeof(normal), 1, stream->spills[2]) == 1;
+    } else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+	// later attributes are not counted yet, the second pass checks the range
+	u32 totals[3] = {UINT32_MAX, UINT32_MAX, UINT32_MAX};
+	u32 count = 0;
+	for (p += 1;; count++) {
+	    while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+	    if (p >= line_end || !iVG_ObjCornerStart(*p)) break;
+	    u32 index[3];
+	    if (!iVG_ObjStreamCornerParse(stream, &p, line_end, stream->counts, totals, index)) return false;
+	    u32 layout = 1 | (index[1] != OBJ_INDEX_NONE) << 1 | (index[2] != OBJ_INDEX_NONE) << 2;
+	    if (!stream->layout) stream->layout = layout;
+	    stream->shared = stream->shared && layout == stream->layout
+		&& (index[1] == OBJ_INDEX_NONE || index[1] == index[0])
+		&& (index[2] == OBJ_INDEX_NONE || index[2] == index[0]);
+	}
+	if (count >= 3) stream->corner_count += 3*(count - 2);
+    }
+    return true;
+}
+
+// Every corner of the triangle fans becomes a vertex, or an index of the
+// positions when they are shared
+b8 iVG_ObjStreamFaceLine(ObjStream* stream, const char* p, const char* line_end) {
+    while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+    if (line_end - p < 2) return true;
+    if (p[0] == 'v') {
+	if (p[1] == ' ' || p[1] == '\t') stream->seen[0]++;
+	else if (p[1] == 't') stream->seen[1]++;
+	else if (p[1] == 'n') stream->seen[2]++;
+	return true;
+    }
+    if (p[0] != 'f' || (p[1] != ' ' && p[1] != '\t')) return true;
+    
+    p += 1;
+    Vertex corner, first, previous;
+    u32 index[3], first_index = 0, previous_index = 0;
+    u32 count = 0;
+    for (;;) {
+	while (p < line_end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+	if (p >= line_end || !iVG_ObjCornerStart(*p)) break;
+	if (!iVG_ObjStreamCornerParse(stream, &p, line_end, stream->seen, stream->counts, index)) return false;
+	if (stream->shared) {
+	    if (count == 0) first_index = index[0];
+	    if (count >= 2) {
+		u32 triangle[3] = {first_index, previous_index, index[0]};
+		for (u32 i = 0; i < 3; i++) {
+		    if (!iVG_ObjStreamIndexPush(stream, triangle[i])) return false;
+		}
+	    }
+	    previous_index = index[0];
+	    count++;
+	    continue;
+	}
+	memset(&corner, 0, sizeof(corner));
+	VM3_Copy(corner.pos, stream->positions[index[0]]);
+	if (index[1] != OBJ_INDEX_NONE) VM2_Copy(corner.tex, stream->texcoords[index[1]]);
+	if (index[2] != OBJ_INDEX_NONE) VM3_Copy(corner.normal, stream->normals[index[2]]);
+	
+	if (count == 0) first = corner;
+	if (count >= 2) {
+	    Vertex* triangle[3] = {&first, &previous, &corner};
+	    for (u32 i = 0; i < 3; i++) {
+		if (!iVG_ObjStreamVertexPush(stream, triangle[i])) return false;
+	    }
+	}
+	previous = corner;
+	count++;
+    }
+    return true;
+}
+
+// One v/vt/vn corner, OBJ_INDEX_NONE for what it leaves out. Seen counts
+// the attributes before the line. False for a broken corner.
+b8 iVG_ObjStreamCornerParse(ObjStream* stream, const char** cursor, const char* line_end,
+			    u32* seen, u32* totals, u32* index) {
+    const char* p = *cursor;
+    index[0] = 0;
+    index[1] = index[2] = OBJ_INDEX_NONE;
+    b8 ok = iVG_ObjIndexParse(&p, line_end, 0, seen[0], totals[0], index + 0);
+    if (p < line_end && *p == '/') {
+	p++;
+	if (p < line_end && *p != '/') {
+	    ok &= iVG_ObjIndexParse(&p, line_end, 0, seen[1], totals[1], index + 1);
+	}
+	if (p < line_end && *p == '/') {
+	    p++;
+	    ok &= iVG_ObjIndexParse(&p, line_end, 0, seen[2], totals[2], index + 2);
+	}
+    }
+    *cursor = p;
+    if (!ok) stream->failed = true;
+    return ok;
+}
+
+// Quantized when the model is, and taken into the bounding sphere
+b8 iVG_ObjStreamVertexPush(ObjStream* stream, Vertex* vertex) {
+    u8* out = iVG_ObjStreamSinkPush(stream, &stream->vertices);
+    if (!out) return false;
+    if (vertex_quantization) {
+	iVG_VertexQuantize((VertexQuantized*)out, vertex, stream->model->position_dequantize);
+    } else {
+	memcpy(out, vertex, sizeof(Vertex));
+    }
+    f32* center = stream->model->sphere_center;
+    f32 d[3] = {vertex->pos[0] - center[0], vertex->pos[1] - center[1], vertex->pos[2] - center[2]};
+    stream->radius2 = fmaxf(stream->radius2, d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    return true;
+}
+
+// Narrowed to the index size, and run through the cache when vertices are shared
+b8 iVG_ObjStreamIndexPush(ObjStream* stream, u32 index) {
+    u8* out = iVG_ObjStreamSinkPush(stream, &stream->indices);
+    if (!out) return false;
+    if (stream->indices.element_size == sizeof(uint16_t)) *(uint16_t*)out = (uint16_t)index;
+    else *(u32*)out = index;
+    if (!stream->shared) return true;
+    
+    for (u32 i = 0; i < VERTEX_CACHE_SIZE; i++) {
+	if (stream->cache[i] == index) return true;
+    }
+    stream->cache[stream->cache_next] = index;
+    stream->cache_next = (stream->cache_next + 1) % VERTEX_CACHE_SIZE;
+    stream->misses++;
+    stream->used[index/8] |= 1 << index%8;
+    return true;
+}
+
+// The vertices, from the positions in order when they are shared and from
+// the second pass otherwise, then the indices, from the second pass or
+// counting up from 0 as no vertex is shared
+b8 iVG_ObjStreamEmit(ObjStream* stream) {
+    memset(stream->seen, 0, sizeof(stream->seen));
+    stream->radius2 = 0;
+    memset(stream->cache, 0xFF, sizeof(stream->cache));
+    stream->cache_next = 0;
+    stream->misses = 0;
+    if (stream->used) memset(stream->used, 0, stream->vertex_count/8 + 1);
+    ObjStreamSink* vertices = &stream->vertices;
+    ObjStreamSink* indices = &stream->indices;
+    Model* model = stream->model;
+    
+    if (stream->shared) {
+	u32 window = stream->window_size/sizeof(f32[3]);
+	for (u32 i = 0; i < stream->vertex_count; i++) {
+	    Vertex vertex;
+	    memset(&vertex, 0, sizeof(vertex));
+	    VM3_Copy(vertex.pos, stream->positions[i]);
+	    if (i < stream->counts[1] && stream->layout & 2) VM2_Copy(vertex.tex, stream->texcoords[i]);
+	    if (i < stream->counts[2] && stream->layout & 4) VM3_Copy(vertex.normal, stream->normals[i]);
+	    if (!iVG_ObjStreamVertexPush(stream, &vertex)) return false;
+	    if (i % window == window - 1) iVG_ObjStreamSpillsDrop(stream);
+	}
+	if (!iVG_ObjStreamSinkFlush(stream, vertices)) return false;
+	if (!iVG_ObjStreamPass(stream, iVG_ObjStreamFaceLine)) return false;
+	// a face the first pass counted differently
+	if (indices->written + indices->count != indices->total) {
+	    stream->failed = true;
+	    return false;
+	}
+	u32 used = 0;
+	for (u32 i = 0; i < stream->vertex_count/8 + 1; i++) {
+	    used += __builtin_popcount(stream->used[i]);
+	}
+	for (u32 i = 0; i < 2; i++) {
+	    model->acmr[i] = (f32)stream->misses/(indices->total/3);
+	    model->atvr[i] = (f32)stream->misses/used;
+	}
+    } else {
+	if (!iVG_ObjStreamPass(stream, iVG_ObjStreamFaceLine)) return false;
+	if (vertices->written + vertices->count != vertices->total) {
+	    stream->failed = true;
+	    return false;
+	}
+	if (!iVG_ObjStreamSinkFlush(stream, vertices)) return false;
+	for (u64 i = 0; i < indices->total; i++) {
+	    if (!iVG_ObjStreamIndexPush(stream, (u32)i)) return false;
+	}
+	// every corner is a vertex of its own
+	for (u32 i = 0; i < 2; i++) {
+	    model->acmr[i] = indices->total ? 3 : 0;
+	    model->atvr[i] = indices->total ? 1 : 0;
+	}
+    }
+    model->sphere_radius = sqrtf(stream->radius2);
+    return iVG_ObjStreamSinkFlush(stream, indices);
+}
+
+// Next element of the window, NULL when the sink is full or can not be written
+u8* iVG_ObjStreamSinkPush(ObjStream* stream, ObjStreamSink* sink) {
+    if (sink->count == sink->capacity) {
+	if (!iVG_ObjStreamSinkFlush(stream, sink)) return NULL;
+	if (!sink->capacity) {
+	    stream->failed = true;
+	    return NULL;
+	}
+    }
+    return sink->window + (u64)sink->count++*sink->element_size;
+}
+
+// Hands the window on and opens the next one, if anything is left
+b8 iVG_ObjStreamSinkFlush(ObjStream* stream, ObjStreamSink* sink) {
+    if (sink->file && sink->count) {
+	u64 offset = sink->offset + sink->written*sink->element_size;
+	if (fseeko(sink->file, offset, SEEK_SET) != 0
+	    || fwrite(sink->window, sink->element_size, sink->count, sink->file) != sink->count) {
+	    return false;
+	}
+    }
+    if (!sink->file && sink->window) {
+	glBindBuffer(GL_COPY_WRITE_BUFFER, sink->buffer);
+	b8 ok = glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	sink->window = NULL;
+	if (!ok) return false;
+    }
+    sink->written += sink->count;
+    sink->count = 0;
+    u64 capacity = stream->window_size/sink->element_size;
+    sink->capacity = capacity < sink->total - sink->written ? capacity : sink->total - sink->written;
+    if (sink->file) {
+	sink->window = stream->staging;
+    } else if (sink->capacity) {
+	glBindBuffer(GL_COPY_WRITE_BUFFER, sink->buffer);
+	sink->window = glMapBufferRange(GL_COPY_WRITE_BUFFER, sink->offset + sink->written*sink->element_size,
+					 (u64)sink->capacity*sink->element_size,
+					 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	if (!sink->window) return false;
+    }
+    return true;
+}
+
+// Into a temporary file that becomes cache_path once it is complete
+b8 iVG_ObjStreamToCache(ObjStream* stream, const char* cache_path) {
+    Model* model = stream->model;
+    u32 index_counts[1] = {(u32)stream->corner_count};
+    MeshFileHeader header;
+    iVG_MeshFileHeaderFill(&header, model, stream->vertex_count, index_counts);
+    char temp_path[4096 + 16];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", cache_path, (int)getpid());
+    FILE* file = fopen(temp_path, "wb");
+    if (!file) return false;
+    stream->vertices = (ObjStreamSink){
+	.file = file, .offset = header.vertex_offset,
+	.element_size = header.vertex_stride, .total = stream->vertex_count,
+    };
+    stream->indices = (ObjStreamSink){
+	.file = file, .offset = header.index_offset,
+	.element_size = header.index_size, .total = stream->corner_count,
+    };
+    b8 ok = iVG_ObjStreamEmit(stream);
+    // again with the radius and the cache stats, which the second pass found
+    iVG_MeshFileHeaderFill(&header, model, stream->vertex_count, index_counts);
+    ok = ok && fseeko(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1
+	&& fflush(file) == 0 && ftruncate(fileno(file), header.size) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temp_path, cache_path) != 0) {
+	remove(temp_path);
+	return false;
+    }
+    return true;
+}
+
+// Into mapped ranges of the model's own buffers or of the geometry pool
+b8 iVG_ObjStreamToBuffers(ObjStream* stream) {
+    Model* model = stream->model;
+    u32 count = stream->corner_count;
+    u32 buffers[2];
+    u64 offsets[2];
+    iVG_ModelGeometryReserve(model, stream->vertex_count, 1, &count, buffers, offsets);
+    model->occluder_positions = malloc(sizeof(f32[3]));
+    model->occluder_indices = malloc(sizeof(u32));
+    stream->vertices = (ObjStreamSink){
+	.buffer = buffers[0], .offset = offsets[0],
+	.element_size = iVG_VertexStrideGet(), .total = stream->vertex_count,
+    };
+    stream->indices = (ObjStreamSink){
+	.buffer = buffers[1], .offset = offsets[1],
+	.element_size = model->index_size, .total = count,
+    };
+    return iVG_ObjStreamEmit(stream);
+}
+
+void VG_ModelInstancesDraw(u32 model_handle) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    if (model->pending_count) iVG_InstancesPrepare();
+    
+    VG_ShaderUse(model->shader);
+    
+    if (model->texture) {
+	iVG_TextureUse(model->texture);
+    } else {
+	iVG_TextureUse(texture_default);
+    }
+    
+    iVG_GLMaterialColorSet(model->color);
+    iVG_GLPositionDequantizeSet(model);
+    
+    iVG_GLModelRenderInstances(model);
+    iVG_GLModelRenderStatic(model);
+}
+
+void VG_ModelInstancesClear(u32 model_handle) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    iVG_ModelInstancesClear(model);
+}
+
+void VG_ModelDrawAt(u32 model_handle, f32 pos[static 3], f32 rotation[static 3], f32 size[static 3]) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    iVG_ModelPendingPush(model, 1, (f32(*)[3])pos, (f32(*)[3])rotation, (f32(*)[3])size);
+}
+
+void VG_ModelDrawBatch(u32 model_handle, u32 count, f32 pos[][3], f32 rotation[][3], f32 size[][3]) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    iVG_ModelPendingPush(model, count, pos, rotation, size);
+}
+
+void VG_ModelColorSet(u32 model_handle, f32 color[static 3]) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    VM3_Copy(model->color, color);
+}
+
+void VG_InstanceShrinkFramesSet(u32 frames) {
+    instance_shrink_frames = frames;
+}
+
+void VG_FrustumCullingSet(b8 enabled) {
+    frustum_culling = enabled;
+}
+
+void VG_LODBiasSet(f32 bias) {
+    lod_bias = bias;
+    iVG_LodScaleUpdate();
+}
+
+void VG_ModelOccluderSet(u32 model_handle, b8 occluder) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    model->occluder = occluder;
+}
+
+void VG_OcclusionCullingSet(b8 enabled) {
+    occlusion_culling = enabled;
+}
+
+void VG_ModelCullStatsGet(u32 model_handle, u32* visible, u32* culled) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    if (visible) *visible = model->stats_visible;
+    if (culled)  *culled  = model->stats_culled;
+}
+
+u32 VG_ModelStaticInstancesCreate(u32 model_handle, u32 count, InstanceTransform* transforms) {
+    u32 handle = iVG_StaticInstancesArenaBump();
+    StaticInstances* set = iVG_StaticInstancesArenaPointerGet(handle);
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    
+    set->model = model_handle;
+    set->count = count;
+    set->next = model->static_instances;
+    model->static_instances = handle;
+    
+    glGenBuffers(1, &set->buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, set->buffer);
+    glBufferStorage(GL_ARRAY_BUFFER, instance_stride*(count ? count : 1), NULL, GL_DYNAMIC_STORAGE_BIT);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    iVG_StaticInstancesWrite(set, 0, count, transforms);
+    
+    return handle;
+}
+
+void VG_ModelStaticInstancesUpdate(u32 handle, u32 first, u32 count, InstanceTransform* transforms) {
+    StaticInstances* set = iVG_StaticInstancesArenaPointerGet(handle);
+    assert(first + count <= set->count && "Static instance update out of range");
+    iVG_StaticInstancesWrite(set, first, count, transforms);
+}
+
+void VG_ModelStaticInstancesDestroy(u32 handle) {
+    StaticInstances* set = iVG_StaticInstancesArenaPointerGet(handle);
+    if (!set->buffer) {
+	assert(false && "Static instances are already destroyed");
+	return;
+    }
+    Model* model = iVG_ModelArenaPointerGet(set->model);
+    
+    u32* link = &model->static_instances;
+    while (*link != handle) {
+	link = &iVG_StaticInstancesArenaPointerGet(*link)->next;
+    }
+    *link = set->next;
+    
+    glDeleteBuffers(1, &set->buffer);
+    set->buffer = 0;
+    set->count = 0;
+}
+
+u32 VG_ObjectCreate(u32 model_handle, InstanceTransform* transform) {
+    u32 handle = iVG_ObjectArenaBump();
+    u32 leaf = iVG_ObjectTreeNodeAlloc();
+    Object* object = iVG_ObjectArenaPointerGet(handle);
+    
+    object->model = model_handle;
+    object->leaf = leaf;
+    object_tree.nodes[leaf].object = handle;
+    iVG_ModelArenaPointerGet(model_handle)->object_count++;
+    VG_ObjectTransformSet(handle, transform);
+    
+    return handle;
+}
+
+void VG_ObjectTransformSet(u32 handle, InstanceTransform* transform) {
+    Object* object = iVG_ObjectArenaPointerGet(handle);
+    assert(object->model && "Object was destroyed");
+    object->transform = *transform;
+    iVG_InstanceRowsCompose(object->rows, transform->position, transform->rotation, transform->size);
+    
+    f32 min[3], max[3];
+    iVG_ObjectBoundsCompute(object, min, max);
+    ObjectNode* node = object_tree.nodes + object->leaf;
+    b8 inserted = object_tree.root == object->leaf || node->parent;
+    if (inserted && min[0] >= node->min[0] && min[1] >= node->min[1] && min[2] >= node->min[2]
+	&& max[0] <= node->max[0] && max[1] <= node->max[1] && max[2] <= node->max[2]) {
+	return;
+    }
+    
+    if (inserted) iVG_ObjectTreeRemove(object->leaf);
+    node = object_tree.nodes + object->leaf;
+    for (u32 k = 0; k < 3; k++) {
+	f32 margin = (max[k] - min[k])*OBJECT_TREE_MARGIN;
+	node->min[k] = min[k] - margin;
+	node->max[k] = max[k] + margin;
+    }
+    iVG_ObjectTreeInsert(object->leaf);
+}
+
+void VG_ObjectDestroy(u32 handle) {
+    Object* object = iVG_ObjectArenaPointerGet(handle);
+    assert(object->model && "Object was destroyed");
+    iVG_ModelArenaPointerGet(object->model)->object_count--;
+    iVG_ObjectTreeRemove(object->leaf);
+    iVG_ObjectTreeNodeFree(object->leaf);
+    
+    object->model = 0;
+    object->leaf = object_arena.free;
+    object_arena.free = handle;
+}
+
+// INTERNALS
+void iVG_RenderFlush() {
+    glfwSwapBuffers(window);
+}
+
+void iVG_SetupOpengl() {
+    glCullFace(GL_BACK);
+    glFrontFace(GL_CCW);
+    glEnable(GL_CULL_FACE);
+
+    glClearColor(0,0,0,0);
+    glViewport(0, 0, window_size[0], window_size[1]);
+}
+
+void iVG_GLDrawTriangles(u32 amount) {
+    glDrawArrays(GL_TRIANGLES, 0, 3*amount);
+}
+
+void iVG_GLVertexArrayBind(VAO_t VAO) {
+    glBindVertexArray(VAO);
+}
+
+void iVG_GLVertexArrayUnbind() {
+    glBindVertexArray(0);
+}
+
+VAO_t iVG_GLVertexArrayNew() {
+    VAO_t VAO;
+    glGenVertexArrays(1, &VAO);
+    return VAO;
+}
+
+void iVG_GLVertexArrayDestroy(VAO_t VAO) {
+    glDeleteVertexArrays(1, &VAO);
+}
+
+
+u32 iVG_GLBufferIndices(void* indices, u32 arr_len, u32 index_size) {
     u32 EBO;
     glGenBuffers(1, &EBO);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, arr_len*sizeof(u32), indices, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (u64)arr_len*index_size, indices, GL_STATIC_DRAW);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return EBO;
 }
 
 
-void iVG_GLBufferVertices(Vertex* vertices, u32 count) {
+u32 iVG_GLBufferVertices(void* vertices, u32 count) {
     u32 VBO;
     glGenBuffers(1, &VBO);
 
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, count*sizeof(Vertex), vertices, GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, (u64)count*iVG_VertexStrideGet(), vertices, GL_STATIC_DRAW);
+    iVG_GLVertexAttributesSet();
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return VBO;
+}
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, pos)));
+// Points the Vertex or VertexQuantized attributes of the bound VAO at the
+// bound GL_ARRAY_BUFFER
+void iVG_GLVertexAttributesSet() {
+    if (vertex_quantization) {
+	u32 stride = sizeof(VertexQuantized);
+	glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride, (void*)(offsetof(VertexQuantized, pos)));
+	glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)(offsetof(VertexQuantized, normal)));
+	glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)(offsetof(VertexQuantized, tex)));
+    } else {
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, pos)));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, normal)));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, tex)));
+    }
     glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, normal)));
     glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(offsetof(Vertex, tex)));
     glEnableVertexAttribArray(2);
+}
+
+// buffers gets the vertex and the index buffer
+u32 iVG_GLLoadVerticesIndexed(void* vertices, u32 vcount, void* indices, u32 icount, u32 index_size,
+			      u32 buffers[2]) {
+    u32 VAO = iVG_GLVertexArrayNew();
+    iVG_GLVertexArrayBind(VAO);
+    
+    buffers[0] = iVG_GLBufferVertices(vertices, vcount);
+    
+    buffers[1] = iVG_GLBufferIndices(indices, icount, index_size);
+    iVG_GLVertexArrayUnbind();
+    return VAO;
+}
+
+void iVG_GLModelRender(Model *model) {
+    iVG_GLVertexArrayBind(model->VAO);
+    
+    glDrawElementsBaseVertex(GL_TRIANGLES, model->lods[0].index_count, iVG_IndexTypeGet(model),
+			     (void*)((u64)model->index_size*model->lods[0].first_index), model->base_vertex);
+
+    iVG_GLVertexArrayBind(0);
+}
+
+// Instance attributes share one binding so the buffer behind them can be
+// swapped without specifying the attributes again
+void iVG_GLInstanceAttributesSet(VAO_t VAO, u32 buffer) {
+    iVG_GLVertexArrayBind(VAO);
+    switch (instance_format) {
+    case INSTANCE_FORMAT_MAT4:
+	for (u32 i = 0; i < 4; i++) {
+	    glVertexAttribFormat(3 + i, 4, GL_FLOAT, GL_FALSE, i*4*sizeof(f32));
+	}
+	glVertexAttribFormat(7, 3, GL_FLOAT, GL_FALSE, offsetof(InstanceMat4, normal_scale));
+	break;
+    case INSTANCE_FORMAT_AFFINE:
+	for (u32 i = 0; i < 3; i++) {
+	    glVertexAttribFormat(3 + i, 4, GL_FLOAT, GL_FALSE, i*4*sizeof(f32));
+	}
+	glVertexAttribFormat(6, 3, GL_FLOAT, GL_FALSE, offsetof(InstanceAffine, normal_scale));
+	break;
+    case INSTANCE_FORMAT_TRS:
+	glVertexAttribFormat(3, 3, GL_FLOAT, GL_FALSE, offsetof(InstanceTRS, position));
+	glVertexAttribFormat(4, 3, GL_FLOAT, GL_FALSE, offsetof(InstanceTRS, size));
+	glVertexAttribFormat(5, 4, GL_SHORT, GL_TRUE,  offsetof(InstanceTRS, rotation));
+	break;
+    }
+    u32 attributes = 3;
+    if (instance_format == INSTANCE_FORMAT_AFFINE) attributes = 4;
+    if (instance_format == INSTANCE_FORMAT_MAT4)   attributes = 5;
+    for (u32 i = 0; i < attributes; i++) {
+	glEnableVertexAttribArray(3 + i);
+	glVertexAttribBinding(3 + i, INSTANCE_BINDING);
+    }
+    glVertexBindingDivisor(INSTANCE_BINDING, 1);
+    glBindVertexBuffer(INSTANCE_BINDING, buffer, 0, instance_stride);
+    iVG_GLVertexArrayUnbind();
+}
+
+void iVG_GLModelRenderInstances(Model *model) {
+    iVG_GLVertexArrayBind(model->VAO);
+    
+    u32 base = iVG_InstanceRingBaseGet();
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	ModelLod* level = model->lods + lod;
+	for (u32 i = 0; i < level->run_count; i++) {
+	    InstanceRun* run = level->runs + i;
+	    if (run->count == 0) continue;
+	    glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, level->index_count, iVG_IndexTypeGet(model),
+							  (void*)((u64)model->index_size*level->first_index),
+							  run->count, model->base_vertex, base + run->first);
+	}
+    }
+    
+    iVG_GLVertexArrayBind(0);
+}
+
+// Static sets have no per frame pass to pick a level, they stay at LOD 0
+void iVG_GLModelRenderStatic(Model *model) {
+    if (!model->static_instances) return;
+    iVG_GLVertexArrayBind(model->VAO);
+    
+    for (u32 handle = model->static_instances; handle; ) {
+	StaticInstances* set = iVG_StaticInstancesArenaPointerGet(handle);
+	if (set->count) {
+	    glBindVertexBuffer(INSTANCE_BINDING, set->buffer, 0, instance_stride);
+	    glDrawElementsInstancedBaseVertex(GL_TRIANGLES, model->lods[0].index_count, iVG_IndexTypeGet(model),
+					      (void*)((u64)model->index_size*model->lods[0].first_index),
+					      set->count, model->base_vertex);
+	}
+	handle = set->next;
+    }
+    
+    glBindVertexBuffer(INSTANCE_BINDING, instance_ring.buffer, 0, instance_stride);
+    iVG_GLVertexArrayBind(0);
+}
+
+void iVG_InstanceRingInit(u32 region_capacity) {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLsizeiptr size = (GLsizeiptr)instance_stride*region_capacity*INSTANCE_RING_REGIONS;
+    
+    glGenBuffers(1, &instance_ring.buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_ring.buffer);
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+    instance_ring.mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (!instance_ring.mapped) {
+	printf("ERROR: Unable to map instance buffer\n");
+	exit(1);
+    }
+    
+    instance_ring.region_capacity = region_capacity;
+    for (u32 i = 0; i < INSTANCE_RING_REGIONS; i++) {
+	instance_ring.fences[i] = NULL;
+    }
+}
+
+void iVG_InstanceRingDestroy() {
+    for (u32 i = 0; i < INSTANCE_RING_REGIONS; i++) {
+	if (instance_ring.fences[i]) glDeleteSync(instance_ring.fences[i]);
+	instance_ring.fences[i] = NULL;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, instance_ring.buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDeleteBuffers(1, &instance_ring.buffer);
+    instance_ring.mapped = NULL;
+}
+
+// Returns the first instance of count free ones in the current region,
+// waiting for the GPU to let go of the region on the first call in a frame
+u32 iVG_InstanceRingAlloc(u32 count) {
+    if (!instance_ring.acquired) {
+	GLsync fence = instance_ring.fences[instance_ring.region];
+	if (fence) {
+	    while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+		;
+	    glDeleteSync(fence);
+	    instance_ring.fences[instance_ring.region] = NULL;
+	}
+	instance_ring.acquired = true;
+    }
+    
+    if (instance_ring.position + count > instance_ring.region_capacity) {
+	u32 capacity = instance_ring.region_capacity;
+	while (capacity < instance_ring.position + count) capacity *= 2;
+	iVG_InstanceRingGrow(capacity);
+    }
+    u32 first = instance_ring.position;
+    instance_ring.position += count;
+    return first;
+}
+
+// Moves the ring to a bigger buffer. The instances written so far this frame
+// are copied over on the GPU, the old buffer dies once the GPU is done with it.
+void iVG_InstanceRingGrow(u32 region_capacity) {
+    InstanceRing old = instance_ring;
+    iVG_InstanceRingInit(region_capacity);
+    instance_ring.region = old.region;
+    instance_ring.position = old.position;
+    instance_ring.acquired = old.acquired;
+    
+    glBindBuffer(GL_COPY_READ_BUFFER, old.buffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, instance_ring.buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+			(GLintptr)instance_stride*old.region*old.region_capacity,
+			(GLintptr)instance_stride*old.region*region_capacity,
+			(GLsizeiptr)instance_stride*old.position);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    
+    for (u32 i = 0; i < INSTANCE_RING_REGIONS; i++) {
+	if (old.fences[i]) glDeleteSync(old.fences[i]);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, old.buffer);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glDeleteBuffers(1, &old.buffer);
+    
+    for (u32 i = 1; i < model_arena.position; i++) {
+	iVG_GLVertexArrayBind(model_arena.base[i].VAO);
+	glBindVertexBuffer(INSTANCE_BINDING, instance_ring.buffer, 0, instance_stride);
+    }
+    iVG_GLVertexArrayUnbind();
+    iVG_Log("New instance ring");
+}
+
+void iVG_InstanceRingFrameEnd() {
+    if (!instance_ring.acquired) return;
+    instance_ring.fences[instance_ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    instance_ring.region = (instance_ring.region + 1) % INSTANCE_RING_REGIONS;
+    instance_ring.position = 0;
+    instance_ring.acquired = false;
+}
+
+u32 iVG_InstanceRingBaseGet() {
+    return instance_ring.region*instance_ring.region_capacity;
+}
+
+char* iVG_FileLoadToString(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+	printf("ERROR: No file with path %s\n", path);
+	exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    u32 length = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(length + 1);
+
+    size_t bytes_read = fread(buffer, 1, length, file);
+
+    if (bytes_read != length) {
+	fclose(file);
+	free(buffer);
+	printf("ERROR: Unable to read file\n");
+	exit(1);
+    }
+
+    buffer[length] = '\0';
+
+    fclose(file);
+    
+    return buffer;
+}
+
+// SHADERS
+void VG_ShaderUse(u32 shader_handle) {
+    u32 variant = iVG_ShaderVariantResolve(shader_handle);
+    if (shader_variant_current != variant) {
+	shader_variant_current = variant;
+	glUseProgram(shader_variants.base[variant].program);
+    }
+    ShaderVariant* bound = shader_variants.base + variant;
+    if (bound->camera_frame != frame_version) iVG_GLShaderCameraUpdate(bound);
+    
+    // the default shader standing in keeps its own values
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    u32 owner = variant == shader->variant || variant == shader->light_variant ? shader_handle : shader_default;
+    if (bound->uniform_owner != owner || bound->uniform_version != iVG_ShaderArenaPointerGet(owner)->uniform_version) {
+	iVG_GLShaderUserUniformsApply(bound, owner);
+    }
+}
+
+void VG_ShaderUniformF32Set(u32 shader_handle, const char* name, f32 value) {
+    iVG_ShaderUserUniformSet(shader_handle, name, USER_UNIFORM_F32, &value);
+}
+
+void VG_ShaderUniformVec2Set(u32 shader_handle, const char* name, f32 value[static 2]) {
+    iVG_ShaderUserUniformSet(shader_handle, name, USER_UNIFORM_VEC2, value);
+}
+
+void VG_ShaderUniformVec3Set(u32 shader_handle, const char* name, f32 value[static 3]) {
+    iVG_ShaderUserUniformSet(shader_handle, name, USER_UNIFORM_VEC3, value);
+}
+
+void VG_ShaderUniformVec4Set(u32 shader_handle, const char* name, f32 value[static 4]) {
+    iVG_ShaderUserUniformSet(shader_handle, name, USER_UNIFORM_VEC4, value);
+}
+
+void VG_ShaderUniformIntSet(u32 shader_handle, const char* name, int32_t value) {
+    iVG_ShaderUserUniformSet(shader_handle, name, USER_UNIFORM_INT, &value);
+}
+
+void VG_ShaderUniformMat4Set(u32 shader_handle, const char* name, f32 value[static 16]) {
+    iVG_ShaderUserUniformSet(shader_handle, name, USER_UNIFORM_MAT4, value);
+}
+
+// Only recorded here, VG_ShaderUse sets the values on the variant it binds
+void iVG_ShaderUserUniformSet(u32 shader_handle, const char* name, UserUniformType type, const void* value) {
+    if (!shader_handle) return;
+    static const u32 sizes[] = {
+	sizeof(f32), sizeof(f32[2]), sizeof(f32[3]), sizeof(f32[4]), sizeof(int32_t), sizeof(f32[16]),
+    };
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    UserUniform* uniform = NULL;
+    for (u32 i = 0; i < shader->uniform_count && !uniform; i++) {
+	if (strcmp(shader->uniforms[i].name, name) == 0) uniform = shader->uniforms + i;
+    }
+    if (!uniform) {
+	if (shader->uniform_count == shader->uniform_capacity) {
+	    shader->uniform_capacity = shader->uniform_capacity ? shader->uniform_capacity*2 : 8;
+	    shader->uniforms = realloc(shader->uniforms, sizeof(UserUniform)*shader->uniform_capacity);
+	}
+	uniform = shader->uniforms + shader->uniform_count++;
+	uniform->name = malloc(strlen(name) + 1);
+	strcpy(uniform->name, name);
+    }
+    uniform->type = type;
+    memcpy(&uniform->value, value, sizes[type]);
+    shader->uniform_version++;
+}
+
+// Names the variant lacks are skipped, like glUniform* on location -1
+void iVG_GLShaderUserUniformsApply(ShaderVariant* variant, u32 shader_handle) {
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    variant->uniform_owner = shader_handle;
+    variant->uniform_version = shader->uniform_version;
+    for (u32 i = 0; i < shader->uniform_count; i++) {
+	UserUniform* uniform = shader->uniforms + i;
+	GLint location = iVG_ShaderUniformFind(variant, uniform->name);
+	if (location < 0) continue;
+	f32* f = uniform->value.f;
+	switch (uniform->type) {
+	case USER_UNIFORM_F32:  glUniform1fv(location, 1, f); break;
+	case USER_UNIFORM_VEC2: glUniform2fv(location, 1, f); break;
+	case USER_UNIFORM_VEC3: glUniform3fv(location, 1, f); break;
+	case USER_UNIFORM_VEC4: glUniform4fv(location, 1, f); break;
+	case USER_UNIFORM_INT:  glUniform1i(location, uniform->value.i); break;
+	case USER_UNIFORM_MAT4: glUniformMatrix4fv(location, 1, GL_TRUE, f); break;
+	}
+    }
+}
+
+b8 VG_ShaderReady(u32 shader_handle) {
+    return iVG_ShaderVariantReady(iVG_ShaderArenaPointerGet(shader_handle)->variant);
+}
+
+void VG_ShaderDefaultSet(u32 shader_handle) {
+    shader_default = shader_handle;
+}
+
+// The variant to draw a handle with. The one for the lights in use once it
+// is linked and the general one until then, which reads the counts from
+// the block. While the general one is compiling the default shader stands
+// in, without a ready default this waits for the link.
+u32 iVG_ShaderVariantResolve(u32 shader_handle) {
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    if (!iVG_ShaderVariantReady(shader->variant)) {
+	Shader* fallback = iVG_ShaderArenaPointerGet(shader_default);
+	if (shader_default && iVG_ShaderVariantReady(fallback->variant)) return fallback->variant;
+	iVG_ShaderVariantFinish(shader_variants.base + shader->variant);
+    }
+    if (!shader_variants.base[shader->variant].lights) return shader->variant;
+    
+    if (shader->light_variant_key != shader_light_key) {
+	shader->light_variant = iVG_ShaderLightVariantGet(shader_handle);
+	shader->light_variant_key = shader_light_key;
+    }
+    if (iVG_ShaderVariantReady(shader->light_variant)) return shader->light_variant;
+    return shader->variant;
+}
+
+ShaderVariant* iVG_ShaderVariantCurrentGet() {
+    return shader_variants.base + shader_variant_current;
+}
+
+// Puts the vgfx defines and then the given ones right after the #version
+// line, keeping line numbers intact
+void iVG_GLShaderSourceSet(u32 shader, const char* source, const char* extra_defines) {
+    const char* body = source;
+    if (strncmp(source, "#version", 8) == 0) {
+	body = strchr(source, '\n');
+	body = body ? body + 1 : source + strlen(source);
+    }
+    
+    GLint type;
+    glGetShaderiv(shader, GL_SHADER_TYPE, &type);
+    char defines[256];
+    iVG_ShaderDefinesGet(type, defines, sizeof(defines));
+    char line[32];
+    snprintf(line, sizeof(line), "\n#line %d\n", body == source ? 1 : 2);
+    const char* strings[5] = {source, defines, extra_defines, line, body};
+    GLint lengths[5] = {body - source, -1, -1, -1, -1};
+    glShaderSource(shader, 5, strings, lengths);
+}
+
+// What vgfx defines for a stage, these follow the window flags
+void iVG_ShaderDefinesGet(GLenum type, char* out, u32 size) {
+    const char* format_define = "VG_INSTANCE_MAT4";
+    if (instance_format == INSTANCE_FORMAT_AFFINE) format_define = "VG_INSTANCE_AFFINE";
+    if (instance_format == INSTANCE_FORMAT_TRS)    format_define = "VG_INSTANCE_TRS";
+    
+    // gl_DrawIDARB picks the model color of a multi draw command
+    const char* pool_defines = "";
+    if (geometry_pool.VAO) {
+	pool_defines = type == GL_VERTEX_SHADER
+	    ? "#extension GL_ARB_shader_draw_parameters : require\n#define VG_GEOMETRY_POOL\n"
+	    : "#define VG_GEOMETRY_POOL\n";
+    }
+    snprintf(out, size, "%s#define VG_DRAW_COLORS %d\n#define %s\n%s",
+	     pool_defines, GEOMETRY_POOL_DRAWS_MAX, format_define,
+	     vertex_quantization ? "#define VG_QUANTIZED_VERTICES\n" : "");
+}
+
+u32 VG_ShaderLoad(const char* vertex_path, const char* fragment_path) {
+    return VG_ShaderLoadDefines(vertex_path, fragment_path, NULL);
+}
+
+u32 VG_ShaderLoadDefines(const char* vertex_path, const char* fragment_path, const char* defines) {
+    u32 shader_handle = VG_ShaderLoadAsync(vertex_path, fragment_path, defines);
+    iVG_ShaderVariantFinish(shader_variants.base + iVG_ShaderArenaPointerGet(shader_handle)->variant);
+    return shader_handle;
+}
+
+u32 VG_ShaderLoadAsync(const char* vertex_path, const char* fragment_path, const char* defines) {
+    u32 shader_handle = iVG_ShaderArenaBump();
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    shader->vertex_source = iVG_FileLoadToString(vertex_path);
+    shader->fragment_source = iVG_FileLoadToString(fragment_path);
+    defines = defines ? defines : "";
+    shader->defines = malloc(strlen(defines) + 1);
+    strcpy(shader->defines, defines);
+    shader->uniforms = NULL;
+    shader->uniform_count = 0;
+    shader->uniform_capacity = 0;
+    shader->uniform_version = 0;
+    shader->source_hash = iVG_Hash64(HASH64_BASIS, shader->vertex_source, strlen(shader->vertex_source) + 1);
+    shader->source_hash = iVG_Hash64(shader->source_hash, shader->fragment_source, strlen(shader->fragment_source) + 1);
+    
+    // the variant without light counts, the only one when the program has no Lights block
+    shader->variant = iVG_ShaderVariantGet(shader_handle, shader->defines);
+    shader->light_variant = shader->variant;
+    shader->light_variant_key = ~0u;
+    return shader_handle;
+}
+
+// The variant of the handle's sources with these defines, started when the
+// table has none yet. Handles loaded from the same files share variants.
+u32 iVG_ShaderVariantGet(u32 shader_handle, const char* defines) {
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    u64 hash = iVG_Hash64(shader->source_hash, defines, strlen(defines) + 1);
+    for (u32 i = 1; i < shader_variants.count; i++) {
+	ShaderVariant* variant = shader_variants.base + i;
+	if (variant->hash != hash || strcmp(variant->defines, defines)) continue;
+	Shader* source = iVG_ShaderArenaPointerGet(variant->source);
+	if (strcmp(source->vertex_source, shader->vertex_source) == 0
+	    && strcmp(source->fragment_source, shader->fragment_source) == 0) {
+	    return i;
+	}
+    }
+    
+    if (shader_variants.count == shader_variants.capacity) {
+	shader_variants.capacity *= 2;
+	shader_variants.base = realloc(shader_variants.base, sizeof(ShaderVariant)*shader_variants.capacity);
+    }
+    u32 index = shader_variants.count++;
+    ShaderVariant* variant = shader_variants.base + index;
+    variant->hash = hash;
+    variant->source = shader_handle;
+    variant->defines = malloc(strlen(defines) + 1);
+    strcpy(variant->defines, defines);
+    variant->uniforms = NULL;
+    variant->uniform_count = 0;
+    variant->uniform_table = NULL;
+    variant->uniform_table_mask = 0;
+    variant->lights = false;
+    variant->camera_frame = 0;
+    variant->uniform_owner = 0;
+    variant->uniform_version = 0;
+    iVG_GLProgramStart(variant, shader->vertex_source, shader->fragment_source);
+    return index;
+}
+
+// VG_DIRECT_LIGHTS and VG_GLOBAL_LIGHTS give the light loops constant
+// bounds, VG_CLUSTERED_LIGHTS 0 drops the cluster lookup. Past
+// SHADER_LIGHT_VARIANT_MAX lights of a kind their count is read from the block.
+u32 iVG_ShaderLightVariantGet(u32 shader_handle) {
+    Shader* shader = iVG_ShaderArenaPointerGet(shader_handle);
+    u32 direct_count = shader_light_key & 0xFF;
+    u32 global_count = (shader_light_key >> 8) & 0xFF;
+    b8 clustered = shader_light_key >> 16;
+    
+    u32 length = strlen(shader->defines) + 128;
+    char* defines = malloc(length);
+    u32 written = snprintf(defines, length, "%s\n#define VG_CLUSTERED_LIGHTS %d\n", shader->defines, clustered);
+    if (direct_count <= SHADER_LIGHT_VARIANT_MAX) {
+	written += snprintf(defines + written, length - written, "#define VG_DIRECT_LIGHTS %u\n", direct_count);
+    }
+    if (global_count <= SHADER_LIGHT_VARIANT_MAX) {
+	snprintf(defines + written, length - written, "#define VG_GLOBAL_LIGHTS %u\n", global_count);
+    }
+    u32 variant = iVG_ShaderVariantGet(shader_handle, defines);
+    free(defines);
+    return variant;
+}
+
+u32 iVG_ShaderLightKeyGet(u32 direct_count, u32 global_count, b8 clustered) {
+    if (direct_count > SHADER_LIGHT_VARIANT_MAX) direct_count = SHADER_LIGHT_VARIANT_MAX + 1;
+    if (global_count > SHADER_LIGHT_VARIANT_MAX) global_count = SHADER_LIGHT_VARIANT_MAX + 1;
+    return direct_count | global_count << 8 | (u32)clustered << 16;
+}
+
+// Starts compiling and linking a variant without waiting on the driver,
+// iVG_ShaderVariantFinish looks at the results. A cached binary is
+// loaded right away.
+void iVG_GLProgramStart(ShaderVariant* variant, const char* vertex_source, const char* fragment_source) {
+    variant->pending = true;
+    variant->stages[0] = variant->stages[1] = 0;
+    variant->cache_key = 0;
+    if (shader_cache_dir) {
+	variant->cache_key = iVG_ShaderCacheKeyGet(vertex_source, fragment_source, variant->defines);
+	variant->program = iVG_GLShaderCacheLoad(variant->cache_key);
+	if (variant->program) return;
+    }
+    
+    const char* sources[2] = {vertex_source, fragment_source};
+    GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+    variant->program = glCreateProgram();
+    for (u32 i = 0; i < 2; i++) {
+	variant->stages[i] = glCreateShader(types[i]);
+	iVG_GLShaderSourceSet(variant->stages[i], sources[i], variant->defines);
+	glCompileShader(variant->stages[i]);
+	glAttachShader(variant->program, variant->stages[i]);
+    }
+    if (shader_cache_dir) glProgramParameteri(variant->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(variant->program);
+}
+
+// Checks what iVG_GLProgramStart began, waiting for the driver if it is
+// not done yet, and reads the uniforms of the linked program
+void iVG_ShaderVariantFinish(ShaderVariant* variant) {
+    if (!variant->pending) return;
+    variant->pending = false;
+    
+    int32_t success;
+    const char* stage_names[2] = {"VERTEX", "FRAGMENT"};
+    for (u32 i = 0; i < 2 && variant->stages[0]; i++) {
+	glGetShaderiv(variant->stages[i], GL_COMPILE_STATUS, &success);
+	if (!success) {
+	    char info_log[512];
+	    glGetShaderInfoLog(variant->stages[i], 512, NULL, info_log);
+	    printf("%s SHADER ERROR: %s\n", stage_names[i], info_log);
+	    exit(1);
+	}
+    }
+    
+    glGetProgramiv(variant->program, GL_LINK_STATUS, &success);
+    if(!success) {
+	char info_log[512];
+	glGetProgramInfoLog(variant->program, 512, NULL, info_log);
+	printf("ERROR: %s\n", info_log);
+	exit(1);
+    }
+    
+    if (variant->stages[0]) {
+	for (u32 i = 0; i < 2; i++) {
+	    glDetachShader(variant->program, variant->stages[i]);
+	    glDeleteShader(variant->stages[i]);
+	}
+	if (shader_cache_dir) iVG_GLShaderCacheStore(variant->program, variant->cache_key);
+    }
+    iVG_ShaderUniformsBuild(variant);
+    iVG_GLShaderBlocksBind(variant->program);
+    variant->lights = glGetUniformBlockIndex(variant->program, "Lights") != GL_INVALID_INDEX;
+}
+
+// True once the variant is linked. Without GL_KHR_parallel_shader_compile
+// asking is the same as waiting.
+b8 iVG_ShaderVariantReady(u32 variant_handle) {
+    ShaderVariant* variant = shader_variants.base + variant_handle;
+    if (!variant->pending) return true;
+    if (shader_parallel_compile) {
+	GLint done = GL_FALSE;
+	glGetProgramiv(variant->program, GL_COMPLETION_STATUS_KHR, &done);
+	if (!done) return false;
+    }
+    iVG_ShaderVariantFinish(variant);
+    return true;
+}
+
+// SHADER CACHE
+void VG_ShaderCacheDirSet(const char* path) {
+    free(shader_cache_dir);
+    shader_cache_dir = NULL;
+    if (!path) return;
+    shader_cache_dir = malloc(strlen(path) + 1);
+    strcpy(shader_cache_dir, path);
+    // only the last directory is made, like mkdir without -p
+    mkdir(path, 0755);
+}
+
+u64 iVG_ShaderCacheKeyGet(const char* vertex_source, const char* fragment_source, const char* defines) {
+    if (!shader_cache_driver_hash) {
+	u64 hash = HASH64_BASIS;
+	GLenum names[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+	for (u32 i = 0; i < ARRLEN(names); i++) {
+	    const char* string = (const char*)glGetString(names[i]);
+	    if (string) hash = iVG_Hash64(hash, string, strlen(string) + 1);
+	}
+	shader_cache_driver_hash = hash;
+    }
+    
+    char stage_defines[256];
+    u64 hash = shader_cache_driver_hash;
+    iVG_ShaderDefinesGet(GL_VERTEX_SHADER, stage_defines, sizeof(stage_defines));
+    hash = iVG_Hash64(hash, stage_defines, strlen(stage_defines) + 1);
+    iVG_ShaderDefinesGet(GL_FRAGMENT_SHADER, stage_defines, sizeof(stage_defines));
+    hash = iVG_Hash64(hash, stage_defines, strlen(stage_defines) + 1);
+    hash = iVG_Hash64(hash, defines, strlen(defines) + 1);
+    hash = iVG_Hash64(hash, vertex_source, strlen(vertex_source) + 1);
+    hash = iVG_Hash64(hash, fragment_source, strlen(fragment_source) + 1);
+    return hash;
+}
+
+void iVG_ShaderCachePathGet(u64 key, char* out, u32 size) {
+    snprintf(out, size, "%s/%016llx.bin", shader_cache_dir, (unsigned long long)key);
+}
+
+// The linked program in the cache under key, 0 when there is none or the
+// driver does not take it
+u32 iVG_GLShaderCacheLoad(u64 key) {
+    char path[4096];
+    iVG_ShaderCachePathGet(key, path, sizeof(path));
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    
+    ShaderCacheHeader header;
+    void* binary = NULL;
+    b8 valid = fread(&header, sizeof(header), 1, file) == 1
+	&& header.magic == SHADER_CACHE_MAGIC && header.key == key && header.length > 0;
+    if (valid) {
+	binary = malloc(header.length);
+	valid = fread(binary, 1, header.length, file) == header.length;
+    }
+    fclose(file);
+    
+    u32 program = 0;
+    if (valid) {
+	program = glCreateProgram();
+	glProgramBinary(program, header.format, binary, header.length);
+	GLint success;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+	    iVG_Log("Program binary rejected, compiling again");
+	    glDeleteProgram(program);
+	    program = 0;
+	}
+    }
+    free(binary);
+    return program;
+}
+
+// Written to a temporary file first so a reader never sees half a binary
+void iVG_GLShaderCacheStore(u32 program, u64 key) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) return;
+    
+    ShaderCacheHeader header = {SHADER_CACHE_MAGIC, 0, key, 0, 0};
+    void* binary = malloc(length);
+    GLsizei written = 0;
+    GLenum format;
+    glGetProgramBinary(program, length, &written, &format, binary);
+    header.format = format;
+    header.length = written;
+    
+    char path[4096], temp_path[4096 + 8];
+    iVG_ShaderCachePathGet(key, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    FILE* file = written > 0 ? fopen(temp_path, "wb") : NULL;
+    if (file) {
+	b8 ok = fwrite(&header, sizeof(header), 1, file) == 1
+	    && fwrite(binary, 1, written, file) == (size_t)written;
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(temp_path, path) != 0) remove(temp_path);
+    }
+    free(binary);
+}
+
+u64 iVG_Hash64(u64 hash, const void* data, u64 size) {
+    const u8* bytes = data;
+    for (u64 i = 0; i < size; i++) {
+	hash = (hash ^ bytes[i])*1099511628211ull;
+    }
+    return hash;
+}
+
+// In the variant VG_ShaderUse binds, waiting for the general one to link first
+int32_t VG_ShaderUniformLocation(u32 shader_handle, const char* name) {
+    iVG_ShaderVariantFinish(shader_variants.base + iVG_ShaderArenaPointerGet(shader_handle)->variant);
+    ShaderVariant* variant = shader_variants.base + iVG_ShaderVariantResolve(shader_handle);
+    return iVG_ShaderUniformFind(variant, name);
+}
+
+void iVG_ShaderArenaInit(u32 size) {
+    shader_arena.position = 1;
+    if (size < 2) size = 2;
+    shader_arena.size = size;
+    shader_arena.base = malloc(size*sizeof(Shader));
+    // handle 0 stands for no program, setting its uniforms does nothing
+    Shader* none = shader_arena.base;
+    memset(none, 0, sizeof(Shader));
+    
+    shader_variants.count = 1;
+    shader_variants.capacity = size;
+    shader_variants.base = malloc(size*sizeof(ShaderVariant));
+    ShaderVariant* none_variant = shader_variants.base;
+    memset(none_variant, 0, sizeof(ShaderVariant));
+    for (u32 slot = 0; slot < UNIFORM_SLOT_COUNT; slot++) {
+	none_variant->slots[slot] = -1;
+    }
+    shader_variant_current = 0;
+    shader_default = 0;
+}
+
+// Lets the driver compile and link on its own threads, as many as it likes
+void iVG_GLShaderParallelCompileInit() {
+    const char* names[2][2] = {
+	{"GL_KHR_parallel_shader_compile", "glMaxShaderCompilerThreadsKHR"},
+	{"GL_ARB_parallel_shader_compile", "glMaxShaderCompilerThreadsARB"},
+    };
+    shader_parallel_compile = false;
+    for (u32 i = 0; i < 2 && !shader_parallel_compile; i++) {
+	if (!iVG_GLExtensionSupported(names[i][0])) continue;
+	ShaderCompilerThreadsProc threads = (ShaderCompilerThreadsProc)glfwGetProcAddress(names[i][1]);
+	if (threads) threads(0xFFFFFFFF);
+	shader_parallel_compile = true;
+    }
+}
+
+u32 iVG_ShaderArenaBump() {
+    u32 temp = shader_arena.position;
+    shader_arena.position++;
+    if (shader_arena.position >= shader_arena.size) {
+	shader_arena.size *=2;
+	shader_arena.base = realloc(shader_arena.base, shader_arena.size*sizeof(Shader));
+    }
+    return temp;
+}
+
+Shader* iVG_ShaderArenaPointerGet(u32 shader_handle) {
+    if (shader_handle > shader_arena.position) {
+	assert(false && "Shader handle is not valid (too big)");
+    }
+    return shader_arena.base + shader_handle;
+}
+
+void iVG_ShaderArenaDestroy() {
+    for (u32 i = 1; i < shader_arena.position; i++) {
+	Shader* shader = shader_arena.base + i;
+	free(shader->vertex_source);
+	free(shader->fragment_source);
+	free(shader->defines);
+	for (u32 k = 0; k < shader->uniform_count; k++) {
+	    free(shader->uniforms[k].name);
+	}
+	free(shader->uniforms);
+    }
+    free(shader_arena.base);
+    for (u32 i = 1; i < shader_variants.count; i++) {
+	ShaderVariant* variant = shader_variants.base + i;
+	for (u32 k = 0; k < variant->uniform_count; k++) {
+	    free(variant->uniforms[k].name);
+	}
+	free(variant->uniforms);
+	free(variant->uniform_table);
+	free(variant->defines);
+    }
+    free(shader_variants.base);
+}
+
+// Fills the uniform table from GL_ACTIVE_UNIFORMS, then the slots from it
+void iVG_ShaderUniformsBuild(ShaderVariant* shader) {
+    shader->uniforms = NULL;
+    shader->uniform_count = 0;
+    shader->uniform_capacity = 0;
+    
+    GLint count = 0, name_max = 0;
+    glGetProgramiv(shader->program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(shader->program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &name_max);
+    char* name = malloc(name_max + 16);
+    for (GLint i = 0; i < count; i++) {
+	GLint size;
+	GLenum type;
+	GLsizei length;
+	glGetActiveUniform(shader->program, i, name_max, &length, &size, &type, name);
+	// members of uniform blocks have no location
+	GLint location = glGetUniformLocation(shader->program, name);
+	if (location < 0) continue;
+	iVG_ShaderUniformAdd(shader, name, location);
+	
+	// arrays are listed once as name[0], the bare name and every element get an entry
+	if (size > 1 && length > 3 && strcmp(name + length - 3, "[0]") == 0) {
+	    name[length - 3] = '\0';
+	    iVG_ShaderUniformAdd(shader, name, location);
+	    for (GLint element = 1; element < size; element++) {
+		snprintf(name + length - 3, 16, "[%d]", element);
+		iVG_ShaderUniformAdd(shader, name, glGetUniformLocation(shader->program, name));
+	    }
+	}
+    }
+    free(name);
+    iVG_ShaderUniformTableBuild(shader);
+    
+    const char* names[] = {"main_texture", "material.color", "drawColors[0]", "positionDequantize",
+			   "drawPositionDequantize[0]", "projection", "view", "cameraPos"};
+    for (u32 slot = 0; slot < ARRLEN(names); slot++) {
+	shader->slots[slot] = iVG_ShaderUniformFind(shader, names[slot]);
+    }
+}
+
+void iVG_ShaderUniformAdd(ShaderVariant* shader, const char* name, GLint location) {
+    if (shader->uniform_count == shader->uniform_capacity) {
+	shader->uniform_capacity = shader->uniform_capacity ? shader->uniform_capacity*2 : 32;
+	shader->uniforms = realloc(shader->uniforms, sizeof(UniformEntry)*shader->uniform_capacity);
+    }
+    UniformEntry* entry = shader->uniforms + shader->uniform_count++;
+    entry->hash = iVG_UniformNameHash(name);
+    entry->location = location;
+    entry->name = malloc(strlen(name) + 1);
+    strcpy(entry->name, name);
+}
+
+// At most half full, so probing always ends on an empty bucket
+void iVG_ShaderUniformTableBuild(ShaderVariant* shader) {
+    u32 size = 16;
+    while (size < 2*shader->uniform_count) size *= 2;
+    shader->uniform_table = calloc(size, sizeof(u32));
+    shader->uniform_table_mask = size - 1;
+    for (u32 i = 0; i < shader->uniform_count; i++) {
+	u32 bucket = shader->uniforms[i].hash & shader->uniform_table_mask;
+	while (shader->uniform_table[bucket]) bucket = (bucket + 1) & shader->uniform_table_mask;
+	shader->uniform_table[bucket] = i + 1;
+    }
+}
+
+// -1 when the program has no such active uniform, like glGetUniformLocation
+GLint iVG_ShaderUniformFind(ShaderVariant* shader, const char* name) {
+    if (!shader->uniform_table) return -1;
+    u32 hash = iVG_UniformNameHash(name);
+    for (u32 bucket = hash & shader->uniform_table_mask; shader->uniform_table[bucket];
+	 bucket = (bucket + 1) & shader->uniform_table_mask) {
+	UniformEntry* entry = shader->uniforms + shader->uniform_table[bucket] - 1;
+	if (entry->hash == hash && strcmp(entry->name, name) == 0) return entry->location;
+    }
+    return -1;
+}
+
+u32 iVG_UniformNameHash(const char* name) {
+    u32 hash = 2166136261u;
+    for (; *name; name++) {
+	hash = (hash ^ (u8)*name)*16777619u;
+    }
+    return hash;
+}
+
+void iVG_FramebufferSizeCallback(GLFWwindow *window, int width, int height) {
+    glViewport(0, 0, width, height);
+    VM2_Set(window_size, width, height);
+}
+
+void iVG_InputUpdate() {
+    VM2_Set(mouse_delta, 0, 0);
+    iVG_PollEvents();
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
+	glfwSetWindowShouldClose(window, true);
+    }
+}
+
+void iVG_PollEvents() {
+    glfwPollEvents();
+}
+
+void iVG_VertexColoredGet(f32* point, f32* color, f32* out) {
+    VM3_Copy(out, point);
+    VRGBA_Copy(out+dims, color);
+}
+
+void iVG_GLPerspectiveUpdate() {
+    f32 size[2];
+    VG_WindowSizeGet(size);
+    VM44_ProjectionPerspective(matrix_projection, camera.fov, size[0]/size[1], PROJECTION_NEAR, PROJECTION_FAR);
+}
+
+// Packs the lights once a frame, the buffers are only written when that
+// differs from what they hold. The cluster grid follows the camera, so it
+// is built every frame there are lights with a range.
+void iVG_GLLightUpdate() {
+    u32 global_count = iVG_LightRecordsPack();
+    if (light_record_count != light_record_uploaded_count
+	|| memcmp(light_records, light_records_uploaded, sizeof(LightRecord)*light_record_count)) {
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, light_record_buffer);
+	if (light_record_count > light_record_buffer_capacity) {
+	    light_record_buffer_capacity = light_record_capacity;
+	    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LightRecord)*light_record_buffer_capacity, NULL, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(LightRecord)*light_record_count, light_records);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	memcpy(light_records_uploaded, light_records, sizeof(LightRecord)*light_record_count);
+	light_record_uploaded_count = light_record_count;
+    }
+    iVG_ClusterGridBuild(global_count, light_record_count - global_count);
+    
+    iVG_GLDirectLightRecordsUpdate();
+    
+    LightBlock block;
+    memset(&block, 0, sizeof(block));
+    block.direct_count = directLightCount;
+    block.global_count = global_count;
+    shader_light_key = iVG_ShaderLightKeyGet(directLightCount, global_count, light_record_count > global_count);
+    block.cluster_grid[0] = CLUSTER_X;
+    block.cluster_grid[1] = CLUSTER_Y;
+    block.cluster_grid[2] = CLUSTER_Z;
+    block.cluster_depth[0] = CLUSTER_Z/logf(PROJECTION_FAR/PROJECTION_NEAR);
+    block.cluster_depth[1] = -logf(PROJECTION_NEAR)*block.cluster_depth[0];
+    if (memcmp(&block, &light_block, sizeof(block)) == 0) return;
+    
+    light_block = block;
+    glBindBuffer(GL_UNIFORM_BUFFER, light_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(light_block), &light_block);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void iVG_GLDirectLightRecordsUpdate() {
+    if (directLightCount > direct_light_record_capacity) {
+	direct_light_record_capacity = directLightCapacity;
+	direct_light_records = realloc(direct_light_records, sizeof(DirectLightRecord)*direct_light_record_capacity);
+	direct_light_records_uploaded = realloc(direct_light_records_uploaded,
+						sizeof(DirectLightRecord)*direct_light_record_capacity);
+    }
+    memset(direct_light_records, 0, sizeof(DirectLightRecord)*directLightCount);
+    for (u32 i = 0; i < directLightCount; i++) {
+	VM3_Copy(direct_light_records[i].direction, directLights[i].direction);
+	VM3_Copy(direct_light_records[i].color, directLights[i].color);
+    }
+    if (directLightCount == direct_light_record_uploaded_count
+	&& !memcmp(direct_light_records, direct_light_records_uploaded, sizeof(DirectLightRecord)*directLightCount)) {
+	return;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, direct_light_record_buffer);
+    if (directLightCount > direct_light_record_buffer_capacity) {
+	direct_light_record_buffer_capacity = direct_light_record_capacity;
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(DirectLightRecord)*direct_light_record_buffer_capacity,
+		     NULL, GL_DYNAMIC_DRAW);
+    }
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(DirectLightRecord)*directLightCount, direct_light_records);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    memcpy(direct_light_records_uploaded, direct_light_records, sizeof(DirectLightRecord)*directLightCount);
+    direct_light_record_uploaded_count = directLightCount;
+}
+
+void iVG_GLUniformVec3Set(UniformSlot slot, f32* vec) {
+    GLint loc = iVG_ShaderVariantCurrentGet()->slots[slot];
+    glUniform3fv(loc, 1, vec);
+}
+
+void iVG_GLUniformIntSet(UniformSlot slot, int i) {
+    GLint loc = iVG_ShaderVariantCurrentGet()->slots[slot];
+    glUniform1i(loc, i);
+}
+
+
+void iVG_GLUniformF32Set(UniformSlot slot, f32 f) {
+    GLint loc = iVG_ShaderVariantCurrentGet()->slots[slot];
+    glUniform1f(loc, f);
+}
+
+// Only programs declaring the plain view, projection and cameraPos
+// uniforms have locations for them, once a frame while bound
+void iVG_GLShaderCameraUpdate(ShaderVariant* variant) {
+    variant->camera_frame = frame_version;
+    if (variant->slots[UNIFORM_PROJECTION] >= 0) {
+	glUniformMatrix4fv(variant->slots[UNIFORM_PROJECTION], 1, GL_TRUE, matrix_projection);
+    }
+    if (variant->slots[UNIFORM_VIEW] >= 0) {
+	glUniformMatrix4fv(variant->slots[UNIFORM_VIEW], 1, GL_TRUE, matrix_view);
+    }
+    if (variant->slots[UNIFORM_CAMERA_POS] >= 0) {
+	glUniform3fv(variant->slots[UNIFORM_CAMERA_POS], 1, camera.position);
+    }
+}
+
+void iVG_GLFrameBlockUpdate() {
+    frame_version++;
+    FrameBlock block;
+    memcpy(block.view, matrix_view, sizeof(block.view));
+    memcpy(block.projection, matrix_projection, sizeof(block.projection));
+    memcpy(block.view_projection, matrix_view_projection, sizeof(block.view_projection));
+    VM3_Copy(block.camera_position, camera.position);
+    block.time = (f32)time_current;
+    VM2_Copy(block.viewport, window_size);
+    block.pad[0] = block.pad[1] = 0;
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(block), &block);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void iVG_FrameBlockInit() {
+    glGenBuffers(1, &frame_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameBlock), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BLOCK_BINDING, frame_buffer);
+}
+
+void iVG_FrameBlockDestroy() {
+    glDeleteBuffers(1, &frame_buffer);
+}
+
+void iVG_GLCameraUpdate() {
+    f32 out[16];
+    VM44_V3A3(camera.position, camera.rotation, matrix_view);
+    VM44_InverseO(matrix_view, out);
+    VM44_Copy(matrix_view, out);
+}
+
+// Points the uniform blocks vgfx fills at their binding points
+void iVG_GLShaderBlocksBind(u32 program) {
+    GLuint lights = glGetUniformBlockIndex(program, "Lights");
+    if (lights != GL_INVALID_INDEX) glUniformBlockBinding(program, lights, LIGHT_BLOCK_BINDING);
+    GLuint frame = glGetUniformBlockIndex(program, "FrameData");
+    if (frame != GL_INVALID_INDEX) glUniformBlockBinding(program, frame, FRAME_BLOCK_BINDING);
+}
+
+void iVG_KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_PRESS) {
+	keys_just_pressed[key] = true;
+	keys_pressed[key] = true;
+    } else if (action == GLFW_RELEASE) {
+	keys_pressed[key] = false;
+    }
+}
+
+void iVG_KeysJustPressedClear() {
+    memset(keys_just_pressed, 0, 512*sizeof(b8));
+}
+
+void iVG_MouseCallback(GLFWwindow* window, f64 x, f64 y) {
+ 
+    if (mouse_first) {
+	VM2_Set(mouse_last, x, y);
+	mouse_first = false;
+    }
+    
+    mouse_delta[0] = x - mouse_last[0];
+    mouse_delta[1] = y - mouse_last[1];
+    
+    
+    VM2_Set(mouse_last, x, y);
+}
+
+void iVG_ModelArenaInit(u32 size) {
+    model_arena.position = 1;
+    if (size < 2) size = 2;
+    model_arena.size = size;
+    model_arena.base = malloc(size*sizeof(Model));
+}
+
+u32 iVG_ModelArenaBump() {
+    u32 temp = model_arena.position;
+    model_arena.position++;
+    if (model_arena.position >= model_arena.size) {
+	model_arena.size *=2;
+	model_arena.base = realloc(model_arena.base, model_arena.size*sizeof(Model));
+    }
+    return temp;
+}
+
+Model* iVG_ModelArenaPointerGet(u32 model_handle) {
+    if (model_handle > model_arena.position) {
+	assert(false && "Model handle is not valid (too big)");
+    }
+    return model_arena.base + model_handle;
+}
+
+void iVG_ModelArenaDestroy() {
+    for (u32 i = 1; i < model_arena.position; i++) {
+	Model* model = model_arena.base + i;
+	iVG_ModelInstancesFree(model);
+	free(model->occluder_positions);
+	free(model->occluder_indices);
+    }
+    free(model_arena.base);
+}
+
+
+void iVG_StaticInstancesArenaInit(u32 size) {
+    static_instances_arena.position = 1;
+    if (size < 2) size = 2;
+    static_instances_arena.size = size;
+    static_instances_arena.base = malloc(size*sizeof(StaticInstances));
+}
+
+u32 iVG_StaticInstancesArenaBump() {
+    u32 temp = static_instances_arena.position;
+    static_instances_arena.position++;
+    if (static_instances_arena.position >= static_instances_arena.size) {
+	static_instances_arena.size *=2;
+	static_instances_arena.base = realloc(static_instances_arena.base, static_instances_arena.size*sizeof(StaticInstances));
+    }
+    return temp;
+}
+
+StaticInstances* iVG_StaticInstancesArenaPointerGet(u32 handle) {
+    if (handle > static_instances_arena.position) {
+	assert(false && "Static instances handle is not valid (too big)");
+    }
+    return static_instances_arena.base + handle;
+}
+
+void iVG_StaticInstancesArenaDestroy() {
+    for (u32 i = 1; i < static_instances_arena.position; i++) {
+	if (static_instances_arena.base[i].buffer) {
+	    glDeleteBuffers(1, &static_instances_arena.base[i].buffer);
+	}
+    }
+    free(static_instances_arena.base);
+}
+
+void iVG_ObjectArenaInit(u32 size) {
+    object_arena.position = 1;
+    object_arena.free = 0;
+    if (size < 2) size = 2;
+    object_arena.size = size;
+    object_arena.base = malloc(size*sizeof(Object));
+}
+
+u32 iVG_ObjectArenaBump() {
+    if (object_arena.free) {
+	u32 handle = object_arena.free;
+	object_arena.free = object_arena.base[handle].leaf;
+	return handle;
+    }
+    u32 temp = object_arena.position;
+    object_arena.position++;
+    if (object_arena.position >= object_arena.size) {
+	object_arena.size *=2;
+	object_arena.base = realloc(object_arena.base, object_arena.size*sizeof(Object));
+    }
+    return temp;
+}
+
+Object* iVG_ObjectArenaPointerGet(u32 handle) {
+    if (handle > object_arena.position) {
+	assert(false && "Object handle is not valid (too big)");
+    }
+    return object_arena.base + handle;
+}
+
+void iVG_ObjectArenaDestroy() {
+    free(object_arena.base);
+}
+
+// World AABB of the model bounds moved by the object rows
+void iVG_ObjectBoundsCompute(Object* object, f32* min, f32* max) {
+    Model* model = iVG_ModelArenaPointerGet(object->model);
+    for (u32 row = 0; row < 3; row++) {
+	f32 center = object->rows[row][3];
+	f32 extent = 0;
+	for (u32 k = 0; k < 3; k++) {
+	    center += object->rows[row][k]*model->sphere_center[k];
+	    extent += fabsf(object->rows[row][k])*(model->aabb_max[k] - model->aabb_min[k])*0.5f;
+	}
+	min[row] = center - extent;
+	max[row] = center + extent;
+    }
+}
+
+void iVG_StaticInstancesWrite(StaticInstances* set, u32 first, u32 count, InstanceTransform* transforms) {
+    if (count == 0) return;
+    u8* instances = malloc(instance_stride*count);
+    for (u32 i = 0; i < count; i++) {
+	iVG_InstanceWrite(instances + i*instance_stride, transforms[i].position,
+			  transforms[i].rotation, transforms[i].size);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, set->buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, instance_stride*first, instance_stride*count, instances);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(instances);
+}
+
+void iVG_TextureArenaInit(u32 size) {
+    texture_arena.position = 1;
+    if (size < 2) size = 2;
+    texture_arena.size = size;
+    texture_arena.base = malloc(size*sizeof(u32));
+}
+
+u32 iVG_TextureArenaBump() {
+    u32 temp = texture_arena.position;
+    texture_arena.position++;
+    if (texture_arena.position >= texture_arena.size) {
+	texture_arena.size *=2;
+	texture_arena.base = realloc(texture_arena.base, texture_arena.size*sizeof(u32));
+    }
+    return temp;
+}
+    
+u32* iVG_TextureArenaPointerGet(u32 texture_handle) {
+    if (texture_handle > texture_arena.position) {
+	assert(false && "Texture handle is not valid (too big)");
+    }
+    return texture_arena.base + texture_handle;
+}
+
+void iVG_TextureArenaDestroy() {
+    free(texture_arena.base);
+}
+
+void iVG_TextureUse(u32 texture_handle) {
+    if (texture_handle == texture_current) return;
+    texture_current = texture_handle;
+    u32* texture = iVG_TextureArenaPointerGet(texture_handle);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, *texture);
+    iVG_GLUniformIntSet(UNIFORM_MAIN_TEXTURE, 0);
+}
+
+b8 iVG_TimeDeltaTargetReached() {
+    time_current = glfwGetTime();
+    return (time_current - time_previous) >= time_delta_target;
+}
+
+
+// Keeps the run storage, next frame fills it again without touching the heap
+void iVG_ModelInstancesClear(Model* model) {
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	model->lods[lod].instance_count = 0;
+	model->lods[lod].run_count = 0;
+    }
+    model->instances_culled = 0;
+    model->objects_drawn = 0;
+    model->depth_nearest = FLT_MAX;
+    model->pending_count = 0;
+}
+
+// Returns room for count instances of one LOD in the instance ring.
+// instance_capacity is what a level reserves up front each frame, so a
+// frame like the last one ends up in a single run per level.
+void* iVG_ModelInstancesPush(Model* model, u32 lod, u32 count) {
+    ModelLod* level = model->lods + lod;
+    InstanceRun* run = level->run_count ? level->runs + level->run_count - 1 : NULL;
+    if (!run || run->count + count > run->capacity) {
+	if (level->instance_capacity < level->instance_count + count) {
+	    u32 capacity = level->instance_capacity ? level->instance_capacity : 1;
+	    while (capacity < level->instance_count + count) capacity *= 2;
+	    level->instance_capacity = capacity;
+	}
+	if (level->run_count == level->run_capacity) {
+	    level->run_capacity = level->run_capacity ? level->run_capacity*2 : 4;
+	    level->runs = realloc(level->runs, sizeof(InstanceRun)*level->run_capacity);
+	}
+	run = level->runs + level->run_count++;
+	run->capacity = level->instance_capacity - level->instance_count;
+	run->first = iVG_InstanceRingAlloc(run->capacity);
+	run->count = 0;
+    }
+    
+    u8* instances = instance_ring.mapped + (size_t)instance_stride*(iVG_InstanceRingBaseGet() + run->first + run->count);
+    run->count += count;
+    level->instance_count += count;
+    return instances;
+}
+
+// Gives back the tail of the last push
+void iVG_ModelInstancesPop(Model* model, u32 lod, u32 count) {
+    if (count == 0) return;
+    ModelLod* level = model->lods + lod;
+    level->runs[level->run_count - 1].count -= count;
+    level->instance_count -= count;
+}
+
+// Leaves count slots after the last run unused, the instances pushed next
+// go in a new run that starts behind them
+void iVG_ModelInstancesSkip(Model* model, u32 lod, u32 count) {
+    if (count == 0) return;
+    ModelLod* level = model->lods + lod;
+    InstanceRun* run = level->runs + level->run_count - 1;
+    InstanceRun next = {
+	.first = run->first + run->count + count,
+	.count = 0,
+	.capacity = run->capacity - run->count - count,
+    };
+    run->capacity = run->count;
+    if (level->run_count == level->run_capacity) {
+	level->run_capacity *= 2;
+	level->runs = realloc(level->runs, sizeof(InstanceRun)*level->run_capacity);
+    }
+    level->runs[level->run_count++] = next;
+}
+
+u32 iVG_ModelInstanceCountGet(Model* model) {
+    u32 count = 0;
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	count += model->lods[lod].instance_count;
+    }
+    return count;
+}
+
+void iVG_ModelPendingPush(Model* model, u32 count, f32 pos[][3], f32 rotation[][3], f32 size[][3]) {
+    if (model->pending_count + count > model->pending_capacity) {
+	u32 capacity = model->pending_capacity ? model->pending_capacity : 64;
+	while (capacity < model->pending_count + count) capacity *= 2;
+	model->pending_pos = realloc(model->pending_pos, sizeof(f32[3])*capacity);
+	model->pending_rotation = realloc(model->pending_rotation, sizeof(f32[3])*capacity);
+	model->pending_size = realloc(model->pending_size, sizeof(f32[3])*capacity);
+	model->pending_capacity = capacity;
+    }
+    memcpy(model->pending_pos + model->pending_count, pos, sizeof(f32[3])*count);
+    memcpy(model->pending_rotation + model->pending_count, rotation, sizeof(f32[3])*count);
+    memcpy(model->pending_size + model->pending_count, size, sizeof(f32[3])*count);
+    model->pending_count += count;
+}
+
+void iVG_ModelBoundsCompute(Model* model, Mesh* mesh) {
+    VM3_Set(model->aabb_min, 0, 0, 0);
+    VM3_Set(model->aabb_max, 0, 0, 0);
+    if (mesh->vertex_count) {
+	VM3_Copy(model->aabb_min, mesh->vertices[0].pos);
+	VM3_Copy(model->aabb_max, mesh->vertices[0].pos);
+    }
+    for (u32 i = 1; i < mesh->vertex_count; i++) {
+	for (u32 k = 0; k < 3; k++) {
+	    model->aabb_min[k] = fminf(model->aabb_min[k], mesh->vertices[i].pos[k]);
+	    model->aabb_max[k] = fmaxf(model->aabb_max[k], mesh->vertices[i].pos[k]);
+	}
+    }
+    
+    f32 radius2 = 0;
+    for (u32 k = 0; k < 3; k++) {
+	model->sphere_center[k] = (model->aabb_min[k] + model->aabb_max[k])*0.5f;
+    }
+    for (u32 i = 0; i < mesh->vertex_count; i++) {
+	f32* p = mesh->vertices[i].pos;
+	f32 d[3] = {p[0] - model->sphere_center[0], p[1] - model->sphere_center[1], p[2] - model->sphere_center[2]};
+	radius2 = fmaxf(radius2, d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    }
+    model->sphere_radius = sqrtf(radius2);
+}
+
+// Occluders only need positions, vertices split by normals or uvs are merged back
+void iVG_ModelOccluderMeshBuild(Model* model, Mesh* mesh) {
+    u32* remap = malloc(sizeof(u32)*(mesh->vertex_count ? mesh->vertex_count : 1));
+    iVG_MeshWeld(mesh, remap, offsetof(Vertex, pos), sizeof(mesh->vertices[0].pos));
+    // the first vertex of a position always comes before the others
+    u32 count = 0;
+    for (u32 i = 0; i < mesh->vertex_count; i++) {
+	remap[i] = remap[i] == i ? count++ : remap[remap[i]];
+    }
+    
+    model->occluder_position_count = count;
+    model->occluder_positions = malloc(sizeof(f32[3])*(count ? count : 1));
+    for (u32 i = 0; i < mesh->vertex_count; i++) {
+	VM3_Copy(model->occluder_positions[remap[i]], mesh->vertices[i].pos);
+    }
+    model->occluder_index_count = mesh->index_count;
+    model->occluder_indices = malloc(sizeof(u32)*(mesh->index_count ? mesh->index_count : 1));
+    for (u32 i = 0; i < mesh->index_count; i++) {
+	model->occluder_indices[i] = remap[mesh->indices[i]];
+    }
+    free(remap);
+}
+
+// Called once per frame. The reservation of a level is shrunk to the highest
+// count seen only after instance_shrink_frames frames in a row used at most
+// half of it.
+void iVG_ModelInstancesTrim(Model* model) {
+    if (instance_shrink_frames == 0) return;
+    
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	ModelLod* level = model->lods + lod;
+	if (level->instance_count*2 > level->instance_capacity) {
+	    level->instance_frames_under = 0;
+	    level->instance_high_water = 0;
+	    continue;
+	}
+	
+	if (level->instance_count > level->instance_high_water) {
+	    level->instance_high_water = level->instance_count;
+	}
+	level->instance_frames_under++;
+	if (level->instance_frames_under < instance_shrink_frames) continue;
+	
+	u32 capacity = 0;
+	if (level->instance_high_water) {
+	    capacity = 1;
+	    while (capacity < level->instance_high_water) capacity *= 2;
+	}
+	level->instance_capacity = capacity;
+	level->instance_frames_under = 0;
+	level->instance_high_water = 0;
+    }
+}
+
+void iVG_ModelInstancesFree(Model* model) {
+    free(model->pending_pos);
+    free(model->pending_rotation);
+    free(model->pending_size);
+    model->pending_pos = NULL;
+    model->pending_rotation = NULL;
+    model->pending_size = NULL;
+    model->pending_count = 0;
+    model->pending_capacity = 0;
+    for (u32 lod = 0; lod < model->lod_count; lod++) {
+	ModelLod* level = model->lods + lod;
+	free(level->runs);
+	level->runs = NULL;
+	level->run_count = 0;
+	level->run_capacity = 0;
+	level->instance_count = 0;
+	level->instance_capacity = 0;
+    }
+}
+
+
+// INSTANCE TRANSFORMS
+// Instance matrices are translate * scale * rotate, the rotation applied
+// around X, then Y, then Z, same as the VM44_Rotate/Scale/Translate chain.
+// Every format is written straight from position, rotation and size.
+void iVG_InstanceFormatSet(InstanceFormat format) {
+    instance_format = format;
+    switch (format) {
+    case INSTANCE_FORMAT_MAT4:   instance_stride = sizeof(InstanceMat4);   break;
+    case INSTANCE_FORMAT_AFFINE: instance_stride = sizeof(InstanceAffine); break;
+    case INSTANCE_FORMAT_TRS:    instance_stride = sizeof(InstanceTRS);    break;
+    }
+}
+
+// Row major upper 3x4 of the instance matrix
+void iVG_InstanceRowsCompose(f32 rows[3][4], f32* pos, f32* rotation, f32* size) {
+    f32 sx = sinf(rotation[0]), cx = cosf(rotation[0]);
+    f32 sy = sinf(rotation[1]), cy = cosf(rotation[1]);
+    f32 sz = sinf(rotation[2]), cz = cosf(rotation[2]);
+
+    rows[0][0] = size[0]*(cz*cy);
+    rows[0][1] = size[0]*(cz*sy*sx - sz*cx);
+    rows[0][2] = size[0]*(cz*sy*cx + sz*sx);
+    rows[0][3] = pos[0];
+    rows[1][0] = size[1]*(sz*cy);
+    rows[1][1] = size[1]*(sz*sy*sx + cz*cx);
+    rows[1][2] = size[1]*(sz*sy*cx - cz*sx);
+    rows[1][3] = pos[1];
+    rows[2][0] = size[2]*(-sy);
+    rows[2][1] = size[2]*(cy*sx);
+    rows[2][2] = size[2]*(cy*cx);
+    rows[2][3] = pos[2];
+}
+
+// A flattened axis has no inverse, it counts as the largest of the others
+void iVG_InstanceNormalScaleCompose(f32* out, f32* size) {
+    f32 x = size[0]*size[0], y = size[1]*size[1], z = size[2]*size[2];
+    f32 largest = fmaxf(x, fmaxf(y, z));
+    if (x == 0) x = largest;
+    if (y == 0) y = largest;
+    if (z == 0) z = largest;
+    if (x == y && y == z) {
+	VM3_Set(out, 1, 1, 1);
+	return;
+    }
+    f32 smallest = fminf(x, fminf(y, z));
+    VM3_Set(out, smallest/x, smallest/y, smallest/z);
+}
+
+// Quaternion of the same rotation as snorm16 xyzw
+void iVG_InstanceQuaternionCompose(int16_t* out, f32* rotation) {
+    f32 sx = sinf(rotation[0]*0.5f), cx = cosf(rotation[0]*0.5f);
+    f32 sy = sinf(rotation[1]*0.5f), cy = cosf(rotation[1]*0.5f);
+    f32 sz = sinf(rotation[2]*0.5f), cz = cosf(rotation[2]*0.5f);
+
+    out[0] = lrintf((cz*cy*sx - sz*sy*cx)*32767.0f);
+    out[1] = lrintf((cz*sy*cx + sz*cy*sx)*32767.0f);
+    out[2] = lrintf((sz*cy*cx - cz*sy*sx)*32767.0f);
+    out[3] = lrintf((cz*cy*cx + sz*sy*sx)*32767.0f);
+}
+
+// Writes an instance whose rows are already composed, TRS records ignore them
+void iVG_InstanceStore(void* out, f32 rows[3][4], f32* pos, f32* rotation, f32* size) {
+    if (instance_format == INSTANCE_FORMAT_TRS) {
+	InstanceTRS* instance = out;
+	VM3_Copy(instance->position, pos);
+	VM3_Copy(instance->size, size);
+	iVG_InstanceQuaternionCompose(instance->rotation, rotation);
+	return;
+    }
+    
+    f32 normal_scale[3];
+    iVG_InstanceNormalScaleCompose(normal_scale, size);
+    if (instance_format == INSTANCE_FORMAT_AFFINE) {
+	InstanceAffine* instance = out;
+	memcpy(instance->rows, rows, sizeof(instance->rows));
+	VM3_Copy(instance->normal_scale, normal_scale);
+	return;
+    }
+    
+    InstanceMat4* instance = out;
+    for (u32 column = 0; column < 4; column++) {
+	instance->transform[4*column + 0] = rows[0][column];
+	instance->transform[4*column + 1] = rows[1][column];
+	instance->transform[4*column + 2] = rows[2][column];
+	instance->transform[4*column + 3] = column == 3 ? 1 : 0;
+    }
+    VM3_Copy(instance->normal_scale, normal_scale);
+}
+
+void iVG_InstanceWrite(void* out, f32* pos, f32* rotation, f32* size) {
+    f32 rows[3][4];
+    if (instance_format != INSTANCE_FORMAT_TRS) {
+	iVG_InstanceRowsCompose(rows, pos, rotation, size);
+    }
+    iVG_InstanceStore(out, rows, pos, rotation, size);
+}
+
+#if defined(__SSE2__)
+// Cephes style sincos on four floats at once, good to about 1e-7
+// for |x| < 8192 which is plenty for euler angles.
+static inline void iVG_SinCos4(__m128 x, __m128* s, __m128* c) {
+    const __m128 sign_mask = _mm_set1_ps(-0.0f);
+    __m128 sign_sin = _mm_and_ps(x, sign_mask);
+    x = _mm_andnot_ps(sign_mask, x);
+
+    __m128i j = _mm_cvttps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.27323954473516f)));
+    j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+    __m128 y = _mm_cvtepi32_ps(j);
+
+    __m128i flip_sin = _mm_slli_epi32(_mm_and_si128(j, _mm_set1_epi32(4)), 29);
+    __m128i flip_cos = _mm_slli_epi32(_mm_andnot_si128(_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4)), 29);
+    __m128 poly_mask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_setzero_si128()));
+    sign_sin = _mm_xor_ps(sign_sin, _mm_castsi128_ps(flip_sin));
+
+    x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(0.78515625f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(2.4187564849853515625e-4f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(3.77489497744594108e-8f)));
+    __m128 z = _mm_mul_ps(x, x);
+
+    __m128 yc = _mm_set1_ps(2.443315711809948e-5f);
+    yc = _mm_add_ps(_mm_mul_ps(yc, z), _mm_set1_ps(-1.388731625493765e-3f));
+    yc = _mm_add_ps(_mm_mul_ps(yc, z), _mm_set1_ps(4.166664568298827e-2f));
+    yc = _mm_mul_ps(_mm_mul_ps(yc, z), z);
+    yc = _mm_sub_ps(yc, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    yc = _mm_add_ps(yc, _mm_set1_ps(1.0f));
+
+    __m128 ys = _mm_set1_ps(-1.9515295891e-4f);
+    ys = _mm_add_ps(_mm_mul_ps(ys, z), _mm_set1_ps(8.3321608736e-3f));
+    ys = _mm_add_ps(_mm_mul_ps(ys, z), _mm_set1_ps(-1.6666654611e-1f));
+    ys = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ys, z), x), x);
+
+    __m128 sin_poly = _mm_or_ps(_mm_and_ps(poly_mask, ys), _mm_andnot_ps(poly_mask, yc));
+    __m128 cos_poly = _mm_or_ps(_mm_and_ps(poly_mask, yc), _mm_andnot_ps(poly_mask, ys));
+    *s = _mm_xor_ps(sin_poly, sign_sin);
+    *c = _mm_xor_ps(cos_poly, _mm_castsi128_ps(flip_cos));
+}
+
+// Four packed vec3s into x, y and z lanes
+static inline void iVG_Vec3Load4(f32 v[][3], __m128* x, __m128* y, __m128* z) {
+    __m128 a = _mm_loadu_ps(v[0]);     // x0 y0 z0 x1
+    __m128 b = _mm_loadu_ps(v[0] + 4); // y1 z1 x2 y2
+    __m128 c = _mm_loadu_ps(v[0] + 8); // z2 x3 y3 z3
+    __m128 x2y2x3y3 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2));
+    __m128 y0z0y1z1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1));
+    *x = _mm_shuffle_ps(a, x2y2x3y3, _MM_SHUFFLE(2, 0, 3, 0));
+    *y = _mm_shuffle_ps(y0z0y1z1, x2y2x3y3, _MM_SHUFFLE(3, 1, 2, 0));
+    *z = _mm_shuffle_ps(y0z0y1z1, c, _MM_SHUFFLE(3, 0, 3, 1));
+}
+
+// Same as iVG_InstanceRowsCompose and iVG_InstanceNormalScaleCompose
+// with each element holding four instances
+static inline void iVG_InstanceRowsCompose4(__m128 m[3][4], __m128 normal_scale[3], f32 pos[][3], f32 rotation[][3], f32 size[][3]) {
+    __m128 rx, ry, rz, kx, ky, kz;
+    iVG_Vec3Load4(pos, &m[0][3], &m[1][3], &m[2][3]);
+    iVG_Vec3Load4(rotation, &rx, &ry, &rz);
+    iVG_Vec3Load4(size, &kx, &ky, &kz);
+
+    __m128 sx, cx, sy, cy, sz, cz;
+    iVG_SinCos4(rx, &sx, &cx);
+    iVG_SinCos4(ry, &sy, &cy);
+    iVG_SinCos4(rz, &sz, &cz);
+
+    __m128 sysx = _mm_mul_ps(sy, sx);
+    __m128 sycx = _mm_mul_ps(sy, cx);
+
+    m[0][0] = _mm_mul_ps(kx, _mm_mul_ps(cz, cy));
+    m[0][1] = _mm_mul_ps(kx, _mm_sub_ps(_mm_mul_ps(cz, sysx), _mm_mul_ps(sz, cx)));
+    m[0][2] = _mm_mul_ps(kx, _mm_add_ps(_mm_mul_ps(cz, sycx), _mm_mul_ps(sz, sx)));
+    m[1][0] = _mm_mul_ps(ky, _mm_mul_ps(sz, cy));
+    m[1][1] = _mm_mul_ps(ky, _mm_add_ps(_mm_mul_ps(sz, sysx), _mm_mul_ps(cz, cx)));
+    m[1][2] = _mm_mul_ps(ky, _mm_sub_ps(_mm_mul_ps(sz, sycx), _mm_mul_ps(cz, sx)));
+    m[2][0] = _mm_mul_ps(kz, _mm_xor_ps(sy, _mm_set1_ps(-0.0f)));
+    m[2][1] = _mm_mul_ps(kz, _mm_mul_ps(cy, sx));
+    m[2][2] = _mm_mul_ps(kz, _mm_mul_ps(cy, cx));
+
+    kx = _mm_mul_ps(kx, kx);
+    ky = _mm_mul_ps(ky, ky);
+    kz = _mm_mul_ps(kz, kz);
+    __m128 largest = _mm_max_ps(kx, _mm_max_ps(ky, kz));
+    __m128 zero = _mm_setzero_ps();
+    kx = _mm_or_ps(kx, _mm_and_ps(_mm_cmpeq_ps(kx, zero), largest));
+    ky = _mm_or_ps(ky, _mm_and_ps(_mm_cmpeq_ps(ky, zero), largest));
+    kz = _mm_or_ps(kz, _mm_and_ps(_mm_cmpeq_ps(kz, zero), largest));
+    __m128 smallest = _mm_min_ps(kx, _mm_min_ps(ky, kz));
+    // Flattened axes count as the largest and uniform sizes keep a scale of 1,
+    // like iVG_InstanceNormalScaleCompose
+    __m128 uniform = _mm_and_ps(_mm_cmpeq_ps(kx, ky), _mm_cmpeq_ps(ky, kz));
+    __m128 one = _mm_and_ps(uniform, _mm_set1_ps(1.0f));
+    normal_scale[0] = _mm_or_ps(one, _mm_andnot_ps(uniform, _mm_div_ps(smallest, kx)));
+    normal_scale[1] = _mm_or_ps(one, _mm_andnot_ps(uniform, _mm_div_ps(smallest, ky)));
+    normal_scale[2] = _mm_or_ps(one, _mm_andnot_ps(uniform, _mm_div_ps(smallest, kz)));
+}
+
+// Same as iVG_InstanceSphereGet for four instances
+static inline void iVG_InstanceSpheres4(Model* model, __m128 m[3][4], __m128 center[3], __m128* radius) {
+    __m128 scale2 = _mm_setzero_ps();
+    for (u32 row = 0; row < 3; row++) {
+	center[row] = _mm_add_ps(m[row][3], _mm_add_ps(_mm_add_ps(
+	    _mm_mul_ps(m[row][0], _mm_set1_ps(model->sphere_center[0])),
+	    _mm_mul_ps(m[row][1], _mm_set1_ps(model->sphere_center[1]))),
+	    _mm_mul_ps(m[row][2], _mm_set1_ps(model->sphere_center[2]))));
+	__m128 length2 = _mm_add_ps(_mm_add_ps(
+	    _mm_mul_ps(m[row][0], m[row][0]),
+	    _mm_mul_ps(m[row][1], m[row][1])),
+	    _mm_mul_ps(m[row][2], m[row][2]));
+	scale2 = _mm_max_ps(scale2, length2);
+    }
+    *radius = _mm_mul_ps(_mm_sqrt_ps(scale2), _mm_set1_ps(model->sphere_radius));
+}
+
+// Returns a bit per instance whose bounding sphere touches the frustum
+static inline u32 iVG_FrustumTest4(__m128 center[3], __m128 radius) {
+    radius = _mm_xor_ps(radius, _mm_set1_ps(-0.0f));
+    __m128 visible = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (u32 plane = 0; plane < 6; plane++) {
+	__m128 distance = _mm_add_ps(_mm_add_ps(
+	    _mm_mul_ps(center[0], _mm_set1_ps(frustum_planes[0][plane])),
+	    _mm_mul_ps(center[1], _mm_set1_ps(frustum_planes[1][plane]))), _mm_add_ps(
+	    _mm_mul_ps(center[2], _mm_set1_ps(frustum_planes[2][plane])),
+	    _mm_set1_ps(frustum_planes[3][plane])));
+	visible = _mm_and_ps(visible, _mm_cmpge_ps(distance, radius));
+    }
+    return _mm_movemask_ps(visible);
+}
+
+// Same as iVG_LodSelect for four instances, the levels of the ones with
+// a bit in visible are stored packed
+static inline void iVG_LodSelect4(u8* out, Model* model, __m128 center[3], __m128 radius, u32 visible) {
+    __m128 depth = _mm_add_ps(_mm_add_ps(
+	_mm_mul_ps(center[0], _mm_set1_ps(matrix_view[8])),
+	_mm_mul_ps(center[1], _mm_set1_ps(matrix_view[9]))), _mm_add_ps(
+	_mm_mul_ps(center[2], _mm_set1_ps(matrix_view[10])),
+	_mm_set1_ps(matrix_view[11])));
+    __m128 threshold = _mm_mul_ps(depth, _mm_set1_ps(-LOD_SCREEN_SIZE));
+    __m128 size = _mm_mul_ps(radius, _mm_set1_ps(lod_scale));
+    __m128 lod = _mm_setzero_ps();
+    for (u32 level = 1; level < model->lod_count; level++) {
+	lod = _mm_add_ps(lod, _mm_and_ps(_mm_cmplt_ps(size, threshold), _mm_set1_ps(1.0f)));
+	threshold = _mm_mul_ps(threshold, _mm_set1_ps(0.5f));
+    }
+    f32 lanes[4];
+    _mm_storeu_ps(lanes, lod);
+    for (u32 lane = 0; lane < 4; lane++) {
+	if (visible & (1u << lane)) *out++ = (u8)lanes[lane];
+    }
+}
+
+// Clears the bit of every instance in visible whose box the occluders hide
+static inline u32 iVG_OcclusionTest4(Model* model, __m128 m[3][4], u32 visible) {
+    f32 lanes[3][4][4];
+    for (u32 row = 0; row < 3; row++) {
+	for (u32 column = 0; column < 4; column++) {
+	    _mm_storeu_ps(lanes[row][column], m[row][column]);
+	}
+    }
+    for (u32 lane = 0; lane < 4; lane++) {
+	if (!(visible & (1u << lane))) continue;
+	f32 rows[3][4];
+	for (u32 row = 0; row < 3; row++) {
+	    for (u32 column = 0; column < 4; column++) {
+		rows[row][column] = lanes[row][column][lane];
+	    }
+	}
+	if (!iVG_OcclusionBoxVisible(model, rows)) visible &= ~(1u << lane);
+    }
+    return visible;
+}
+
+static void iVG_InstancesWriteMat44(InstanceMat4* out, __m128 m[3][4], __m128 normal_scale[4]) {
+    for (u32 column = 0; column < 4; column++) {
+	__m128 c0 = m[0][column], c1 = m[1][column], c2 = m[2][column];
+	__m128 c3 = column == 3 ? _mm_set1_ps(1.0f) : _mm_setzero_ps();
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	_mm_storeu_ps(out[0].transform + 4*column, c0);
+	_mm_storeu_ps(out[1].transform + 4*column, c1);
+	_mm_storeu_ps(out[2].transform + 4*column, c2);
+	_mm_storeu_ps(out[3].transform + 4*column, c3);
+    }
+    normal_scale[3] = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(normal_scale[0], normal_scale[1], normal_scale[2], normal_scale[3]);
+    for (u32 i = 0; i < 4; i++) {
+	f32 lanes[4];
+	_mm_storeu_ps(lanes, normal_scale[i]);
+	VM3_Copy(out[i].normal_scale, lanes);
+    }
+}
+
+static void iVG_InstancesWriteAffine4(InstanceAffine* out, __m128 m[3][4], __m128 normal_scale[4]) {
+    for (u32 row = 0; row < 3; row++) {
+	_MM_TRANSPOSE4_PS(m[row][0], m[row][1], m[row][2], m[row][3]);
+	for (u32 i = 0; i < 4; i++) {
+	    _mm_storeu_ps(out[i].rows + 4*row, m[row][i]);
+	}
+    }
+    normal_scale[3] = _mm_setzero_ps();
+    _MM_TRANSPOSE4_PS(normal_scale[0], normal_scale[1], normal_scale[2], normal_scale[3]);
+    for (u32 i = 0; i < 4; i++) {
+	f32 lanes[4];
+	_mm_storeu_ps(lanes, normal_scale[i]);
+	VM3_Copy(out[i].normal_scale, lanes);
+    }
+}
+
+static void iVG_InstancesWriteTRS4(InstanceTRS* out, f32 pos[][3], f32 rotation[][3], f32 size[][3]) {
+    __m128 rx, ry, rz;
+    iVG_Vec3Load4(rotation, &rx, &ry, &rz);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 sx, cx, sy, cy, sz, cz;
+    iVG_SinCos4(_mm_mul_ps(rx, half), &sx, &cx);
+    iVG_SinCos4(_mm_mul_ps(ry, half), &sy, &cy);
+    iVG_SinCos4(_mm_mul_ps(rz, half), &sz, &cz);
+
+    __m128 czcy = _mm_mul_ps(cz, cy), szsy = _mm_mul_ps(sz, sy);
+    __m128 czsy = _mm_mul_ps(cz, sy), szcy = _mm_mul_ps(sz, cy);
+    __m128 q[4] = {
+	_mm_sub_ps(_mm_mul_ps(czcy, sx), _mm_mul_ps(szsy, cx)),
+	_mm_add_ps(_mm_mul_ps(czsy, cx), _mm_mul_ps(szcy, sx)),
+	_mm_sub_ps(_mm_mul_ps(szcy, cx), _mm_mul_ps(czsy, sx)),
+	_mm_add_ps(_mm_mul_ps(czcy, cx), _mm_mul_ps(szsy, sx)),
+    };
+    __m128 snorm = _mm_set1_ps(32767.0f);
+    _MM_TRANSPOSE4_PS(q[0], q[1], q[2], q[3]);
+    for (u32 i = 0; i < 4; i++) {
+	__m128i packed = _mm_cvtps_epi32(_mm_mul_ps(q[i], snorm));
+	_mm_storel_epi64((__m128i*)out[i].rotation, _mm_packs_epi32(packed, packed));
+	VM3_Copy(out[i].position, pos[i]);
+	VM3_Copy(out[i].size, size[i]);
+    }
+}
+#endif
+
+#if defined(__AVX__)
+static inline void iVG_SinCos8(__m256 x, __m256* s, __m256* c) {
+    __m128 s_lo, c_lo, s_hi, c_hi;
+    iVG_SinCos4(_mm256_castps256_ps128(x), &s_lo, &c_lo);
+    iVG_SinCos4(_mm256_extractf128_ps(x, 1), &s_hi, &c_hi);
+    *s = _mm256_insertf128_ps(_mm256_castps128_ps256(s_lo), s_hi, 1);
+    *c = _mm256_insertf128_ps(_mm256_castps128_ps256(c_lo), c_hi, 1);
+}
+
+static inline void iVG_Vec3Load8(f32 v[][3], __m256* x, __m256* y, __m256* z) {
+    __m128 x_lo, y_lo, z_lo, x_hi, y_hi, z_hi;
+    iVG_Vec3Load4(v, &x_lo, &y_lo, &z_lo);
+    iVG_Vec3Load4(v + 4, &x_hi, &y_hi, &z_hi);
+    *x = _mm256_insertf128_ps(_mm256_castps128_ps256(x_lo), x_hi, 1);
+    *y = _mm256_insertf128_ps(_mm256_castps128_ps256(y_lo), y_hi, 1);
+    *z = _mm256_insertf128_ps(_mm256_castps128_ps256(z_lo), z_hi, 1);
+}
+
+// Transposes four lanes of eight instances, instance i ends up in the
+// low half of a[i%4] for i < 4 and in the high half for the rest
+static inline void iVG_Transpose8x4(__m256* a) {
+    __m256 t0 = _mm256_unpacklo_ps(a[0], a[1]);
+    __m256 t1 = _mm256_unpackhi_ps(a[0], a[1]);
+    __m256 t2 = _mm256_unpacklo_ps(a[2], a[3]);
+    __m256 t3 = _mm256_unpackhi_ps(a[2], a[3]);
+    a[0] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    a[1] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    a[2] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    a[3] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+static inline void iVG_InstanceRowsCompose8(__m256 m[3][4], __m256 normal_scale[3], f32 pos[][3], f32 rotation[][3], f32 size[][3]) {
+    __m256 rx, ry, rz, kx, ky, kz;
+    iVG_Vec3Load8(pos, &m[0][3], &m[1][3], &m[2][3]);
+    iVG_Vec3Load8(rotation, &rx, &ry, &rz);
+    iVG_Vec3Load8(size, &kx, &ky, &kz);
+
+    __m256 sx, cx, sy, cy, sz, cz;
+    iVG_SinCos8(rx, &sx, &cx);
+    iVG_SinCos8(ry, &sy, &cy);
+    iVG_SinCos8(rz, &sz, &cz);
+
+    __m256 sysx = _mm256_mul_ps(sy, sx);
+    __m256 sycx = _mm256_mul_ps(sy, cx);
+
+    m[0][0] = _mm256_mul_ps(kx, _mm256_mul_ps(cz, cy));
+    m[0][1] = _mm256_mul_ps(kx, _mm256_sub_ps(_mm256_mul_ps(cz, sysx), _mm256_mul_ps(sz, cx)));
+    m[0][2] = _mm256_mul_ps(kx, _mm256_add_ps(_mm256_mul_ps(cz, sycx), _mm256_mul_ps(sz, sx)));
+    m[1][0] = _mm256_mul_ps(ky, _mm256_mul_ps(sz, cy));
+    m[1][1] = _mm256_mul_ps(ky, _mm256_add_ps(_mm256_mul_ps(sz, sysx), _mm256_mul_ps(cz, cx)));
+    m[1][2] = _mm256_mul_ps(ky, _mm256_sub_ps(_mm256_mul_ps(sz, sycx), _mm256_mul_ps(cz, sx)));
+    m[2][0] = _mm256_mul_ps(kz, _mm256_xor_ps(sy, _mm256_set1_ps(-0.0f)));
+    m[2][1] = _mm256_mul_ps(kz, _mm256_mul_ps(cy, sx));
+    m[2][2] = _mm256_mul_ps(kz, _mm256_mul_ps(cy, cx));
+
+    kx = _mm256_mul_ps(kx, kx);
+    ky = _mm256_mul_ps(ky, ky);
+    kz = _mm256_mul_ps(kz, kz);
+    __m256 largest = _mm256_max_ps(kx, _mm256_max_ps(ky, kz));
+    __m256 zero = _mm256_setzero_ps();
+    kx = _mm256_blendv_ps(kx, largest, _mm256_cmp_ps(kx, zero, _CMP_EQ_OQ));
+    ky = _mm256_blendv_ps(ky, largest, _mm256_cmp_ps(ky, zero, _CMP_EQ_OQ));
+    kz = _mm256_blendv_ps(kz, largest, _mm256_cmp_ps(kz, zero, _CMP_EQ_OQ));
+    __m256 smallest = _mm256_min_ps(kx, _mm256_min_ps(ky, kz));
+    __m256 uniform = _mm256_and_ps(_mm256_cmp_ps(kx, ky, _CMP_EQ_OQ), _mm256_cmp_ps(ky, kz, _CMP_EQ_OQ));
+    __m256 one = _mm256_set1_ps(1.0f);
+    normal_scale[0] = _mm256_blendv_ps(_mm256_div_ps(smallest, kx), one, uniform);
+    normal_scale[1] = _mm256_blendv_ps(_mm256_div_ps(smallest, ky), one, uniform);
+    normal_scale[2] = _mm256_blendv_ps(_mm256_div_ps(smallest, kz), one, uniform);
+}
+
+static inline void iVG_InstanceSpheres8(Model* model, __m256 m[3][4], __m256 center[3], __m256* radius) {
+    __m256 scale2 = _mm256_setzero_ps();
+    for (u32 row = 0; row < 3; row++) {
+	center[row] = _mm256_add_ps(m[row][3], _mm256_add_ps(_mm256_add_ps(
+	    _mm256_mul_ps(m[row][0], _mm256_set1_ps(model->sphere_center[0])),
+	    _mm256_mul_ps(m[row][1], _mm256_set1_ps(model->sphere_center[1]))),
+	    _mm256_mul_ps(m[row][2], _mm256_set1_ps(model->sphere_center[2]))));
+	__m256 length2 = _mm256_add_ps(_mm256_add_ps(
+	    _mm256_mul_ps(m[row][0], m[row][0]),
+	    _mm256_mul_ps(m[row][1], m[row][1])),
+	    _mm256_mul_ps(m[row][2], m[row][2]));
+	scale2 = _mm256_max_ps(scale2, length2);
+    }
+    *radius = _mm256_mul_ps(_mm256_sqrt_ps(scale2), _mm256_set1_ps(model->sphere_radius));
+}
+
+static inline u32 iVG_FrustumTest8(__m256 center[3], __m256 radius) {
+    radius = _mm256_xor_ps(radius, _mm256_set1_ps(-0.0f));
+    __m256 visible = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (u32 plane = 0; plane < 6; plane++) {
+	__m256 distance = _mm256_add_ps(_mm256_add_ps(
+	    _mm256_mul_ps(center[0], _mm256_set1_ps(frustum_planes[0][plane])),
+	    _mm256_mul_ps(center[1], _mm256_set1_ps(frustum_planes[1][plane]))), _mm256_add_ps(
+	    _mm256_mul_ps(center[2], _mm256_set1_ps(frustum_planes[2][plane])),
+	    _mm256_set1_ps(frustum_planes[3][plane])));
+	visible = _mm256_and_ps(visible, _mm256_cmp_ps(distance, radius, _CMP_GE_OQ));
+    }
+    return _mm256_movemask_ps(visible);
+}
+
+static inline void iVG_LodSelect8(u8* out, Model* model, __m256 center[3], __m256 radius, u32 visible) {
+    __m256 depth = _mm256_add_ps(_mm256_add_ps(
+	_mm256_mul_ps(center[0], _mm256_set1_ps(matrix_view[8])),
+	_mm256_mul_ps(center[1], _mm256_set1_ps(matrix_view[9]))), _mm256_add_ps(
+	_mm256_mul_ps(center[2], _mm256_set1_ps(matrix_view[10])),
+	_mm256_set1_ps(matrix_view[11])));
+    __m256 threshold = _mm256_mul_ps(depth, _mm256_set1_ps(-LOD_SCREEN_SIZE));
+    __m256 size = _mm256_mul_ps(radius, _mm256_set1_ps(lod_scale));
+    __m256 lod = _mm256_setzero_ps();
+    for (u32 level = 1; level < model->lod_count; level++) {
+	lod = _mm256_add_ps(lod, _mm256_and_ps(_mm256_cmp_ps(size, threshold, _CMP_LT_OQ), _mm256_set1_ps(1.0f)));
+	threshold = _mm256_mul_ps(threshold, _mm256_set1_ps(0.5f));
+    }
+    f32 lanes[8];
+    _mm256_storeu_ps(lanes, lod);
+    for (u32 lane = 0; lane < 8; lane++) {
+	if (visible & (1u << lane)) *out++ = (u8)lanes[lane];
+    }
+}
+
+static inline u32 iVG_OcclusionTest8(Model* model, __m256 m[3][4], u32 visible) {
+    f32 lanes[3][4][8];
+    for (u32 row = 0; row < 3; row++) {
+	for (u32 column = 0; column < 4; column++) {
+	    _mm256_storeu_ps(lanes[row][column], m[row][column]);
+	}
+    }
+    for (u32 lane = 0; lane < 8; lane++) {
+	if (!(visible & (1u << lane))) continue;
+	f32 rows[3][4];
+	for (u32 row = 0; row < 3; row++) {
+	    for (u32 column = 0; column < 4; column++) {
+		rows[row][column] = lanes[row][column][lane];
+	    }
+	}
+	if (!iVG_OcclusionBoxVisible(model, rows)) visible &= ~(1u << lane);
+    }
+    return visible;
+}
+
+static void iVG_InstancesWriteMat48(InstanceMat4* out, __m256 m[3][4], __m256 normal_scale[4]) {
+    for (u32 column = 0; column < 4; column++) {
+	__m256 c[4] = {
+	    m[0][column], m[1][column], m[2][column],
+	    column == 3 ? _mm256_set1_ps(1.0f) : _mm256_setzero_ps(),
+	};
+	iVG_Transpose8x4(c);
+	for (u32 i = 0; i < 4; i++) {
+	    _mm_storeu_ps(out[i].transform + 4*column,   _mm256_castps256_ps128(c[i]));
+	    _mm_storeu_ps(out[i+4].transform + 4*column, _mm256_extractf128_ps(c[i], 1));
+	}
+    }
+    normal_scale[3] = _mm256_setzero_ps();
+    iVG_Transpose8x4(normal_scale);
+    for (u32 i = 0; i < 4; i++) {
+	f32 lanes[8];
+	_mm256_storeu_ps(lanes, normal_scale[i]);
+	VM3_Copy(out[i].normal_scale, lanes);
+	VM3_Copy(out[i+4].normal_scale, lanes + 4);
+    }
+}
+
+static void iVG_InstancesWriteAffine8(InstanceAffine* out, __m256 m[3][4], __m256 normal_scale[4]) {
+    for (u32 row = 0; row < 3; row++) {
+	iVG_Transpose8x4(m[row]);
+	for (u32 i = 0; i < 4; i++) {
+	    _mm_storeu_ps(out[i].rows + 4*row,   _mm256_castps256_ps128(m[row][i]));
+	    _mm_storeu_ps(out[i+4].rows + 4*row, _mm256_extractf128_ps(m[row][i], 1));
+	}
+    }
+    normal_scale[3] = _mm256_setzero_ps();
+    iVG_Transpose8x4(normal_scale);
+    for (u32 i = 0; i < 4; i++) {
+	f32 lanes[8];
+	_mm256_storeu_ps(lanes, normal_scale[i]);
+	VM3_Copy(out[i].normal_scale, lanes);
+	VM3_Copy(out[i+4].normal_scale, lanes + 4);
+    }
+}
+#endif
+
+// Copies the instances whose bit is set in visible out of a group written to scratch
+static u32 iVG_InstancesCompact(u8* out, u8* scratch, u32 visible, u32 lanes) {
+    u32 written = 0;
+    for (u32 lane = 0; lane < lanes; lane++) {
+	if (visible & (1u << lane)) {
+	    memcpy(out + written*instance_stride, scratch + lane*instance_stride, instance_stride);
+	    written++;
+	}
+    }
+    return written;
+}
+
+// Writes the instances that pass the frustum test of model, or all of them
+// without cull, packed at the start of out. While the occlusion buffer is
+// ready instances it hides are left out too, unless model is an occluder.
+// With lods the LOD of every written instance goes to the same place in it.
+// depth_nearest, unless NULL, is lowered to the nearest written instance in
+// front of the camera. model may be NULL when neither culling nor LODs are
+// asked for. Returns how many were written
+u32 iVG_InstancesWrite(void* out, u32 count, f32 pos[][3], f32 rotation[][3], f32 size[][3],
+		       Model* model, b8 cull, u8* lods, f32* depth_nearest) {
+    u8* target = out;
+    u32 written = 0;
+    u32 i = 0;
+    b8 occlude = model && occlusion.ready && !model->occluder;
+#if defined(__AVX__)
+    if (instance_format != INSTANCE_FORMAT_TRS) {
+	for (; i + 8 <= count; i += 8) {
+	    __m256 m[3][4], normal_scale[4];
+	    iVG_InstanceRowsCompose8(m, normal_scale, pos + i, rotation + i, size + i);
+	    u32 visible = 0xFF;
+	    if (cull || lods || occlude) {
+		__m256 center[3], radius;
+		iVG_InstanceSpheres8(model, m, center, &radius);
+		if (cull) visible = iVG_FrustumTest8(center, radius);
+		if (occlude && visible) visible = iVG_OcclusionTest8(model, m, visible);
+		if (lods) iVG_LodSelect8(lods + written, model, center, radius, visible);
+	    }
+	    if (visible == 0) continue;
+	    if (depth_nearest) iVG_InstancesDepthNearestFold(depth_nearest, pos + i, visible, 8);
+	    
+	    u8 scratch[8*sizeof(InstanceMat4)];
+	    u8* group = visible == 0xFF ? target + written*instance_stride : scratch;
+	    if (instance_format == INSTANCE_FORMAT_MAT4) {
+		iVG_InstancesWriteMat48((InstanceMat4*)group, m, normal_scale);
+	    } else {
+		iVG_InstancesWriteAffine8((InstanceAffine*)group, m, normal_scale);
+	    }
+	    written += visible == 0xFF ? 8 : iVG_InstancesCompact(target + written*instance_stride, scratch, visible, 8);
+	}
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+	__m128 m[3][4], normal_scale[4];
+	if (instance_format != INSTANCE_FORMAT_TRS || cull || lods || occlude) {
+	    iVG_InstanceRowsCompose4(m, normal_scale, pos + i, rotation + i, size + i);
+	}
+	u32 visible = 0xF;
+	if (cull || lods || occlude) {
+	    __m128 center[3], radius;
+	    iVG_InstanceSpheres4(model, m, center, &radius);
+	    if (cull) visible = iVG_FrustumTest4(center, radius);
+	    if (occlude && visible) visible = iVG_OcclusionTest4(model, m, visible);
+	    if (lods) iVG_LodSelect4(lods + written, model, center, radius, visible);
+	}
+	if (visible == 0) continue;
+	if (depth_nearest) iVG_InstancesDepthNearestFold(depth_nearest, pos + i, visible, 4);
+	
+	u8 scratch[4*sizeof(InstanceMat4)];
+	u8* group = visible == 0xF ? target + written*instance_stride : scratch;
+	switch (instance_format) {
+	case INSTANCE_FORMAT_MAT4:
+	    iVG_InstancesWriteMat44((InstanceMat4*)group, m, normal_scale);
+	    break;
+	case INSTANCE_FORMAT_AFFINE:
+	    iVG_InstancesWriteAffine4((InstanceAffine*)group, m, normal_scale);
+	    break;
+	case INSTANCE_FORMAT_TRS:
+	    iVG_InstancesWriteTRS4((InstanceTRS*)group, pos + i, rotation + i, size + i);
+	    break;
+	}
+	written += visible == 0xF ? 4 : iVG_InstancesCompact(target + written*instance_stride, scratch, visible, 4);
+    }
+#endif
+    
+    for (; i < count; i++) {
+	f32 rows[3][4];
+	if (instance_format != INSTANCE_FORMAT_TRS || cull || lods || occlude) {
+	    iVG_InstanceRowsCompose(rows, pos[i], rotation[i], size[i]);
+	}
+	if (cull || lods || occlude) {
+	    f32 center[3], radius;
+	    iVG_InstanceSphereGet(model, rows, center, &radius);
+	    if (cull && !iVG_FrustumSphereVisible(center, radius)) continue;
+	    if (occlude && !iVG_OcclusionBoxVisible(model, rows)) continue;
+	    if (lods) lods[written] = iVG_LodSelect(model, center, radius);
+	}
+	if (depth_nearest) iVG_InstancesDepthNearestFold(depth_nearest, pos + i, 1, 1);
+	iVG_InstanceStore(target + written*instance_stride, rows, pos[i], rotation[i], size[i]);
+	written++;
+    }
+    return written;
+}
+
+// Over the lanes set in visible
+void iVG_InstancesDepthNearestFold(f32* depth_nearest, f32 pos[][3], u32 visible, u32 lanes) {
+    for (u32 lane = 0; lane < lanes; lane++) {
+	if (!(visible & (1u << lane))) continue;
+	f32 depth = iVG_ViewDepthGet(pos[lane]);
+	if (depth > 0) *depth_nearest = fminf(*depth_nearest, depth);
+    }
+}
+
+// FRUSTUM
+
+// Every plane passes everything until the first VG_DrawingBegin
+void iVG_FrustumReset() {
+    memset(frustum_planes, 0, sizeof(frustum_planes));
+    for (u32 plane = 0; plane < 8; plane++) {
+	frustum_planes[3][plane] = FLT_MAX;
+    }
+}
+
+// Extracts the six planes from the rows of projection * view, normals point inwards
+void iVG_FrustumUpdate() {
+    f32 (*clip)[4] = matrix_view_projection;
+    for (u32 row = 0; row < 4; row++) {
+	for (u32 column = 0; column < 4; column++) {
+	    clip[row][column] = 0;
+	    for (u32 k = 0; k < 4; k++) {
+		clip[row][column] += matrix_projection[4*row + k]*matrix_view[4*k + column];
+	    }
+	}
+    }
+    
+    iVG_FrustumReset();
+    for (u32 plane = 0; plane < 6; plane++) {
+	f32 sign = plane % 2 ? -1 : 1;
+	f32 p[4];
+	for (u32 k = 0; k < 4; k++) {
+	    p[k] = clip[3][k] + sign*clip[plane/2][k];
+	}
+	f32 length = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+	for (u32 k = 0; k < 4; k++) {
+	    frustum_planes[k][plane] = p[k]/length;
+	}
+    }
+}
+
+b8 iVG_FrustumSphereVisible(f32* center, f32 radius) {
+#if defined(__SSE2__)
+    __m128 cx = _mm_set1_ps(center[0]), cy = _mm_set1_ps(center[1]), cz = _mm_set1_ps(center[2]);
+    __m128 r = _mm_set1_ps(-radius);
+    for (u32 plane = 0; plane < 8; plane += 4) {
+	__m128 distance = _mm_add_ps(_mm_add_ps(
+	    _mm_mul_ps(cx, _mm_loadu_ps(frustum_planes[0] + plane)),
+	    _mm_mul_ps(cy, _mm_loadu_ps(frustum_planes[1] + plane))), _mm_add_ps(
+	    _mm_mul_ps(cz, _mm_loadu_ps(frustum_planes[2] + plane)),
+	    _mm_loadu_ps(frustum_planes[3] + plane)));
+	if (_mm_movemask_ps(_mm_cmplt_ps(distance, r))) return false;
+    }
+#else
+    for (u32 plane = 0; plane < 6; plane++) {
+	f32 distance = frustum_planes[0][plane]*center[0] + frustum_planes[1][plane]*center[1]
+	    + frustum_planes[2][plane]*center[2] + frustum_planes[3][plane];
+	if (distance < -radius) return false;
+    }
+#endif
+    return true;
+}
+
+// The model bounding sphere moved by the instance rows, the radius grows
+// with the largest axis scale so the sphere stays conservative
+void iVG_InstanceSphereGet(Model* model, f32 rows[3][4], f32* center, f32* radius) {
+    f32 scale2 = 0;
+    for (u32 row = 0; row < 3; row++) {
+	center[row] = rows[row][0]*model->sphere_center[0] + rows[row][1]*model->sphere_center[1]
+	    + rows[row][2]*model->sphere_center[2] + rows[row][3];
+	scale2 = fmaxf(scale2, rows[row][0]*rows[row][0] + rows[row][1]*rows[row][1] + rows[row][2]*rows[row][2]);
+    }
+    *radius = sqrtf(scale2)*model->sphere_radius;
+}
+
+// OCCLUSION
+void iVG_OcclusionInit() {
+    u32 size = 0;
+    for (u32 level = 0; level < OCCLUSION_LEVELS; level++) {
+	size += (OCCLUSION_WIDTH >> level)*(OCCLUSION_HEIGHT >> level);
+    }
+    f32* depth = malloc(sizeof(f32)*size);
+    for (u32 level = 0; level < OCCLUSION_LEVELS; level++) {
+	occlusion.levels[level] = depth;
+	depth += (OCCLUSION_WIDTH >> level)*(OCCLUSION_HEIGHT >> level);
+    }
+    occlusion.instances = NULL;
+    occlusion.instance_count = 0;
+    occlusion.instance_capacity = 0;
+    occlusion.triangles = NULL;
+    occlusion.triangle_capacity = 0;
+    occlusion.ready = false;
+}
+
+void iVG_OcclusionDestroy() {
+    free(occlusion.levels[0]);
+    free(occlusion.instances);
+    free(occlusion.triangles);
+}
+
+// Rasterizes the occluder instances given this frame and the objects of
+// occluder models, then builds the pyramid the other instances are tested with
+void iVG_OcclusionBuild() {
+    occlusion.ready = false;
+    occlusion.instance_count = 0;
+    if (!occlusion_culling) return;
+    
+    for (u32 i = 1; i < model_arena.position; i++) {
+	Model* model = model_arena.base + i;
+	if (!model->occluder) continue;
+	for (u32 k = 0; k < model->pending_count; k++) {
+	    f32 rows[3][4];
+	    iVG_InstanceRowsCompose(rows, model->pending_pos[k], model->pending_rotation[k], model->pending_size[k]);
+	    iVG_OcclusionInstancePush(model, rows);
+	}
+    }
+    for (u32 i = 1; i < object_arena.position; i++) {
+	Object* object = object_arena.base + i;
+	if (object->model && model_arena.base[object->model].occluder) {
+	    iVG_OcclusionInstancePush(model_arena.base + object->model, object->rows);
+	}
+    }
+    if (!occlusion.instance_count) return;
+    
+    // clipping at the near plane turns a triangle into two at most
+    u32 triangle_count = 0;
+    for (u32 i = 0; i < occlusion.instance_count; i++) {
+	OcclusionInstance* instance = occlusion.instances + i;
+	instance->first_triangle = triangle_count;
+	triangle_count += instance->model->occluder_index_count/3*2;
+    }
+    if (triangle_count > occlusion.triangle_capacity) {
+	occlusion.triangle_capacity = triangle_count;
+	occlusion.triangles = realloc(occlusion.triangles, sizeof(OcclusionTriangle)*triangle_count);
+    }
+    
+    JobCounter counter = {0};
+    for (u32 i = 0; i < occlusion.instance_count; i++) {
+	VG_JobSubmit(iVG_OcclusionSetupJob, occlusion.instances + i, &counter);
+    }
+    VG_JobWait(&counter);
+    for (u32 band = 0; band < OCCLUSION_HEIGHT/OCCLUSION_BAND_HEIGHT; band++) {
+	VG_JobSubmit(iVG_OcclusionRasterJob, (void*)(uintptr_t)band, &counter);
+    }
+    VG_JobWait(&counter);
+    
+    iVG_OcclusionPyramidBuild();
+    occlusion.ready = true;
+}
+
+// Queues an occluder instance unless it is outside the frustum
+void iVG_OcclusionInstancePush(Model* model, f32 rows[3][4]) {
+    f32 center[3], radius;
+    iVG_InstanceSphereGet(model, rows, center, &radius);
+    if (!iVG_FrustumSphereVisible(center, radius)) return;
+    
+    if (occlusion.instance_count == occlusion.instance_capacity) {
+	occlusion.instance_capacity = occlusion.instance_capacity ? occlusion.instance_capacity*2 : 16;
+	occlusion.instances = realloc(occlusion.instances, sizeof(OcclusionInstance)*occlusion.instance_capacity);
+    }
+    OcclusionInstance* instance = occlusion.instances + occlusion.instance_count++;
+    instance->model = model;
+    memcpy(instance->rows, rows, sizeof(instance->rows));
+    instance->triangle_count = 0;
+}
+
+// projection * view * rows
+static inline void iVG_OcclusionMatrixCompose(f32 out[4][4], f32 rows[3][4]) {
+    for (u32 row = 0; row < 4; row++) {
+	for (u32 column = 0; column < 4; column++) {
+	    out[row][column] = column == 3 ? matrix_view_projection[row][3] : 0;
+	    for (u32 k = 0; k < 3; k++) {
+		out[row][column] += matrix_view_projection[row][k]*rows[k][column];
+	    }
+	}
+    }
+}
+
+// Projects the triangles of one occluder instance into its part of
+// occlusion.triangles, dropping back faces and whatever is off screen
+void iVG_OcclusionSetupJob(void* data) {
+    OcclusionInstance* instance = data;
+    Model* model = instance->model;
+    f32 m[4][4];
+    iVG_OcclusionMatrixCompose(m, instance->rows);
+    
+    OcclusionTriangle* out = occlusion.triangles + instance->first_triangle;
+    u32 count = 0;
+    for (u32 i = 0; i + 3 <= model->occluder_index_count; i += 3) {
+	// x, y and w of the corners, cut at w = OCCLUSION_NEAR
+	f32 corners[3][3];
+	for (u32 k = 0; k < 3; k++) {
+	    f32* p = model->occluder_positions[model->occluder_indices[i + k]];
+	    corners[k][0] = m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3];
+	    corners[k][1] = m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3];
+	    corners[k][2] = m[3][0]*p[0] + m[3][1]*p[1] + m[3][2]*p[2] + m[3][3];
+	}
+	f32 polygon[4][3];
+	u32 polygon_count = 0;
+	for (u32 k = 0; k < 3; k++) {
+	    f32* a = corners[k];
+	    f32* b = corners[(k + 1) % 3];
+	    if (a[2] >= OCCLUSION_NEAR) VM3_Copy(polygon[polygon_count++], a);
+	    if ((a[2] >= OCCLUSION_NEAR) != (b[2] >= OCCLUSION_NEAR)) {
+		f32 t = (OCCLUSION_NEAR - a[2])/(b[2] - a[2]);
+		for (u32 c = 0; c < 3; c++) {
+		    polygon[polygon_count][c] = a[c] + (b[c] - a[c])*t;
+		}
+		polygon_count++;
+	    }
+	}
+	if (polygon_count < 3) continue;
+	
+	f32 x[4], y[4], z[4];
+	for (u32 k = 0; k < polygon_count; k++) {
+	    z[k] = 1.0f/polygon[k][2];
+	    x[k] = (polygon[k][0]*z[k]*0.5f + 0.5f)*OCCLUSION_WIDTH;
+	    y[k] = (polygon[k][1]*z[k]*0.5f + 0.5f)*OCCLUSION_HEIGHT;
+	}
+	for (u32 k = 1; k + 1 < polygon_count; k++) {
+	    u32 v[3] = {0, k, k + 1};
+	    f32 area = (x[v[1]] - x[v[0]])*(y[v[2]] - y[v[0]]) - (x[v[2]] - x[v[0]])*(y[v[1]] - y[v[0]]);
+	    if (area <= 0) continue;
+	    f32 x_min = fminf(x[v[0]], fminf(x[v[1]], x[v[2]]));
+	    f32 x_max = fmaxf(x[v[0]], fmaxf(x[v[1]], x[v[2]]));
+	    f32 y_min = fminf(y[v[0]], fminf(y[v[1]], y[v[2]]));
+	    f32 y_max = fmaxf(y[v[0]], fmaxf(y[v[1]], y[v[2]]));
+	    if (x_max < 0 || y_max < 0 || x_min > OCCLUSION_WIDTH || y_min > OCCLUSION_HEIGHT) continue;
+	    
+	    OcclusionTriangle* triangle = out + count++;
+	    for (u32 c = 0; c < 3; c++) {
+		triangle->x[c] = x[v[c]];
+		triangle->y[c] = y[v[c]];
+		triangle->z[c] = z[v[c]];
+	    }
+	}
+    }
+    instance->triangle_count = count;
+}
+
+// Clears one band of rows and draws every occluder triangle over it. Only
+// pixels whose center is strictly inside a triangle are covered, which keeps
+// the occluders from growing at their edges
+void iVG_OcclusionRasterJob(void* data) {
+    u32 y_begin = (u32)(uintptr_t)data*OCCLUSION_BAND_HEIGHT;
+    u32 y_end = y_begin + OCCLUSION_BAND_HEIGHT;
+    f32* depth = occlusion.levels[0];
+    memset(depth + y_begin*OCCLUSION_WIDTH, 0, sizeof(f32)*OCCLUSION_WIDTH*OCCLUSION_BAND_HEIGHT);
+    
+    for (u32 i = 0; i < occlusion.instance_count; i++) {
+	OcclusionInstance* instance = occlusion.instances + i;
+	OcclusionTriangle* triangles = occlusion.triangles + instance->first_triangle;
+	for (u32 t = 0; t < instance->triangle_count; t++) {
+	    OcclusionTriangle* triangle = triangles + t;
+	    f32* x = triangle->x;
+	    f32* y = triangle->y;
+	    f32* z = triangle->z;
+	    // rows and columns whose pixel centers fall in the bounds
+	    int row_first = (int)ceilf(fminf(y[0], fminf(y[1], y[2])) - 0.5f);
+	    int row_last = (int)floorf(fmaxf(y[0], fmaxf(y[1], y[2])) - 0.5f);
+	    int column_first = (int)ceilf(fminf(x[0], fminf(x[1], x[2])) - 0.5f);
+	    int column_last = (int)floorf(fmaxf(x[0], fmaxf(x[1], x[2])) - 0.5f);
+	    if (row_first < (int)y_begin) row_first = y_begin;
+	    if (row_last >= (int)y_end) row_last = y_end - 1;
+	    if (column_first < 0) column_first = 0;
+	    if (column_last >= OCCLUSION_WIDTH) column_last = OCCLUSION_WIDTH - 1;
+	    if (row_first > row_last || column_first > column_last) continue;
+	    
+	    // edge k is positive on the inner side of the edge from corner k to the next
+	    f32 a[3], b[3], c[3];
+	    for (u32 k = 0; k < 3; k++) {
+		u32 next = (k + 1) % 3;
+		a[k] = y[k] - y[next];
+		b[k] = x[next] - x[k];
+		c[k] = -(a[k]*x[k] + b[k]*y[k]);
+	    }
+	    f32 area = (x[1] - x[0])*(y[2] - y[0]) - (x[2] - x[0])*(y[1] - y[0]);
+	    f32 dzdx = ((z[1] - z[0])*(y[2] - y[0]) - (z[2] - z[0])*(y[1] - y[0]))/area;
+	    f32 dzdy = ((z[2] - z[0])*(x[1] - x[0]) - (z[1] - z[0])*(x[2] - x[0]))/area;
+	    f32 dzc = z[0] - dzdx*x[0] - dzdy*y[0];
+	    
+	    for (int row = row_first; row <= row_last; row++) {
+		f32 py = row + 0.5f;
+		f32* line = depth + row*OCCLUSION_WIDTH;
+		int column = column_first;
+#if defined(__SSE2__)
+		// four pixels at a time from an aligned column, the ones outside are masked
+		column &= ~3;
+		__m128 e_row[3], a4[3];
+		for (u32 k = 0; k < 3; k++) {
+		    e_row[k] = _mm_set1_ps(b[k]*py + c[k]);
+		    a4[k] = _mm_set1_ps(a[k]);
+		}
+		__m128 z_row = _mm_set1_ps(dzdy*py + dzc);
+		__m128 dzdx4 = _mm_set1_ps(dzdx);
+		for (; column <= column_last; column += 4) {
+		    __m128 px = _mm_add_ps(_mm_set1_ps((f32)column), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+		    __m128 inside = _mm_and_ps(_mm_and_ps(
+			_mm_cmpgt_ps(_mm_add_ps(_mm_mul_ps(a4[0], px), e_row[0]), _mm_setzero_ps()),
+			_mm_cmpgt_ps(_mm_add_ps(_mm_mul_ps(a4[1], px), e_row[1]), _mm_setzero_ps())),
+			_mm_cmpgt_ps(_mm_add_ps(_mm_mul_ps(a4[2], px), e_row[2]), _mm_setzero_ps()));
+		    __m128 pz = _mm_and_ps(inside, _mm_add_ps(_mm_mul_ps(dzdx4, px), z_row));
+		    _mm_storeu_ps(line + column, _mm_max_ps(_mm_loadu_ps(line + column), pz));
+		}
+#endif
+		for (; column <= column_last; column++) {
+		    f32 px = column + 0.5f;
+		    if (a[0]*px + b[0]*py + c[0] > 0 && a[1]*px + b[1]*py + c[1] > 0
+			&& a[2]*px + b[2]*py + c[2] > 0) {
+			line[column] = fmaxf(line[column], dzdx*px + dzdy*py + dzc);
+		    }
+		}
+	    }
+	}
+    }
+}
+
+void iVG_OcclusionPyramidBuild() {
+    for (u32 level = 1; level < OCCLUSION_LEVELS; level++) {
+	f32* below = occlusion.levels[level - 1];
+	f32* above = occlusion.levels[level];
+	u32 width = OCCLUSION_WIDTH >> level;
+	u32 height = OCCLUSION_HEIGHT >> level;
+	for (u32 y = 0; y < height; y++) {
+	    f32* row0 = below + 2*y*2*width;
+	    f32* row1 = row0 + 2*width;
+	    for (u32 x = 0; x < width; x++) {
+		above[y*width + x] = fminf(fminf(row0[2*x], row0[2*x + 1]), fminf(row1[2*x], row1[2*x + 1]));
+	    }
+	}
+    }
+}
+
+// False when the model box moved by rows is behind the occluders everywhere
+// it covers. The covered pixels get one more on each side since occluders
+// are only sampled at pixel centers
+b8 iVG_OcclusionBoxVisible(Model* model, f32 rows[3][4]) {
+    f32 m[4][4];
+    iVG_OcclusionMatrixCompose(m, rows);
+    f32 center[4], axes[3][4];
+    for (u32 row = 0; row < 4; row++) {
+	center[row] = m[row][3];
+	for (u32 k = 0; k < 3; k++) {
+	    center[row] += m[row][k]*(model->aabb_min[k] + model->aabb_max[k])*0.5f;
+	    axes[k][row] = m[row][k]*(model->aabb_max[k] - model->aabb_min[k])*0.5f;
+	}
+    }
+    
+    f32 x_min = FLT_MAX, y_min = FLT_MAX, x_max = -FLT_MAX, y_max = -FLT_MAX, z_max = 0;
+    for (u32 corner = 0; corner < 8; corner++) {
+	f32 p[4];
+	for (u32 row = 0; row < 4; row++) {
+	    p[row] = center[row];
+	    for (u32 k = 0; k < 3; k++) {
+		p[row] += corner & (1u << k) ? axes[k][row] : -axes[k][row];
+	    }
+	}
+	if (p[3] < OCCLUSION_NEAR) return true;
+	f32 z = 1.0f/p[3];
+	f32 x = (p[0]*z*0.5f + 0.5f)*OCCLUSION_WIDTH;
+	f32 y = (p[1]*z*0.5f + 0.5f)*OCCLUSION_HEIGHT;
+	x_min = fminf(x_min, x);
+	x_max = fmaxf(x_max, x);
+	y_min = fminf(y_min, y);
+	y_max = fmaxf(y_max, y);
+	z_max = fmaxf(z_max, z);
+    }
+    if (x_max < 0 || y_max < 0 || x_min >= OCCLUSION_WIDTH || y_min >= OCCLUSION_HEIGHT) return true;
+    
+    int x0 = (int)floorf(x_min) - 1, x1 = (int)floorf(x_max) + 1;
+    int y0 = (int)floorf(y_min) - 1, y1 = (int)floorf(y_max) + 1;
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 >= OCCLUSION_WIDTH) x1 = OCCLUSION_WIDTH - 1;
+    if (y1 >= OCCLUSION_HEIGHT) y1 = OCCLUSION_HEIGHT - 1;
+    // the level where the box spans two texels at most, the last one is two by one
+    u32 level = 0;
+    while ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1) level++;
+    
+    f32* depth = occlusion.levels[level];
+    u32 width = OCCLUSION_WIDTH >> level;
+    for (int y = y0 >> level; y <= y1 >> level; y++) {
+	for (int x = x0 >> level; x <= x1 >> level; x++) {
+	    if (depth[y*width + x] <= z_max) return true;
+	}
+    }
+    return false;
+}
+
+// MESH LOD
+void iVG_LodScaleUpdate() {
+    lod_scale = matrix_projection[5]*exp2f(-lod_bias);
+}
+
+// Coarsest level the bounding sphere allows. It covers radius*lod_scale/depth
+// of the screen height, LOD 0 is kept down to LOD_SCREEN_SIZE of it
+u32 iVG_LodSelect(Model* model, f32* center, f32 radius) {
+    f32 threshold = iVG_ViewDepthGet(center)*LOD_SCREEN_SIZE;
+    f32 size = radius*lod_scale;
+    u32 lod = 0;
+    while (lod + 1 < model->lod_count && size < threshold) {
+	lod++;
+	threshold *= 0.5f;
+    }
+    return lod;
+}
+
+// remap[i] becomes the first vertex whose size bytes at offset are the same as those of vertex i
+void iVG_MeshWeld(Mesh* mesh, u32* remap, size_t offset, size_t size) {
+    u32 capacity = 1;
+    while (capacity < mesh->vertex_count*2) capacity *= 2;
+    u32* table = malloc(sizeof(u32)*capacity);
+    memset(table, 0xFF, sizeof(u32)*capacity);
+    
+    for (u32 i = 0; i < mesh->vertex_count; i++) {
+	u8* key = (u8*)(mesh->vertices + i) + offset;
+	u32 hash = 2166136261u;
+	for (size_t k = 0; k < size; k++) {
+	    hash = (hash ^ key[k])*16777619u;
+	}
+	u32 slot = hash & (capacity - 1);
+	while (table[slot] != UINT32_MAX && memcmp((u8*)(mesh->vertices + table[slot]) + offset, key, size)) {
+	    slot = (slot + 1) & (capacity - 1);
+	}
+	if (table[slot] == UINT32_MAX) table[slot] = i;
+	remap[i] = table[slot];
+    }
+    free(table);
+}
+
+// Triangles around each position, the ones of position p are
+// adjacency[offsets[p]] up to adjacency[offsets[p + 1]]
+void iVG_MeshAdjacencyBuild(u32* triangles, u32 triangle_count, u32* position, u32 vertex_count,
+			    u32* offsets, u32* adjacency) {
+    memset(offsets, 0, sizeof(u32)*(vertex_count + 1));
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	offsets[position[triangles[i]] + 1]++;
+    }
+    for (u32 i = 0; i < vertex_count; i++) {
+	offsets[i + 1] += offsets[i];
+    }
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	adjacency[offsets[position[triangles[i]]]++] = i/3;
+    }
+    for (u32 i = vertex_count; i > 0; i--) {
+	offsets[i] = offsets[i - 1];
+    }
+    offsets[0] = 0;
+}
+
+static inline void iVG_QuadricPlaneAdd(Quadric* quadric, f64 a, f64 b, f64 c, f64 d) {
+    f64 plane[10] = {a*a, a*b, a*c, a*d, b*b, b*c, b*d, c*c, c*d, d*d};
+    for (u32 k = 0; k < 10; k++) {
+	quadric->q[k] += plane[k];
+    }
+}
+
+static inline f64 iVG_QuadricError(Quadric* quadric, f32* p) {
+    f64* q = quadric->q;
+    f64 x = p[0], y = p[1], z = p[2];
+    return q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x
+	+ q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y
+	+ q[7]*z*z + 2*q[8]*z + q[9];
+}
+
+static inline void iVG_TriangleNormal(f32* out, f32* a, f32* b, f32* c) {
+    f32 u[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    f32 v[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    out[0] = u[1]*v[2] - u[2]*v[1];
+    out[1] = u[2]*v[0] - u[0]*v[2];
+    out[2] = u[0]*v[1] - u[1]*v[0];
+}
+
+static int iVG_LodCollapseCompare(const void* a, const void* b) {
+    f32 x = ((const LodCollapse*)a)->cost, y = ((const LodCollapse*)b)->cost;
+    return (x > y) - (x < y);
+}
+
+// Returns the index buffer of every level back to back, LOD 0 being the
+// mesh indices as they are. Vertices sharing a position but not the rest
+// sit on a seam and stay, like the ones on open borders. Each pass sorts the
+// possible collapses by error and takes them while they don't touch what
+// an earlier one of the pass changed or flip a triangle.
+u32* iVG_MeshLodsBuild(Mesh* mesh, u32* lod_count, u32 index_counts[MODEL_LOD_MAX]) {
+    u32 capacity = mesh->index_count*2;
+    u32* out = malloc(sizeof(u32)*(capacity ? capacity : 1));
+    memcpy(out, mesh->indices, sizeof(u32)*mesh->index_count);
+    index_counts[0] = mesh->index_count;
+    *lod_count = 1;
+    u32 triangle_count = mesh->index_count/3;
+    if (triangle_count < 32) return out;
+    
+    u32 n = mesh->vertex_count;
+    Vertex* vertices = mesh->vertices;
+    u32* vertex = malloc(sizeof(u32)*n);
+    u32* position = malloc(sizeof(u32)*n);
+    iVG_MeshWeld(mesh, vertex, 0, sizeof(Vertex));
+    iVG_MeshWeld(mesh, position, offsetof(Vertex, pos), sizeof(vertices[0].pos));
+    
+    u32* triangles = malloc(sizeof(u32)*triangle_count*3);
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	triangles[i] = vertex[mesh->indices[i]];
+    }
+    
+    Quadric* quadrics = calloc(n, sizeof(Quadric));
+    u8* locked = calloc(n, 1);
+    u8* touched = malloc(n);
+    u32* remap = malloc(sizeof(u32)*n);
+    u32* offsets = malloc(sizeof(u32)*(n + 1));
+    u32* adjacency = malloc(sizeof(u32)*triangle_count*3);
+    LodCollapse* collapses = malloc(sizeof(LodCollapse)*triangle_count*6);
+    
+    // remap holds the first corner seen at each position for a moment
+    for (u32 i = 0; i < n; i++) {
+	remap[i] = UINT32_MAX;
+    }
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	u32 p = position[triangles[i]];
+	if (remap[p] == UINT32_MAX) remap[p] = triangles[i];
+	else if (remap[p] != triangles[i]) locked[p] = true;
+    }
+    for (u32 i = 0; i < n; i++) {
+	remap[i] = i;
+    }
+    
+    f32 min[3], max[3];
+    VM3_Copy(min, vertices[triangles[0]].pos);
+    VM3_Copy(max, vertices[triangles[0]].pos);
+    for (u32 t = 0; t < triangle_count; t++) {
+	f32* p[3];
+	for (u32 k = 0; k < 3; k++) {
+	    p[k] = vertices[triangles[3*t + k]].pos;
+	    for (u32 axis = 0; axis < 3; axis++) {
+		min[axis] = fminf(min[axis], p[k][axis]);
+		max[axis] = fmaxf(max[axis], p[k][axis]);
+	    }
+	}
+	f32 normal[3];
+	iVG_TriangleNormal(normal, p[0], p[1], p[2]);
+	f32 length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+	if (length == 0) continue;
+	for (u32 axis = 0; axis < 3; axis++) {
+	    normal[axis] /= length;
+	}
+	f32 d = -(normal[0]*p[0][0] + normal[1]*p[0][1] + normal[2]*p[0][2]);
+	for (u32 k = 0; k < 3; k++) {
+	    iVG_QuadricPlaneAdd(quadrics + position[triangles[3*t + k]], normal[0], normal[1], normal[2], d);
+	}
+    }
+    f32 extent[3] = {max[0] - min[0], max[1] - min[1], max[2] - min[2]};
+    f64 error_max = MESH_LOD_ERROR_MAX*sqrtf(extent[0]*extent[0] + extent[1]*extent[1] + extent[2]*extent[2]);
+    error_max *= error_max;
+    
+    // an edge only one triangle has is on a border
+    iVG_MeshAdjacencyBuild(triangles, triangle_count, position, n, offsets, adjacency);
+    for (u32 p = 0; p < n; p++) {
+	for (u32 j = offsets[p]; j < offsets[p + 1] && !locked[p]; j++) {
+	    for (u32 k = 0; k < 3; k++) {
+		u32 q = position[triangles[3*adjacency[j] + k]];
+		if (q == p) continue;
+		u32 shared = 0;
+		for (u32 other = offsets[p]; other < offsets[p + 1]; other++) {
+		    u32* triangle = triangles + 3*adjacency[other];
+		    shared += position[triangle[0]] == q || position[triangle[1]] == q || position[triangle[2]] == q;
+		}
+		if (shared == 1) locked[p] = true;
+	    }
+	}
+    }
+    
+    u32 current = triangle_count;
+    u32 previous = triangle_count;
+    u32 total = mesh->index_count;
+    for (u32 lod = 1; lod < MODEL_LOD_MAX; lod++) {
+	u32 target = triangle_count >> lod;
+	while (current > target) {
+	    iVG_MeshAdjacencyBuild(triangles, current, position, n, offsets, adjacency);
+	    u32 collapse_count = 0;
+	    for (u32 i = 0; i < current*3; i++) {
+		u32 a = triangles[i];
+		u32 b = triangles[i - i%3 + (i%3 + 1)%3];
+		u32 pa = position[a], pb = position[b];
+		if (pa == pb) continue;
+		f32 cost_ab = iVG_QuadricError(quadrics + pa, vertices[b].pos) + iVG_QuadricError(quadrics + pb, vertices[b].pos);
+		f32 cost_ba = iVG_QuadricError(quadrics + pa, vertices[a].pos) + iVG_QuadricError(quadrics + pb, vertices[a].pos);
+		if (!locked[pa]) collapses[collapse_count++] = (LodCollapse){a, b, cost_ab};
+		if (!locked[pb]) collapses[collapse_count++] = (LodCollapse){b, a, cost_ba};
+	    }
+	    qsort(collapses, collapse_count, sizeof(LodCollapse), iVG_LodCollapseCompare);
+	    
+	    memset(touched, 0, n);
+	    u32 collapsed = 0;
+	    u32 remaining = current;
+	    for (u32 i = 0; i < collapse_count && remaining > target; i++) {
+		LodCollapse* collapse = collapses + i;
+		if (collapse->cost > error_max) break;
+		u32 pa = position[collapse->from], pb = position[collapse->to];
+		if (touched[pa] || touched[pb]) continue;
+		
+		u32 removed = 0;
+		b8 valid = true;
+		for (u32 j = offsets[pa]; j < offsets[pa + 1] && valid; j++) {
+		    u32* triangle = triangles + 3*adjacency[j];
+		    f32* p[3];
+		    f32* moved[3];
+		    b8 shared = false;
+		    for (u32 k = 0; k < 3; k++) {
+			p[k] = vertices[triangle[k]].pos;
+			moved[k] = position[triangle[k]] == pa ? vertices[collapse->to].pos : p[k];
+			shared |= position[triangle[k]] == pb;
+		    }
+		    if (shared) {
+			removed++;
+			continue;
+		    }
+		    f32 before[3], after[3];
+		    iVG_TriangleNormal(before, p[0], p[1], p[2]);
+		    iVG_TriangleNormal(after, moved[0], moved[1], moved[2]);
+		    f32 dot = before[0]*after[0] + before[1]*after[1] + before[2]*after[2];
+		    f32 lengths = sqrtf((before[0]*before[0] + before[1]*before[1] + before[2]*before[2])
+					*(after[0]*after[0] + after[1]*after[1] + after[2]*after[2]));
+		    valid = dot > 0.25f*lengths;
+		}
+		if (!valid) continue;
+		
+		remap[collapse->from] = collapse->to;
+		for (u32 k = 0; k < 10; k++) {
+		    quadrics[pb].q[k] += quadrics[pa].q[k];
+		}
+		for (u32 j = offsets[pa]; j < offsets[pa + 1]; j++) {
+		    u32* triangle = triangles + 3*adjacency[j];
+		    for (u32 k = 0; k < 3; k++) {
+			touched[position[triangle[k]]] = true;
+		    }
+		}
+		remaining -= removed;
+		collapsed++;
+	    }
+	    if (!collapsed) break;
+	    
+	    u32 kept = 0;
+	    for (u32 t = 0; t < current; t++) {
+		u32 a = remap[triangles[3*t]], b = remap[triangles[3*t + 1]], c = remap[triangles[3*t + 2]];
+		if (position[a] == position[b] || position[b] == position[c] || position[c] == position[a]) continue;
+		triangles[3*kept] = a;
+		triangles[3*kept + 1] = b;
+		triangles[3*kept + 2] = c;
+		kept++;
+	    }
+	    current = kept;
+	}
+	// a level that barely saves anything over the last one isn't worth its memory
+	if (current*4 > previous*3) break;
+	
+	if (total + current*3 > capacity) {
+	    while (total + current*3 > capacity) capacity *= 2;
+	    out = realloc(out, sizeof(u32)*capacity);
+	}
+	memcpy(out + total, triangles, sizeof(u32)*current*3);
+	index_counts[lod] = current*3;
+	total += current*3;
+	(*lod_count)++;
+	previous = current;
+    }
+    
+    free(vertex);
+    free(position);
+    free(triangles);
+    free(quadrics);
+    free(locked);
+    free(touched);
+    free(remap);
+    free(offsets);
+    free(adjacency);
+    free(collapses);
+    return out;
+}
+
+// MESH OPTIMIZATION
+void VG_MeshOptimizationSet(b8 enabled) {
+    mesh_optimization = enabled;
+}
+
+void VG_ModelVertexCacheStatsGet(u32 model_handle, f32* acmr, f32* atvr) {
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    if (acmr) memcpy(acmr, model->acmr, sizeof(model->acmr));
+    if (atvr) memcpy(atvr, model->atvr, sizeof(model->atvr));
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+// Every level gets its own triangle order, the vertices then follow the
+// order the levels use them in
+void iVG_MeshOptimize(Model* model, Mesh* mesh, u32* indices, u32 lod_count, u32* index_counts) {
+    u32* timestamps = malloc(sizeof(u32)*(mesh->vertex_count ? mesh->vertex_count : 1));
+    iVG_VertexCacheStatsGet(indices, index_counts[0], mesh->vertex_count, timestamps, model->acmr + 0, model->atvr + 0);
+    if (mesh_optimization) {
+	u32 first = 0;
+	for (u32 lod = 0; lod < lod_count; lod++) {
+	    iVG_MeshTrianglesOptimize(mesh, indices + first, index_counts[lod], timestamps);
+	    first += index_counts[lod];
+	}
+	iVG_MeshFetchOptimize(mesh, indices, first);
+    }
+    iVG_VertexCacheStatsGet(indices, index_counts[0], mesh->vertex_count, timestamps, model->acmr + 1, model->atvr + 1);
+    free(timestamps);
 }
 
-u32 iVG_GLLoadVerticesIndexed(Vertex* vertices, u32 vcount, u32* indices, u32 icount) {
-    u32 VAO = iVG_GLVertexArrayNew();
-    iVG_GLVertexArrayBind(VAO);
+// Tipsify order, then clusters of it that are about as good for the cache
+// as the whole, sorted so the ones facing away from the middle come first
+void iVG_MeshTrianglesOptimize(Mesh* mesh, u32* indices, u32 index_count, u32* timestamps) {
+    u32 triangle_count = index_count/3;
+    if (!triangle_count) return;
+    u32* ordered = malloc(sizeof(u32)*triangle_count*3);
+    iVG_MeshTipsify(indices, triangle_count, mesh->vertex_count, timestamps, ordered);
+    // an exported order can already beat Tipsify, the better one gets clustered
+    f32 acmr_before, acmr_after, atvr;
+    iVG_VertexCacheStatsGet(indices, index_count, mesh->vertex_count, timestamps, &acmr_before, &atvr);
+    iVG_VertexCacheStatsGet(ordered, index_count, mesh->vertex_count, timestamps, &acmr_after, &atvr);
+    if (acmr_before <= acmr_after) memcpy(ordered, indices, sizeof(u32)*triangle_count*3);
     
-    iVG_GLBufferVertices(vertices, vcount);
+    u32* clusters = malloc(sizeof(u32)*(triangle_count + 1));
+    u32* bounds = malloc(sizeof(u32)*(triangle_count + 1));
+    u32 hard_count = iVG_MeshHardBoundariesFind(ordered, triangle_count, mesh->vertex_count, timestamps, bounds);
+    bounds[hard_count] = triangle_count;
+    u32 cluster_count = iVG_MeshSoftBoundariesFind(ordered, bounds, hard_count, mesh->vertex_count,
+						   timestamps, clusters);
+    clusters[cluster_count] = triangle_count;
     
-    iVG_GLBufferIndices(indices, icount, 0);
-    iVG_GLVertexArrayUnbind();
-    return VAO;
+    f32 mesh_center[3] = {0, 0, 0};
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	f32* p = mesh->vertices[ordered[i]].pos;
+	for (u32 k = 0; k < 3; k++) mesh_center[k] += p[k]/(triangle_count*3);
+    }
+    
+    MeshCluster* sorted = malloc(sizeof(MeshCluster)*cluster_count);
+    for (u32 c = 0; c < cluster_count; c++) {
+	// area weighted center and summed normal of the cluster
+	f32 center[3] = {0, 0, 0}, normal[3] = {0, 0, 0}, area = 0;
+	for (u32 t = clusters[c]; t < clusters[c + 1]; t++) {
+	    f32* p[3];
+	    for (u32 k = 0; k < 3; k++) p[k] = mesh->vertices[ordered[t*3 + k]].pos;
+	    f32 e1[3] = {p[1][0] - p[0][0], p[1][1] - p[0][1], p[1][2] - p[0][2]};
+	    f32 e2[3] = {p[2][0] - p[0][0], p[2][1] - p[0][1], p[2][2] - p[0][2]};
+	    f32 n[3] = {e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0]};
+	    f32 weight = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+	    for (u32 k = 0; k < 3; k++) {
+		center[k] += (p[0][k] + p[1][k] + p[2][k])*(weight/3);
+		normal[k] += n[k];
+	    }
+	    area += weight;
+	}
+	f32 length = sqrtf(normal[0]*normal[0] + normal[1]*normal[1] + normal[2]*normal[2]);
+	f32 key = 0;
+	for (u32 k = 0; k < 3; k++) {
+	    f32 offset = (area > 0 ? center[k]/area : 0) - mesh_center[k];
+	    key += offset*(length > 0 ? normal[k]/length : 0);
+	}
+	sorted[c] = (MeshCluster){.key = key, .cluster = c};
+    }
+    qsort(sorted, cluster_count, sizeof(MeshCluster), iVG_MeshClusterCompare);
+    
+    u32* out = indices;
+    for (u32 i = 0; i < cluster_count; i++) {
+	u32 c = sorted[i].cluster;
+	u32 count = (clusters[c + 1] - clusters[c])*3;
+	memcpy(out, ordered + clusters[c]*3, sizeof(u32)*count);
+	out += count;
+    }
+    free(sorted);
+    free(bounds);
+    free(clusters);
+    free(ordered);
 }
 
-void iVG_GLModelRender(Model *model) {
-    iVG_GLVertexArrayBind(model->VAO);
+// Fans around one vertex at a time. The next is the vertex of the last fan
+// that still has triangles and stays longest in the cache while fanning
+// around it, or the most recent one with triangles left when no vertex
+// fits the cache, or the first one with any left at all.
+void iVG_MeshTipsify(u32* indices, u32 triangle_count, u32 vertex_count, u32* timestamps, u32* out) {
+    u32* offsets = calloc(vertex_count + 1, sizeof(u32));
+    u32* live = malloc(sizeof(u32)*(vertex_count ? vertex_count : 1));
+    u32* adjacency = malloc(sizeof(u32)*triangle_count*3);
+    u32* dead_ends = malloc(sizeof(u32)*triangle_count*3);
+    u8* emitted = calloc(triangle_count, 1);
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	offsets[indices[i] + 1]++;
+    }
+    for (u32 v = 0; v < vertex_count; v++) {
+	offsets[v + 1] += offsets[v];
+	live[v] = offsets[v];
+    }
+    for (u32 i = 0; i < triangle_count*3; i++) {
+	adjacency[live[indices[i]]++] = i/3;
+    }
+    for (u32 v = 0; v < vertex_count; v++) {
+	live[v] = offsets[v + 1] - offsets[v];
+    }
+    memset(timestamps, 0, sizeof(u32)*vertex_count);
     
-    glDrawElements(GL_TRIANGLES, model->index_count, GL_UNSIGNED_INT, NULL);
+    u32 time = VERTEX_CACHE_SIZE + 1;
+    u32 written = 0, dead_count = 0, cursor = 0;
+    u32 fan = UINT32_MAX;
+    while (cursor < vertex_count && !live[cursor]) cursor++;
+    if (cursor < vertex_count) fan = cursor;
+    while (fan != UINT32_MAX) {
+	u32 fan_start = written;
+	for (u32 a = offsets[fan]; a < offsets[fan + 1]; a++) {
+	    u32 triangle = adjacency[a];
+	    if (emitted[triangle]) continue;
+	    emitted[triangle] = true;
+	    for (u32 k = 0; k < 3; k++) {
+		u32 v = indices[triangle*3 + k];
+		out[written++] = v;
+		dead_ends[dead_count++] = v;
+		live[v]--;
+		if (time - timestamps[v] > VERTEX_CACHE_SIZE) timestamps[v] = time++;
+	    }
+	}
+	
+	fan = UINT32_MAX;
+	int64_t best = -1;
+	for (u32 i = fan_start; i < written; i++) {
+	    u32 v = out[i];
+	    if (!live[v]) continue;
+	    int64_t priority = 0;
+	    if (time - timestamps[v] + 2*live[v] <= VERTEX_CACHE_SIZE) priority = time - timestamps[v];
+	    if (priority > best) {
+		best = priority;
+		fan = v;
+	    }
+	}
+	while (fan == UINT32_MAX && dead_count) {
+	    u32 v = dead_ends[--dead_count];
+	    if (live[v]) fan = v;
+	}
+	while (fan == UINT32_MAX && cursor < vertex_count) {
+	    if (live[cursor]) fan = cursor;
+	    else cursor++;
+	}
+    }
+    free(emitted);
+    free(dead_ends);
+    free(adjacency);
+    free(live);
+    free(offsets);
+}
 
-    iVG_GLVertexArrayBind(0);
+// A triangle missing the cache with all three vertices usually starts a
+// part of the mesh that has nothing to do with the one before
+u32 iVG_MeshHardBoundariesFind(u32* indices, u32 triangle_count, u32 vertex_count, u32* timestamps, u32* out) {
+    memset(timestamps, 0, sizeof(u32)*vertex_count);
+    u32 time = VERTEX_CACHE_SIZE + 1;
+    u32 count = 0;
+    for (u32 t = 0; t < triangle_count; t++) {
+	u32 misses = iVG_VertexCacheMisses(indices + t*3, timestamps, &time);
+	if (t == 0 || misses == 3) out[count++] = t;
+    }
+    return count;
 }
 
-u32 iVG_GLInstancesBuffer(InstanceData* instances, u32 instance_count) {
-    u32 instance_vbo;
-    glGenBuffers(1, &instance_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceData)*instance_count, instances, GL_DYNAMIC_DRAW);
+// Cuts each hard cluster where the triangles since the last cut miss the
+// cache no more than MESH_OVERDRAW_THRESHOLD times as often as the whole
+// cluster does, merging the leftover at the end into the cluster before
+u32 iVG_MeshSoftBoundariesFind(u32* indices, u32* hard, u32 hard_count, u32 vertex_count, u32* timestamps,
+			       u32* out) {
+    memset(timestamps, 0, sizeof(u32)*vertex_count);
+    u32 time = VERTEX_CACHE_SIZE + 1;
+    u32 count = 0;
+    for (u32 h = 0; h < hard_count; h++) {
+	u32 start = hard[h], end = hard[h + 1];
+	time += VERTEX_CACHE_SIZE + 1;
+	u32 misses = 0;
+	for (u32 t = start; t < end; t++) {
+	    misses += iVG_VertexCacheMisses(indices + t*3, timestamps, &time);
+	}
+	f32 threshold = MESH_OVERDRAW_THRESHOLD*misses/(end - start);
+	
+	out[count++] = start;
+	time += VERTEX_CACHE_SIZE + 1;
+	u32 running_misses = 0, running_triangles = 0;
+	for (u32 t = start; t < end; t++) {
+	    running_misses += iVG_VertexCacheMisses(indices + t*3, timestamps, &time);
+	    running_triangles++;
+	    if ((f32)running_misses/running_triangles <= threshold) {
+		out[count++] = t + 1;
+		time += VERTEX_CACHE_SIZE + 1;
+		running_misses = running_triangles = 0;
+	    }
+	}
+	if (out[count - 1] != start) count--;
+    }
+    return count;
+}
 
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(0));    
-    glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(4*sizeof(f32)));
-    glEnableVertexAttribArray(5);
-    glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(8*sizeof(f32)));
-    glEnableVertexAttribArray(6);
-    glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(12*sizeof(f32)));
-    
-    glVertexAttribDivisor(3, 1);
-    glVertexAttribDivisor(4, 1);
-    glVertexAttribDivisor(5, 1);
-    glVertexAttribDivisor(6, 1);
+int iVG_MeshClusterCompare(const void* a, const void* b) {
+    const MeshCluster* x = a;
+    const MeshCluster* y = b;
+    if (x->key != y->key) return x->key > y->key ? -1 : 1;
+    return x->cluster < y->cluster ? -1 : x->cluster > y->cluster;
+}
 
-    return instance_vbo;
+// Numbers vertices in the order indices first use them, unused ones last
+void iVG_MeshFetchOptimize(Mesh* mesh, u32* indices, u32 index_count) {
+    u32* remap = malloc(sizeof(u32)*(mesh->vertex_count ? mesh->vertex_count : 1));
+    memset(remap, 0xFF, sizeof(u32)*mesh->vertex_count);
+    u32 next = 0;
+    for (u32 i = 0; i < index_count; i++) {
+	if (remap[indices[i]] == UINT32_MAX) remap[indices[i]] = next++;
+	indices[i] = remap[indices[i]];
+    }
+    Vertex* vertices = malloc(sizeof(Vertex)*(mesh->vertex_count ? mesh->vertex_count : 1));
+    for (u32 v = 0; v < mesh->vertex_count; v++) {
+	if (remap[v] == UINT32_MAX) remap[v] = next++;
+	vertices[remap[v]] = mesh->vertices[v];
+    }
+    for (u32 i = 0; i < mesh->index_count; i++) {
+	mesh->indices[i] = remap[mesh->indices[i]];
+    }
+    free(mesh->vertices);
+    mesh->vertices = vertices;
+    free(remap);
 }
 
-void iVG_GLModelRenderInstances(Model *model) {
-    iVG_GLVertexArrayBind(model->VAO);
-    
-    if (model->instance_count > model->instance_vbo_capacity) {
-	glDeleteBuffers(1, &model->instance_vbo);
-	model->instance_vbo = iVG_GLInstancesBuffer(model->instances, model->instance_count);
-	model->instance_vbo_capacity = model->instance_count;
-	iVG_Log("New instance VBO");
-    } else {
-	glBindBuffer(GL_ARRAY_BUFFER, model->instance_vbo);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(InstanceData)*model->instance_count, model->instances);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+// Misses of one triangle in a FIFO cache, where a vertex stays until
+// VERTEX_CACHE_SIZE misses came after its own
+u32 iVG_VertexCacheMisses(u32* triangle, u32* timestamps, u32* time) {
+    u32 misses = 0;
+    for (u32 k = 0; k < 3; k++) {
+	if (*time - timestamps[triangle[k]] > VERTEX_CACHE_SIZE) {
+	    timestamps[triangle[k]] = (*time)++;
+	    misses++;
+	}
     }
-    
-    // Buffering instance data
-    glDrawElementsInstanced(GL_TRIANGLES, model->index_count, GL_UNSIGNED_INT, NULL, model->instance_count);
-    
-    iVG_GLVertexArrayBind(0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);    
+    return misses;
 }
 
-char* iVG_FileLoadToString(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-	printf("ERROR: No file with path %s\n", path);
-	exit(1);
+// Misses per triangle and per vertex the indices use
+void iVG_VertexCacheStatsGet(u32* indices, u32 index_count, u32 vertex_count, u32* timestamps,
+			     f32* acmr, f32* atvr) {
+    memset(timestamps, 0, sizeof(u32)*vertex_count);
+    u32 time = VERTEX_CACHE_SIZE + 1;
+    u32 misses = 0;
+    for (u32 t = 0; t < index_count/3; t++) {
+	misses += iVG_VertexCacheMisses(indices + t*3, timestamps, &time);
     }
+    // every used vertex missed at least once, so it has a timestamp
+    u32 used = 0;
+    for (u32 v = 0; v < vertex_count; v++) {
+	used += timestamps[v] != 0;
+    }
+    *acmr = index_count >= 3 ? (f32)misses/(index_count/3) : 0;
+    *atvr = used ? (f32)misses/used : 0;
+}
 
-    fseek(file, 0, SEEK_END);
-    u32 length = ftell(file);
-    rewind(file);
+// VERTEX QUANTIZATION
+u32 iVG_VertexStrideGet() {
+    return vertex_quantization ? sizeof(VertexQuantized) : sizeof(Vertex);
+}
 
-    char* buffer = (char*)malloc(length + 1);
+u32 iVG_IndexSizeGet(u32 vertex_count) {
+    return !geometry_pool.VAO && vertex_count <= 65536 ? sizeof(uint16_t) : sizeof(u32);
+}
 
-    size_t bytes_read = fread(buffer, 1, length, file);
+GLenum iVG_IndexTypeGet(Model* model) {
+    return model->index_size == sizeof(uint16_t) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+}
 
-    if (bytes_read != length) {
-	fclose(file);
-	free(buffer);
-	printf("ERROR: Unable to read file\n");
-	exit(1);
+// The cube keeps one scale for all axes, so the instance normal matrices stay right
+void iVG_ModelPositionDequantizeSet(Model* model) {
+    f32 half = 0;
+    for (u32 k = 0; k < 3; k++) {
+	model->position_dequantize[k] = (model->aabb_min[k] + model->aabb_max[k])*0.5f;
+	half = fmaxf(half, (model->aabb_max[k] - model->aabb_min[k])*0.5f);
     }
+    model->position_dequantize[3] = half;
+}
 
-    buffer[length] = '\0';
-
-    fclose(file);
-    
-    return buffer;
+// Packed over the vertices themselves, VertexQuantized being the smaller.
+// Returns what goes to GL: vertices when quantization is off.
+void* iVG_VerticesQuantize(Model* model, Vertex* vertices, u32 count) {
+    if (!vertex_quantization) return vertices;
+    for (u32 i = 0; i < count; i++) {
+	Vertex vertex = vertices[i];
+	VertexQuantized packed;
+	iVG_VertexQuantize(&packed, &vertex, model->position_dequantize);
+	memcpy((u8*)vertices + (u64)i*sizeof(packed), &packed, sizeof(packed));
+    }
+    return vertices;
 }
 
-// SHADERS
-void VG_ShaderUse(u32 shader) {
-    if (shader_current == shader) return;
-    shader_current = shader;
-    glUseProgram(shader);
-    iVG_GLShaderCameraUpdate();
-    iVG_GLShaderLightUpdate();
-    iVG_GLShaderProjectionUpdate();
+// In place as well, returns indices as index_size bytes each
+void* iVG_IndicesNarrow(u32* indices, u64 count, u32 index_size) {
+    if (index_size == sizeof(u32)) return indices;
+    for (u64 i = 0; i < count; i++) {
+	uint16_t index = (uint16_t)indices[i];
+	memcpy((u8*)indices + i*sizeof(index), &index, sizeof(index));
+    }
+    return indices;
 }
 
-u32 VG_ShaderLoad(const char* vertex_path, const char* fragment_path) {
-    u32 vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+void iVG_VertexQuantize(VertexQuantized* out, Vertex* vertex, f32* dequantize) {
+    f32 scale = dequantize[3] > 0 ? 1/dequantize[3] : 0;
+    for (u32 k = 0; k < 3; k++) {
+	f32 position = fminf(fmaxf((vertex->pos[k] - dequantize[k])*scale, -1), 1);
+	out->pos[k] = lrintf(position*32767.0f);
+    }
+    out->pad = 0;
+    
+    f32* n = vertex->normal;
+    f32 length = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+    f32 inverse = length > 0 ? 1/length : 0;
+    out->normal = 0;
+    for (u32 k = 0; k < 3; k++) {
+	int32_t component = lrintf(fminf(fmaxf(n[k]*inverse, -1), 1)*511.0f);
+	out->normal |= ((u32)component & 0x3FF) << (10*k);
+    }
+    
+    out->tex[0] = iVG_HalfFromFloat(vertex->tex[0]);
+    out->tex[1] = iVG_HalfFromFloat(vertex->tex[1]);
+}
 
-    char* vertex_shader_source = iVG_FileLoadToString(vertex_path);
-    glShaderSource(vertex_shader, 1, (const char**)&vertex_shader_source, NULL);
-    glCompileShader(vertex_shader);
-    free(vertex_shader_source);
+// Rounded to nearest even, too large becomes infinity
+uint16_t iVG_HalfFromFloat(f32 value) {
+    u32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    u32 sign = (bits >> 16) & 0x8000;
+    u32 magnitude = bits & 0x7FFFFFFF;
+    if (magnitude >= 0x7F800000) return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+    if (magnitude < 0x33000000) return sign;
     
-    int32_t success;
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &success);
+    u32 half, rest, midpoint;
+    if (magnitude < 0x38800000) {
+	// subnormal, in steps of 2^-24
+	u32 shift = 126 - (magnitude >> 23);
+	u32 mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+	half = mantissa >> shift;
+	rest = mantissa & ((1u << shift) - 1);
+	midpoint = 1u << (shift - 1);
+    } else {
+	half = (magnitude >> 13) - (112 << 10);
+	rest = magnitude & 0x1FFF;
+	midpoint = 0x1000;
+    }
+    // a carry out of the mantissa moves on to the next exponent, as it should
+    if (rest > midpoint || (rest == midpoint && (half & 1))) half++;
+    if (half > 0x7C00) half = 0x7C00;
+    return sign | half;
+}
 
-    if (!success) {
-	char info_log[512];
-	glGetShaderInfoLog(vertex_shader, 512, NULL, info_log);
-	printf("VERTEX SHADER ERROR: %s\n", info_log);
-	exit(1);
-    }    
+// OBJECT TREE
+void iVG_ObjectTreeInit(u32 size) {
+    object_tree.position = 1;
+    if (size < 2) size = 2;
+    object_tree.size = size;
+    object_tree.nodes = malloc(size*sizeof(ObjectNode));
+    object_tree.free = 0;
+    object_tree.root = 0;
+    object_tree.stack = NULL;
+    object_tree.stack_size = 0;
+}
 
-    u32 fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    char* fragment_shader_source = iVG_FileLoadToString(fragment_path);
-    glShaderSource(fragment_shader, 1, (const char**)&fragment_shader_source, NULL);
-    glCompileShader(fragment_shader);
-    free(fragment_shader_source);
-    
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
+void iVG_ObjectTreeDestroy() {
+    free(object_tree.nodes);
+    free(object_tree.stack);
+}
 
-    if (!success) {
-	char info_log[512];
-	glGetShaderInfoLog(fragment_shader, 512, NULL, info_log);
-	printf("FRAGMENT SHADER ERROR: %s\n", info_log);
-	exit(1);
+u32 iVG_ObjectTreeNodeAlloc() {
+    u32 index = object_tree.free;
+    if (index) {
+	object_tree.free = object_tree.nodes[index].parent;
+    } else {
+	index = object_tree.position++;
+	if (object_tree.position >= object_tree.size) {
+	    object_tree.size *= 2;
+	    object_tree.nodes = realloc(object_tree.nodes, object_tree.size*sizeof(ObjectNode));
+	}
     }
+    ObjectNode* node = object_tree.nodes + index;
+    node->parent = 0;
+    node->child[0] = 0;
+    node->child[1] = 0;
+    node->object = 0;
+    node->height = 0;
+    return index;
+}
 
-    int32_t shader_program = glCreateProgram();
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    glLinkProgram(shader_program);
-
+void iVG_ObjectTreeNodeFree(u32 index) {
+    object_tree.nodes[index].parent = object_tree.free;
+    object_tree.nodes[index].height = -1;
+    object_tree.free = index;
+}
 
-    glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
-    if(!success) {
-	char info_log[512];
-	glGetProgramInfoLog(shader_program, 512, NULL, info_log);
-	printf("ERROR: %s\n", info_log);
-	exit(1);
+static inline void iVG_ObjectNodeUnion(ObjectNode* out, ObjectNode* a, ObjectNode* b) {
+    for (u32 k = 0; k < 3; k++) {
+	out->min[k] = fminf(a->min[k], b->min[k]);
+	out->max[k] = fmaxf(a->max[k], b->max[k]);
     }
-    
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
-    return shader_program;
 }
 
-void iVG_FramebufferSizeCallback(GLFWwindow *window, int width, int height) {
-    glViewport(0, 0, width, height);
-    VM2_Set(window_size, width, height);
+// Half the surface area, what the insertion cost is measured in
+static inline f32 iVG_ObjectNodeArea(ObjectNode* node) {
+    f32 x = node->max[0] - node->min[0];
+    f32 y = node->max[1] - node->min[1];
+    f32 z = node->max[2] - node->min[2];
+    return x*y + y*z + z*x;
 }
 
-void iVG_InputUpdate() {
-    VM2_Set(mouse_delta, 0, 0);
-    iVG_PollEvents();
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
-	glfwSetWindowShouldClose(window, true);
+// Recomputes height and bounds of every node from index up to the root
+static void iVG_ObjectTreeRefit(u32 index) {
+    ObjectNode* nodes = object_tree.nodes;
+    while (index) {
+	index = iVG_ObjectTreeBalance(index);
+	ObjectNode* node = nodes + index;
+	ObjectNode* a = nodes + node->child[0];
+	ObjectNode* b = nodes + node->child[1];
+	node->height = 1 + (a->height > b->height ? a->height : b->height);
+	iVG_ObjectNodeUnion(node, a, b);
+	index = node->parent;
     }
 }
 
-void iVG_PollEvents() {
-    glfwPollEvents();
+void iVG_ObjectTreeInsert(u32 leaf) {
+    if (!object_tree.root) {
+	object_tree.root = leaf;
+	object_tree.nodes[leaf].parent = 0;
+	return;
+    }
+    
+    // walk down to the sibling that grows the tree the least
+    ObjectNode* nodes = object_tree.nodes;
+    ObjectNode combined;
+    u32 index = object_tree.root;
+    while (nodes[index].height > 0) {
+	ObjectNode* node = nodes + index;
+	iVG_ObjectNodeUnion(&combined, node, nodes + leaf);
+	f32 cost = 2*iVG_ObjectNodeArea(&combined);
+	f32 inheritance = 2*(iVG_ObjectNodeArea(&combined) - iVG_ObjectNodeArea(node));
+	
+	f32 child_cost[2];
+	for (u32 i = 0; i < 2; i++) {
+	    ObjectNode* child = nodes + node->child[i];
+	    iVG_ObjectNodeUnion(&combined, child, nodes + leaf);
+	    child_cost[i] = iVG_ObjectNodeArea(&combined) + inheritance;
+	    if (child->height > 0) child_cost[i] -= iVG_ObjectNodeArea(child);
+	}
+	if (cost < child_cost[0] && cost < child_cost[1]) break;
+	index = child_cost[0] < child_cost[1] ? node->child[0] : node->child[1];
+    }
+    
+    u32 sibling = index;
+    u32 parent = iVG_ObjectTreeNodeAlloc();
+    nodes = object_tree.nodes;
+    u32 grandparent = nodes[sibling].parent;
+    nodes[parent].parent = grandparent;
+    nodes[parent].child[0] = sibling;
+    nodes[parent].child[1] = leaf;
+    nodes[parent].height = nodes[sibling].height + 1;
+    iVG_ObjectNodeUnion(nodes + parent, nodes + sibling, nodes + leaf);
+    nodes[sibling].parent = parent;
+    nodes[leaf].parent = parent;
+    
+    if (grandparent) {
+	ObjectNode* node = nodes + grandparent;
+	node->child[node->child[0] == sibling ? 0 : 1] = parent;
+    } else {
+	object_tree.root = parent;
+    }
+    iVG_ObjectTreeRefit(grandparent);
 }
 
-void iVG_VertexColoredGet(f32* point, f32* color, f32* out) {
-    VM3_Copy(out, point);
-    VRGBA_Copy(out+dims, color);
+void iVG_ObjectTreeRemove(u32 leaf) {
+    ObjectNode* nodes = object_tree.nodes;
+    if (leaf == object_tree.root) {
+	object_tree.root = 0;
+	return;
+    }
+    
+    u32 parent = nodes[leaf].parent;
+    u32 grandparent = nodes[parent].parent;
+    u32 sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+    nodes[leaf].parent = 0;
+    nodes[sibling].parent = grandparent;
+    iVG_ObjectTreeNodeFree(parent);
+    
+    if (grandparent) {
+	ObjectNode* node = nodes + grandparent;
+	node->child[node->child[0] == parent ? 0 : 1] = sibling;
+	iVG_ObjectTreeRefit(grandparent);
+    } else {
+	object_tree.root = sibling;
+    }
 }
 
-void iVG_GLShaderProjectionUpdate() {
-    u32 projection_loc = glGetUniformLocation(shader_current, "projection");
-    glUniformMatrix4fv(projection_loc, 1, GL_TRUE, matrix_projection);
+// Rotates the taller child of a up when the heights of its children
+// differ by more than one. Returns the node now in the place of a.
+u32 iVG_ObjectTreeBalance(u32 a_index) {
+    ObjectNode* nodes = object_tree.nodes;
+    ObjectNode* a = nodes + a_index;
+    if (a->height < 2) return a_index;
+    
+    int32_t balance = nodes[a->child[1]].height - nodes[a->child[0]].height;
+    if (balance >= -1 && balance <= 1) return a_index;
+    
+    // up is the child that rises, stay is the one that stays under a
+    u32 side = balance > 1 ? 1 : 0;
+    u32 up_index = a->child[side];
+    ObjectNode* up = nodes + up_index;
+    ObjectNode* stay = nodes + a->child[1 - side];
+    
+    // the taller grandchild stays under up, the other one moves to a
+    u32 tall_index = up->child[0];
+    u32 short_index = up->child[1];
+    if (nodes[tall_index].height < nodes[short_index].height) {
+	tall_index = up->child[1];
+	short_index = up->child[0];
+    }
+    ObjectNode* tall = nodes + tall_index;
+    ObjectNode* shorter = nodes + short_index;
+    
+    up->parent = a->parent;
+    a->parent = up_index;
+    if (up->parent) {
+	ObjectNode* node = nodes + up->parent;
+	node->child[node->child[0] == a_index ? 0 : 1] = up_index;
+    } else {
+	object_tree.root = up_index;
+    }
+    
+    up->child[0] = a_index;
+    up->child[1] = tall_index;
+    a->child[side] = short_index;
+    shorter->parent = a_index;
+    
+    iVG_ObjectNodeUnion(a, stay, shorter);
+    a->height = 1 + (stay->height > shorter->height ? stay->height : shorter->height);
+    iVG_ObjectNodeUnion(up, a, tall);
+    up->height = 1 + (a->height > tall->height ? a->height : tall->height);
+    return up_index;
 }
 
-void iVG_GLPerspectiveUpdate() {
-    f32 size[2];
-    VG_WindowSizeGet(size);
-    VM44_ProjectionPerspective(matrix_projection, camera.fov, size[0]/size[1], 0.1, 100);
+// Walks the tree against the frustum and pushes the objects in view as
+// instances of their models. planes has a bit for every frustum plane a
+// node still straddles, subtrees fully inside one stop testing it. Leaves
+// are tested against the occlusion buffer on their own.
+void iVG_ObjectTreeQuery() {
+    if (!object_tree.root) return;
+    
+    // a depth first walk never holds more than one node per level plus one
+    u32 depth = object_tree.nodes[object_tree.root].height + 2;
+    if (object_tree.stack_size < depth) {
+	object_tree.stack_size = depth;
+	object_tree.stack = realloc(object_tree.stack, depth*sizeof(ObjectTreeVisit));
+    }
+    u32 count = 0;
+    object_tree.stack[count++] = (ObjectTreeVisit){object_tree.root, frustum_culling ? 0x3F : 0};
+    while (count) {
+	ObjectTreeVisit visit = object_tree.stack[--count];
+	ObjectNode* node = object_tree.nodes + visit.node;
+	
+	f32 center[3], extent[3];
+	for (u32 k = 0; k < 3; k++) {
+	    center[k] = (node->min[k] + node->max[k])*0.5f;
+	    extent[k] = (node->max[k] - node->min[k])*0.5f;
+	}
+	b8 outside = false;
+	for (u32 plane = 0; plane < 6 && !outside; plane++) {
+	    if (!(visit.planes & (1u << plane))) continue;
+	    f32 distance = frustum_planes[3][plane];
+	    f32 radius = 0;
+	    for (u32 k = 0; k < 3; k++) {
+		distance += frustum_planes[k][plane]*center[k];
+		radius += fabsf(frustum_planes[k][plane])*extent[k];
+	    }
+	    if (distance < -radius) outside = true;
+	    if (distance >= radius) visit.planes &= ~(1u << plane);
+	}
+	if (outside) continue;
+	
+	if (node->height == 0) {
+	    Object* object = object_arena.base + node->object;
+	    Model* model = model_arena.base + object->model;
+	    if (occlusion.ready && !model->occluder && !iVG_OcclusionBoxVisible(model, object->rows)) continue;
+	    u32 lod = 0;
+	    if (model->lod_count > 1) {
+		f32 sphere_center[3], radius;
+		iVG_InstanceSphereGet(model, object->rows, sphere_center, &radius);
+		lod = iVG_LodSelect(model, sphere_center, radius);
+	    }
+	    void* instance = iVG_ModelInstancesPush(model, lod, 1);
+	    iVG_InstanceStore(instance, object->rows, object->transform.position,
+			      object->transform.rotation, object->transform.size);
+	    model->objects_drawn++;
+	    model->depth_nearest = fminf(model->depth_nearest, iVG_ViewDepthGet(object->transform.position));
+	    continue;
+	}
+	object_tree.stack[count++] = (ObjectTreeVisit){node->child[0], visit.planes};
+	object_tree.stack[count++] = (ObjectTreeVisit){node->child[1], visit.planes};
+    }
 }
 
-void iVG_GLLightUpdate() {
+// JOBS
+void VG_JobSubmit(JobFunction function, void* data, JobCounter* counter) {
+    Job job = {function, data, counter};
+    atomic_fetch_add(&counter->pending, 1);
     
+    JobQueue* queue = job_pool.queues + job_thread;
+    pthread_mutex_lock(&queue->lock);
+    b8 full = queue->bottom - queue->top == JOB_QUEUE_CAPACITY;
+    if (!full) {
+	queue->jobs[queue->bottom % JOB_QUEUE_CAPACITY] = job;
+	queue->bottom++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (full) {
+	iVG_JobRun(&job);
+	return;
+    }
+    
+    atomic_fetch_add(&job_pool.queued, 1);
+    pthread_mutex_lock(&job_pool.sleep_lock);
+    pthread_cond_signal(&job_pool.wake);
+    pthread_mutex_unlock(&job_pool.sleep_lock);
 }
 
-void iVG_GLUniformVec3Set(char* name, f32* vec) {
-    u32 loc = glGetUniformLocation(shader_current, name);
-    glUniform3fv(loc, 1, vec);
+void VG_JobWait(JobCounter* counter) {
+    while (atomic_load(&counter->pending)) {
+	Job job;
+	if (iVG_JobTake(&job)) {
+	    iVG_JobRun(&job);
+	} else {
+	    sched_yield();
+	}
+    }
 }
 
-void iVG_GLUniformIntSet(char *name, int i) {
-    u32 loc = glGetUniformLocation(shader_current, name);
-    glUniform1i(loc, i);
+void iVG_JobPoolInit(u32 threads) {
+    if (threads < 1) threads = 1;
+    job_pool.count = threads;
+    job_pool.queues = malloc(threads*sizeof(JobQueue));
+    for (u32 i = 0; i < threads; i++) {
+	pthread_mutex_init(&job_pool.queues[i].lock, NULL);
+	job_pool.queues[i].top = 0;
+	job_pool.queues[i].bottom = 0;
+    }
+    atomic_init(&job_pool.queued, 0);
+    pthread_mutex_init(&job_pool.sleep_lock, NULL);
+    pthread_cond_init(&job_pool.wake, NULL);
+    job_pool.quit = false;
+    job_thread = 0;
+    
+    job_pool.threads = malloc(threads*sizeof(pthread_t));
+    for (u32 i = 1; i < threads; i++) {
+	if (pthread_create(job_pool.threads + i, NULL, iVG_JobWorker, (void*)(uintptr_t)i)) {
+	    printf("ERROR: Unable to start job thread\n");
+	    exit(1);
+	}
+    }
 }
 
+void iVG_JobPoolDestroy() {
+    pthread_mutex_lock(&job_pool.sleep_lock);
+    job_pool.quit = true;
+    pthread_cond_broadcast(&job_pool.wake);
+    pthread_mutex_unlock(&job_pool.sleep_lock);
+    for (u32 i = 1; i < job_pool.count; i++) {
+	pthread_join(job_pool.threads[i], NULL);
+    }
+    
+    for (u32 i = 0; i < job_pool.count; i++) {
+	pthread_mutex_destroy(&job_pool.queues[i].lock);
+    }
+    pthread_mutex_destroy(&job_pool.sleep_lock);
+    pthread_cond_destroy(&job_pool.wake);
+    free(job_pool.queues);
+    free(job_pool.threads);
+}
 
-void iVG_GLUniformF32Set(char *name, f32 f) {
-    u32 loc = glGetUniformLocation(shader_current, name);
-    glUniform1f(loc, f);
+// Takes the newest job of the own queue, or steals the oldest one of another
+b8 iVG_JobTake(Job* job) {
+    for (u32 i = 0; i < job_pool.count; i++) {
+	u32 index = (job_thread + i) % job_pool.count;
+	JobQueue* queue = job_pool.queues + index;
+	pthread_mutex_lock(&queue->lock);
+	b8 found = queue->bottom != queue->top;
+	if (found && index == job_thread) {
+	    queue->bottom--;
+	    *job = queue->jobs[queue->bottom % JOB_QUEUE_CAPACITY];
+	} else if (found) {
+	    *job = queue->jobs[queue->top % JOB_QUEUE_CAPACITY];
+	    queue->top++;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	if (found) {
+	    atomic_fetch_sub(&job_pool.queued, 1);
+	    return true;
+	}
+    }
+    return false;
 }
 
-void iVG_GLShaderCameraUpdate() {
-    u32 view_loc = glGetUniformLocation(shader_current, "view");
-    iVG_GLUniformVec3Set("cameraPos", camera.position);
-    glUniformMatrix4fv(view_loc, 1, GL_TRUE, matrix_view);
+void iVG_JobRun(Job* job) {
+    job->function(job->data);
+    atomic_fetch_sub(&job->counter->pending, 1);
 }
 
-void iVG_GLCameraUpdate() {
-    f32 out[16];
-    VM44_V3A3(camera.position, camera.rotation, matrix_view);
-    VM44_InverseO(matrix_view, out);
-    VM44_Copy(matrix_view, out);
+void* iVG_JobWorker(void* index) {
+    job_thread = (u32)(uintptr_t)index;
+    while (true) {
+	Job job;
+	if (iVG_JobTake(&job)) {
+	    iVG_JobRun(&job);
+	    continue;
+	}
+	
+	pthread_mutex_lock(&job_pool.sleep_lock);
+	while (!job_pool.quit && atomic_load(&job_pool.queued) == 0) {
+	    pthread_cond_wait(&job_pool.wake, &job_pool.sleep_lock);
+	}
+	b8 quit = job_pool.quit;
+	pthread_mutex_unlock(&job_pool.sleep_lock);
+	if (quit) return NULL;
+    }
 }
 
-void iVG_GLShaderLightUpdate() {
-    char name[50];
-    for(u32 i = 0; i < DIRECT_LIGHT_MAX_COUNT; i++) {
-	snprintf(name, 49, "directLights[%d].direction", i);
-	iVG_GLUniformVec3Set(name, directLights[i].direction);
-	snprintf(name, 49, "directLights[%d].color", i);
-	iVG_GLUniformVec3Set(name, directLights[i].color);
+// INSTANCE PREPARATION
+// Turns the pending transforms of every model into instances. All ring
+// space of single level models is reserved first since growing the ring
+// moves it, then workers compose, cull and write the chunks, then the runs
+// are fixed up around whatever culling left empty. Models with LODs claim
+// their levels after that and a second round of jobs moves their instances.
+void iVG_InstancesPrepare() {
+    u32 chunk_count = 0;
+    size_t scratch_size = 0;
+    for (u32 i = 1; i < model_arena.position; i++) {
+	Model* model = model_arena.base + i;
+	if (!model->pending_count) continue;
+	
+	u32 first = 0;
+	if (model->lod_count == 1) {
+	    iVG_ModelInstancesPush(model, 0, model->pending_count);
+	    InstanceRun* run = model->lods[0].runs + model->lods[0].run_count - 1;
+	    first = run->first + run->count - model->pending_count;
+	} else {
+	    scratch_size += (size_t)instance_stride*model->pending_count;
+	}
+	for (u32 offset = 0; offset < model->pending_count; offset += INSTANCE_CHUNK_SIZE) {
+	    if (chunk_count == instance_chunk_capacity) {
+		instance_chunk_capacity = instance_chunk_capacity ? instance_chunk_capacity*2 : 64;
+		instance_chunks = realloc(instance_chunks, sizeof(InstanceChunk)*instance_chunk_capacity);
+	    }
+	    InstanceChunk* chunk = instance_chunks + chunk_count++;
+	    chunk->model = model;
+	    chunk->first = first + offset;
+	    chunk->offset = offset;
+	    chunk->count = model->pending_count - offset;
+	    if (chunk->count > INSTANCE_CHUNK_SIZE) chunk->count = INSTANCE_CHUNK_SIZE;
+	    chunk->written = 0;
+	    chunk->depth_nearest = FLT_MAX;
+	    chunk->scratch = NULL;
+	}
+    }
+    if (!chunk_count) return;
+    
+    if (scratch_size > instance_scratch_capacity) {
+	instance_scratch_capacity = scratch_size;
+	instance_scratch = realloc(instance_scratch, instance_scratch_capacity);
+    }
+    u8* scratch = instance_scratch;
+    for (u32 i = 0; i < chunk_count; i++) {
+	InstanceChunk* chunk = instance_chunks + i;
+	if (chunk->model->lod_count == 1) continue;
+	chunk->scratch = scratch;
+	scratch += (size_t)instance_stride*chunk->count;
+    }
+    
+    JobCounter counter = {0};
+    for (u32 i = 0; i < chunk_count; i++) {
+	VG_JobSubmit(iVG_InstanceChunkJob, instance_chunks + i, &counter);
+    }
+    VG_JobWait(&counter);
+    
+    b8 scatter = false;
+    for (u32 i = 0; i < chunk_count; i++) {
+	InstanceChunk* chunk = instance_chunks + i;
+	Model* model = chunk->model;
+	b8 last = chunk->offset + chunk->count >= model->pending_count;
+	model->instances_culled += chunk->count - chunk->written;
+	model->depth_nearest = fminf(model->depth_nearest, chunk->depth_nearest);
+	if (chunk->scratch) {
+	    // ring positions are kept relative to the region, growing the ring keeps those
+	    for (u32 lod = 0; lod < model->lod_count; lod++) {
+		if (!chunk->lod_written[lod]) continue;
+		u8* instances = iVG_ModelInstancesPush(model, lod, chunk->lod_written[lod]);
+		chunk->lod_first[lod] = (instances - instance_ring.mapped)/instance_stride - iVG_InstanceRingBaseGet();
+		scatter = true;
+	    }
+	} else {
+	    if (chunk->offset == 0) iVG_ModelInstancesPop(model, 0, model->pending_count);
+	    // pushing again claims the slots that were written
+	    iVG_ModelInstancesPush(model, 0, chunk->written);
+	    if (!last) iVG_ModelInstancesSkip(model, 0, chunk->count - chunk->written);
+	}
+	if (last) model->pending_count = 0;
     }
-    for (u32 i = 0; i < POINT_LIGHT_MAX_COUNT; i++) {
-	snprintf(name, 49, "pointLights[%d].position", i);
-	iVG_GLUniformVec3Set(name, pointLights[i].position);
-	snprintf(name, 49, "pointLights[%d].color", i);
-	iVG_GLUniformVec3Set(name, pointLights[i].color);
+    if (!scatter) return;
+    
+    for (u32 i = 0; i < chunk_count; i++) {
+	InstanceChunk* chunk = instance_chunks + i;
+	if (chunk->scratch && chunk->written) VG_JobSubmit(iVG_InstanceChunkScatterJob, chunk, &counter);
     }
-    for (u32 i = 0; i < FLASH_LIGHT_MAX_COUNT; i++) {
-	snprintf(name, 49, "flashLights[%d].position", i);
-	iVG_GLUniformVec3Set(name, flashLights[i].position);
-	snprintf(name, 49, "flashLights[%d].direction", i);
-	iVG_GLUniformVec3Set(name, flashLights[i].direction);
-	snprintf(name, 49, "flashLights[%d].color", i);
-	iVG_GLUniformVec3Set(name, flashLights[i].color);
-	snprintf(name, 49, "flashLights[%d].angle", i);
-	iVG_GLUniformF32Set(name, flashLights[i].angle);
-	snprintf(name, 49, "flashLights[%d].cutoff", i);
-	iVG_GLUniformF32Set(name, flashLights[i].cutoff);
+    VG_JobWait(&counter);
+}
+
+void iVG_InstanceChunkJob(void* data) {
+    InstanceChunk* chunk = data;
+    Model* model = chunk->model;
+    f32 (*pos)[3] = model->pending_pos + chunk->offset;
+    f32 (*rotation)[3] = model->pending_rotation + chunk->offset;
+    f32 (*size)[3] = model->pending_size + chunk->offset;
+    if (chunk->scratch) {
+	chunk->written = iVG_InstancesWrite(chunk->scratch, chunk->count, pos, rotation, size,
+					    model, frustum_culling, chunk->lods, &chunk->depth_nearest);
+	memset(chunk->lod_written, 0, sizeof(chunk->lod_written));
+	for (u32 i = 0; i < chunk->written; i++) {
+	    chunk->lod_written[chunk->lods[i]]++;
+	}
+    } else {
+	u8* out = instance_ring.mapped + (size_t)instance_stride*(iVG_InstanceRingBaseGet() + chunk->first);
+	chunk->written = iVG_InstancesWrite(out, chunk->count, pos, rotation, size,
+					    model, frustum_culling, NULL, &chunk->depth_nearest);
     }
 }
 
-void iVG_KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-    if (action == GLFW_PRESS) {
-	keys_just_pressed[key] = true;
-	keys_pressed[key] = true;
-    } else if (action == GLFW_RELEASE) {
-	keys_pressed[key] = false;
+// Moves the instances of a chunk from scratch to the ring slots of their level
+void iVG_InstanceChunkScatterJob(void* data) {
+    InstanceChunk* chunk = data;
+    u8* region = instance_ring.mapped + (size_t)instance_stride*iVG_InstanceRingBaseGet();
+    for (u32 i = 0; i < chunk->written; i++) {
+	u32 index = chunk->lod_first[chunk->lods[i]]++;
+	memcpy(region + (size_t)instance_stride*index, chunk->scratch + (size_t)instance_stride*i, instance_stride);
     }
 }
 
-void iVG_KeysJustPressedClear() {
-    memset(keys_just_pressed, 0, 512*sizeof(b8));
+// Distance in front of the camera, negative behind it
+f32 iVG_ViewDepthGet(f32* pos) {
+    return -(matrix_view[8]*pos[0] + matrix_view[9]*pos[1] + matrix_view[10]*pos[2] + matrix_view[11]);
 }
 
-void iVG_MouseCallback(GLFWwindow* window, f64 x, f64 y) {
- 
-    if (mouse_first) {
-	VM2_Set(mouse_last, x, y);
-	mouse_first = false;
+// RENDER QUEUE
+u64 iVG_RenderKeyCompose(Model* model) {
+    u32 texture = model->texture ? model->texture : texture_default;
+    u32 material = 0;
+    u32 bits[3] = {5, 6, 5};
+    for (u32 k = 0; k < 3; k++) {
+	f32 channel = fminf(fmaxf(model->color[k], 0), 1);
+	material = (material << bits[k]) | (u32)lrintf(channel*((1 << bits[k]) - 1));
     }
-    
-    mouse_delta[0] = x - mouse_last[0];
-    mouse_delta[1] = y - mouse_last[1];
-    
-    
-    VM2_Set(mouse_last, x, y);
+    u32 depth = 0xFFFF;
+    if (model->depth_nearest < RENDER_KEY_DEPTH_FAR) {
+	depth = (u32)(fmaxf(model->depth_nearest, 0)/RENDER_KEY_DEPTH_FAR*0xFFFF);
+    }
+    return (u64)(model->shader & 0xFFFF) << 48 | (u64)(texture & 0xFFFF) << 32
+	| (u64)material << 16 | depth;
 }
 
-void iVG_ModelArenaInit(u32 size) {
-    model_arena.position = 1;
-    if (size < 2) size = 2;
-    model_arena.size = size;
-    model_arena.base = malloc(size*sizeof(Model));
+void iVG_RenderQueuePush(u64 key, u32 model_handle) {
+    if (render_queue.count == render_queue.capacity) {
+	render_queue.capacity = render_queue.capacity ? render_queue.capacity*2 : 64;
+	render_queue.items = realloc(render_queue.items, sizeof(RenderItem)*render_queue.capacity);
+	render_queue.scratch = realloc(render_queue.scratch, sizeof(RenderItem)*render_queue.capacity);
+    }
+    render_queue.items[render_queue.count++] = (RenderItem){key, model_handle};
 }
 
-u32 iVG_ModelArenaBump() {
-    u32 temp = model_arena.position;
-    model_arena.position++;
-    if (model_arena.position >= model_arena.size) {
-	model_arena.size *=2;
-	model_arena.base = realloc(model_arena.base, model_arena.size*sizeof(Model));
+// Least significant digit radix sort, a byte per pass. Passes where every
+// key has the same byte are skipped, which is most of them in practice.
+void iVG_RenderQueueSort() {
+    u32 count = render_queue.count;
+    if (count < 2) return;
+    
+    for (u32 shift = 0; shift < 64; shift += 8) {
+	u32 histogram[256] = {0};
+	for (u32 i = 0; i < count; i++) {
+	    histogram[(render_queue.items[i].key >> shift) & 0xFF]++;
+	}
+	if (histogram[(render_queue.items[0].key >> shift) & 0xFF] == count) continue;
+	
+	u32 offset = 0;
+	for (u32 digit = 0; digit < 256; digit++) {
+	    u32 size = histogram[digit];
+	    histogram[digit] = offset;
+	    offset += size;
+	}
+	for (u32 i = 0; i < count; i++) {
+	    RenderItem item = render_queue.items[i];
+	    render_queue.scratch[histogram[(item.key >> shift) & 0xFF]++] = item;
+	}
+	RenderItem* swap = render_queue.items;
+	render_queue.items = render_queue.scratch;
+	render_queue.scratch = swap;
     }
-    return temp;
 }
 
-Model* iVG_ModelArenaPointerGet(u32 model_handle) {
-    if (model_handle > model_arena.position) {
-	assert(false && "Model handle is not valid (too big)");
+void iVG_RenderQueueSubmit() {
+    if (geometry_pool.VAO) {
+	iVG_RenderQueueSubmitIndirect();
+	return;
+    }
+
+    // the program, as the one behind a handle changes once it is linked
+    // or the light counts pick another variant
+    u32 material_program = 0;
+    f32 material_color[3];
+    for (u32 i = 0; i < render_queue.count; i++) {
+	Model* model = iVG_ModelArenaPointerGet(render_queue.items[i].model);
+	VG_ShaderUse(model->shader);
+	iVG_TextureUse(model->texture ? model->texture : texture_default);
+	u32 program = iVG_ShaderVariantCurrentGet()->program;
+	if (material_program != program || memcmp(material_color, model->color, sizeof(material_color))) {
+	    iVG_GLMaterialColorSet(model->color);
+	    material_program = program;
+	    VM3_Copy(material_color, model->color);
+	}
+	iVG_GLPositionDequantizeSet(model);
+	
+	iVG_GLModelRenderInstances(model);
+	iVG_GLModelRenderStatic(model);
     }
-    return model_arena.base + model_handle;
 }
 
-void iVG_ModelArenaDestroy() {
-    free(model_arena.base);
+void iVG_RenderQueueDestroy() {
+    free(render_queue.items);
+    free(render_queue.scratch);
+    render_queue.items = NULL;
+    render_queue.scratch = NULL;
+    render_queue.count = 0;
+    render_queue.capacity = 0;
 }
 
+// GEOMETRY POOL
+void iVG_GeometryPoolInit() {
+    geometry_pool.VAO = iVG_GLVertexArrayNew();
+    geometry_pool.vertex_capacity = 1 << 16;
+    geometry_pool.index_capacity = 1 << 18;
+    geometry_pool.vertex_buffer = iVG_GeometryPoolBufferGrow(0, 0, iVG_VertexStrideGet()*geometry_pool.vertex_capacity);
+    geometry_pool.index_buffer = iVG_GeometryPoolBufferGrow(0, 0, sizeof(u32)*geometry_pool.index_capacity);
+    iVG_GeometryPoolAttach();
+    glGenBuffers(1, &geometry_pool.indirect_buffer);
+}
 
-void iVG_TextureArenaInit(u32 size) {
-    texture_arena.position = 1;
-    if (size < 2) size = 2;
-    texture_arena.size = size;
-    texture_arena.base = malloc(size*sizeof(u32));
+void iVG_GeometryPoolDestroy() {
+    if (!geometry_pool.VAO) return;
+    iVG_GLVertexArrayDestroy(geometry_pool.VAO);
+    glDeleteBuffers(1, &geometry_pool.vertex_buffer);
+    glDeleteBuffers(1, &geometry_pool.index_buffer);
+    glDeleteBuffers(1, &geometry_pool.indirect_buffer);
+    free(geometry_pool.commands);
+    free(geometry_pool.colors);
+    free(geometry_pool.position_dequantize);
+    free(geometry_pool.command_models);
+    memset(&geometry_pool, 0, sizeof(geometry_pool));
 }
 
-u32 iVG_TextureArenaBump() {
-    u32 temp = texture_arena.position;
-    texture_arena.position++;
-    if (texture_arena.position >= texture_arena.size) {
-	texture_arena.size *=2;
-	texture_arena.base = realloc(texture_arena.base, texture_arena.size*sizeof(u32));
+void iVG_GeometryPoolAttach() {
+    iVG_GLVertexArrayBind(geometry_pool.VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, geometry_pool.vertex_buffer);
+    iVG_GLVertexAttributesSet();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, geometry_pool.index_buffer);
+    iVG_GLVertexArrayUnbind();
+}
+
+// Returns a new buffer of size bytes holding the first used bytes of buffer,
+// which is deleted
+u32 iVG_GeometryPoolBufferGrow(u32 buffer, u32 used, u32 size) {
+    u32 grown;
+    glGenBuffers(1, &grown);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+    glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+    if (buffer) {
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, used);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glDeleteBuffers(1, &buffer);
     }
-    return temp;
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    return grown;
 }
-    
-u32* iVG_TextureArenaPointerGet(u32 texture_handle) {
-    if (texture_handle > texture_arena.position) {
-	assert(false && "Texture handle is not valid (too big)");
+
+// Appends the vertices and indices, the model gets the pool VAO and its
+// base vertex. Returns where the indices start in the pool
+// Makes room for a mesh at the end of the pool and points model at it
+u32 iVG_GeometryPoolReserve(Model* model, u32 vertex_count, u32 index_count) {
+    GeometryPool* pool = &geometry_pool;
+    b8 grown = false;
+    if (pool->vertex_count + vertex_count > pool->vertex_capacity) {
+	u32 capacity = pool->vertex_capacity;
+	while (capacity < pool->vertex_count + vertex_count) capacity *= 2;
+	u32 stride = iVG_VertexStrideGet();
+	pool->vertex_buffer = iVG_GeometryPoolBufferGrow(pool->vertex_buffer, stride*pool->vertex_count,
+							 stride*capacity);
+	pool->vertex_capacity = capacity;
+	grown = true;
     }
-    return texture_arena.base + texture_handle;
+    if (pool->index_count + index_count > pool->index_capacity) {
+	u32 capacity = pool->index_capacity;
+	while (capacity < pool->index_count + index_count) capacity *= 2;
+	pool->index_buffer = iVG_GeometryPoolBufferGrow(pool->index_buffer, sizeof(u32)*pool->index_count,
+							sizeof(u32)*capacity);
+	pool->index_capacity = capacity;
+	grown = true;
+    }
+    if (grown) iVG_GeometryPoolAttach();
+    
+    u32 first_index = pool->index_count;
+    model->VAO = pool->VAO;
+    model->base_vertex = pool->vertex_count;
+    pool->vertex_count += vertex_count;
+    pool->index_count += index_count;
+    return first_index;
 }
 
-void iVG_TextureArenaDestroy() {
-    free(texture_arena.base);
+void iVG_GeometryPoolCommandPush(u32 model_handle, u32 lod, u32 count, u32 first) {
+    GeometryPool* pool = &geometry_pool;
+    if (pool->command_count == pool->command_capacity) {
+	pool->command_capacity = pool->command_capacity ? pool->command_capacity*2 : 64;
+	pool->commands = realloc(pool->commands, sizeof(DrawCommand)*pool->command_capacity);
+	pool->colors = realloc(pool->colors, sizeof(f32[3])*pool->command_capacity);
+	pool->position_dequantize = realloc(pool->position_dequantize, sizeof(f32[4])*pool->command_capacity);
+	pool->command_models = realloc(pool->command_models, sizeof(u32)*pool->command_capacity);
+    }
+    Model* model = iVG_ModelArenaPointerGet(model_handle);
+    pool->commands[pool->command_count] = (DrawCommand){
+	.count = model->lods[lod].index_count,
+	.instance_count = count,
+	.first_index = model->lods[lod].first_index,
+	.base_vertex = model->base_vertex,
+	.base_instance = first,
+    };
+    VM3_Copy(pool->colors[pool->command_count], model->color);
+    memcpy(pool->position_dequantize[pool->command_count], model->position_dequantize, sizeof(f32[4]));
+    pool->command_models[pool->command_count] = model_handle;
+    pool->command_count++;
 }
 
-void iVG_TextureUse(u32 texture_handle) {
-    if (texture_handle == texture_current) return;
-    texture_current = texture_handle;
-    u32* texture = iVG_TextureArenaPointerGet(texture_handle);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, *texture);
-    iVG_GLUniformIntSet("main_texture", 0);
+// Turns every run in the queue into a command, uploads them at once and
+// draws each shader and texture group with glMultiDrawElementsIndirect.
+// Static sets sit in their own buffers and are drawn one by one after.
+void iVG_RenderQueueSubmitIndirect() {
+    GeometryPool* pool = &geometry_pool;
+    u32 base = iVG_InstanceRingBaseGet();
+    pool->command_count = 0;
+    for (u32 i = 0; i < render_queue.count; i++) {
+	Model* model = iVG_ModelArenaPointerGet(render_queue.items[i].model);
+	for (u32 lod = 0; lod < model->lod_count; lod++) {
+	    ModelLod* level = model->lods + lod;
+	    for (u32 j = 0; j < level->run_count; j++) {
+		InstanceRun* run = level->runs + j;
+		if (run->count) iVG_GeometryPoolCommandPush(render_queue.items[i].model, lod, run->count, base + run->first);
+	    }
+	}
+    }
+    
+    iVG_GLVertexArrayBind(pool->VAO);
+    if (pool->command_count) {
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, pool->indirect_buffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawCommand)*pool->command_count, pool->commands, GL_STREAM_DRAW);
+    }
+    for (u32 first = 0; first < pool->command_count; ) {
+	Model* model = iVG_ModelArenaPointerGet(pool->command_models[first]);
+	u32 texture = model->texture ? model->texture : texture_default;
+	u32 last = first + 1;
+	while (last < pool->command_count && last - first < GEOMETRY_POOL_DRAWS_MAX) {
+	    Model* next = iVG_ModelArenaPointerGet(pool->command_models[last]);
+	    if (next->shader != model->shader || (next->texture ? next->texture : texture_default) != texture) break;
+	    last++;
+	}
+	
+	VG_ShaderUse(model->shader);
+	iVG_TextureUse(texture);
+	GLint* slots = iVG_ShaderVariantCurrentGet()->slots;
+	glUniform3fv(slots[UNIFORM_DRAW_COLORS], last - first, pool->colors[first]);
+	if (vertex_quantization) {
+	    glUniform4fv(slots[UNIFORM_DRAW_POSITION_DEQUANTIZE], last - first, pool->position_dequantize[first]);
+	}
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(sizeof(DrawCommand)*first), last - first, 0);
+	first = last;
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    iVG_GLVertexArrayUnbind();
+    
+    for (u32 i = 0; i < render_queue.count; i++) {
+	Model* model = iVG_ModelArenaPointerGet(render_queue.items[i].model);
+	if (!model->static_instances) continue;
+	VG_ShaderUse(model->shader);
+	iVG_TextureUse(model->texture ? model->texture : texture_default);
+	iVG_GLMaterialColorSet(model->color);
+	iVG_GLPositionDequantizeSet(model);
+	iVG_GLModelRenderStatic(model);
+    }
 }
 
-b8 iVG_TimeDeltaTargetReached() {
-    time_current = glfwGetTime();
-    return (time_current - time_previous) >= time_delta_target;
+b8 iVG_GLExtensionSupported(const char* name) {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++) {
+	if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0) return true;
+    }
+    return false;
 }
 
+// Single draws have a gl_DrawIDARB of zero, so with the pool they read the first color
+void iVG_GLMaterialColorSet(f32* color) {
+    if (geometry_pool.VAO) {
+	iVG_GLUniformVec3Set(UNIFORM_DRAW_COLORS, color);
+    } else {
+	iVG_GLUniformVec3Set(UNIFORM_MATERIAL_COLOR, color);
+    }
+}
 
-void iVG_ModelInstancesClear(Model* model) {
-    free(model->instances);
-    model->instance_count = 0;
-    model->instance_capacity = 0;
-    model->instances = NULL;
+// Like the color, the pool slot is the one single draws read
+void iVG_GLPositionDequantizeSet(Model* model) {
+    if (!vertex_quantization) return;
+    GLint* slots = iVG_ShaderVariantCurrentGet()->slots;
+    UniformSlot slot = geometry_pool.VAO ? UNIFORM_DRAW_POSITION_DEQUANTIZE : UNIFORM_POSITION_DEQUANTIZE;
+    glUniform4fv(slots[slot], 1, model->position_dequantize);
 }
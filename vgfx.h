@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
 #include "include/vmath/vmath.h"
 #define VG_KEY_SPACE 32
 #define VG_KEY_LEFT_SHIFT 340
@@ -9,6 +10,22 @@
 #define VG_KEY_D 68
 
 #define VG_WINDOW_FLAG_VSYNC (1)
+// Smaller instance records: 48 byte 3x4 matrix, or 32 byte position,
+// quaternion and scale. Only cuts upload size, drawing stays the same.
+#define VG_WINDOW_FLAG_INSTANCE_AFFINE (1 << 1)
+#define VG_WINDOW_FLAG_INSTANCE_TRS    (1 << 2)
+// Threads preparing instances, the calling one included. Without it
+// there is one per core
+#define VG_WINDOW_FLAG_THREADS(count) ((u32)(count) << 24)
+// All meshes share one vertex and index buffer and a frame is drawn with
+// one multi draw per shader and texture. Shaders then get VG_GEOMETRY_POOL
+// defined and take the model color from drawColors[gl_DrawIDARB]
+#define VG_WINDOW_FLAG_GEOMETRY_POOL (1 << 3)
+// 16 byte vertices: positions as 16 bit fractions of the mesh bounds,
+// normals as 10_10_10_2 and texture coordinates as half floats. Shaders
+// then get VG_QUANTIZED_VERTICES defined and place aPos with
+// positionDequantize, or drawPositionDequantize[gl_DrawIDARB] in the pool
+#define VG_WINDOW_FLAG_QUANTIZED_VERTICES (1 << 4)
 
 // INITIALIZATION AND CLOSING
 void VG_WindowOpen(char* name, f32* size, u32 flags);
@@ -27,6 +44,18 @@ b8 VG_VSyncGet();
 
 void VG_FPSMaxSet(u32);
 
+// JOBS
+// Jobs run on the vgfx worker threads. A counter tracks the unfinished
+// jobs submitted with it and has to start at zero
+typedef void (*JobFunction)(void* data);
+typedef struct {
+    atomic_uint pending;
+} JobCounter;
+
+void VG_JobSubmit(JobFunction function, void* data, JobCounter* counter);
+// Runs queued jobs on the calling thread until the counter reaches zero
+void VG_JobWait(JobCounter* counter);
+
 // BACKGROUND COLOR
 void VG_BackgroundColorGet(f32* out);
 
@@ -40,11 +69,50 @@ void VG_WindowSizeUpdate();
 
 
 // SHADERS
-
+// The camera comes in the FrameData block of shaders/shader.vert, bound
+// once a frame for every program. Shaders declaring plain view, projection
+// and cameraPos uniforms instead still get them set while bound
 u32 VG_ShaderLoad(const char* vertex_path, const char* fragment_path);
 
+// Like VG_ShaderLoad, with defines such as "#define FOG 1\n" put after the
+// #version line of both sources. Programs reading the Lights block are also
+// built with VG_DIRECT_LIGHTS, VG_GLOBAL_LIGHTS and VG_CLUSTERED_LIGHTS set
+// to the lights in use, a variant per count that is picked by VG_ShaderUse
+u32 VG_ShaderLoadDefines(const char* vertex_path, const char* fragment_path, const char* defines);
+
+// Starts compiling and returns at once, defines may be NULL. Until the
+// program is linked, draws with it use the default shader, or wait for
+// it when there is no ready default. Compile errors exit when found
+u32 VG_ShaderLoadAsync(const char* vertex_path, const char* fragment_path, const char* defines);
+
+// True once the program is linked, never blocks where the driver has
+// GL_KHR_parallel_shader_compile
+b8 VG_ShaderReady(u32 shader);
+
+void VG_ShaderDefaultSet(u32 shader);
+
 void VG_ShaderUse(u32 shader);
 
+// Linked programs are kept in path and loaded from there instead of being
+// compiled, when the driver still accepts them. NULL turns the cache off
+void VG_ShaderCacheDirSet(const char* path);
+
+// Location of an active uniform of the program, for glUniform* while it is
+// in use. Looked up in a table made at load time, -1 when there is none.
+// Light count variants are separate programs with their own values, and
+// models switch between them as lights come and go or a variant finishes
+// linking, so a value set with glUniform* is only kept by one of them
+int32_t VG_ShaderUniformLocation(u32 shader, const char* name);
+
+// Values kept by the shader and set on every variant it is drawn with,
+// names the program doesn't use are ignored. Matrices are row major
+void VG_ShaderUniformF32Set(u32 shader, const char* name, f32 value);
+void VG_ShaderUniformVec2Set(u32 shader, const char* name, f32 value[static 2]);
+void VG_ShaderUniformVec3Set(u32 shader, const char* name, f32 value[static 3]);
+void VG_ShaderUniformVec4Set(u32 shader, const char* name, f32 value[static 4]);
+void VG_ShaderUniformIntSet(u32 shader, const char* name, int32_t value);
+void VG_ShaderUniformMat4Set(u32 shader, const char* name, f32 value[static 16]);
+
 // FPS
 f64 VG_FPSGet();
 
@@ -70,9 +138,12 @@ void VG_CameraForwardGet(f32* out);
 void VG_CameraRightGet(f32* out);
 
 //LIGHT
+// Lights with a range fade out at that distance and only shade the
+// clusters they reach, a range of 0 lights everything
 typedef struct {
     f32 position[3];
     f32 color[3];
+    f32 range;
 } PointLight;
 
 typedef struct {
@@ -86,6 +157,7 @@ typedef struct {
     f32 color[3];
     f32 angle;
     f32 cutoff;
+    f32 range;
 } FlashLight;
 
 u32 VG_FlashLightCreate();
@@ -95,6 +167,7 @@ u32 VG_FlashLightDestroy();
 u32 VG_DirectLightDestroy();
 u32 VG_PointLightDestroy();
 
+// lights move when more of their kind are created, there is no limit to them
 FlashLight*  VG_FlashLightGet(u32 light);
 DirectLight* VG_DirectLightGet(u32 light);
 PointLight*  VG_PointLightGet(u32 light);
@@ -131,11 +204,72 @@ void VG_MouseDeltaGet(f32* out);
 void VG_MouseGet(f32* out);
 
 // MESHES
+typedef struct {
+    f32 position[3];
+    f32 rotation[3];
+    f32 size[3];
+} InstanceTransform;
+
 u32 VG_ModelNew(char* path, u32 texture, u32 shader);
+
+// Parses an OBJ with the importer behind VG_ModelNew, ignoring its cache,
+// and gives the sizes of the mesh after merging equal corners. False when
+// the file can not be read or a face is broken
+b8 VG_ObjParse(const char* path, u32* vertex_count, u32* index_count);
+
+// OBJ files whose import would need more memory than bytes, about 256 per
+// triangle, are streamed through windows of a fixed size instead, at the
+// cost of LODs and the occluder mesh. 0, the default, imports everything in
+// memory. Faces whose corners index v, vt and vn alike share the vertices,
+// any other file gets a vertex for every triangle corner. Positions,
+// normals and texture coordinates are spilled to files next to the .vgm
+// cache, or to tmpfile() when its directory can not be written to, which
+// may keep them in memory. The GL buffers are still allocated whole
+void VG_ImportBudgetSet(u64 bytes);
+
+// Imported meshes are reordered for the vertex cache and overdraw before
+// they are uploaded and cached, on by default. Caches already written keep
+// the order they were written with
+void VG_MeshOptimizationSet(b8 enabled);
+// Average cache misses per triangle and per vertex of LOD 0 in a simulated
+// 16 entry FIFO cache, [0] as imported and [1] as drawn
+void VG_ModelVertexCacheStatsGet(u32 model_handle, f32* acmr, f32* atvr);
 void VG_ModelInstancesDraw(u32 model_handle);
 void VG_ModelInstancesClear(u32 model_handle);
 void     VG_ModelDrawAt(u32 model_handle, f32 pos[static 3], f32 rotation[static 3], f32 size[static 3]);
+// Same as calling VG_ModelDrawAt count times, each array holds one entry per instance
+void     VG_ModelDrawBatch(u32 model_handle, u32 count, f32 pos[][3], f32 rotation[][3], f32 size[][3]);
 void     VG_ModelColorSet(u32 model_handle, f32 color[static 3]);
+// Frames in a row an instance array has to stay under half its capacity
+// before it is shrunk, 0 keeps the storage forever
+void     VG_InstanceShrinkFramesSet(u32 frames);
+// Instances whose bounding sphere is outside the camera frustum are dropped
+// when submitted, on by default. Static instances are always drawn
+void     VG_FrustumCullingSet(b8 enabled);
+// Models get coarser index buffers at load and every instance is drawn with
+// the one its size on screen calls for. Each step of bias picks a level
+// coarser, negative values keep the detailed ones longer. Starts at 0
+void     VG_LODBiasSet(f32 bias);
+// Instances of occluder models are drawn into a small depth buffer on the CPU
+// first, other instances whose bounding box ends up behind it are dropped.
+// Good occluders are large and simple like floors and walls, back faces
+// don't occlude. Models start as non occluders
+void     VG_ModelOccluderSet(u32 model_handle, b8 occluder);
+// Occlusion culling against the occluder models, on by default
+void     VG_OcclusionCullingSet(b8 enabled);
+// Instances drawn and dropped by culling during the last finished frame
+void     VG_ModelCullStatsGet(u32 model_handle, u32* visible, u32* culled);
+
+// Instances kept on the GPU and drawn with the model every frame until destroyed
+u32      VG_ModelStaticInstancesCreate(u32 model_handle, u32 count, InstanceTransform* transforms);
+void     VG_ModelStaticInstancesUpdate(u32 static_handle, u32 first, u32 count, InstanceTransform* transforms);
+void     VG_ModelStaticInstancesDestroy(u32 static_handle);
+
+// Instances kept in a bounding volume tree and drawn every frame while in
+// view. Moving one only touches the tree once it leaves its padded bounds
+u32      VG_ObjectCreate(u32 model_handle, InstanceTransform* transform);
+void     VG_ObjectTransformSet(u32 object_handle, InstanceTransform* transform);
+void     VG_ObjectDestroy(u32 object_handle);
 
 // DRAWING SHAPES
 